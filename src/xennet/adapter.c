@@ -42,6 +42,7 @@
 #include "adapter.h"
 #include "transmitter.h"
 #include "receiver.h"
+#include "hash.h"
 #include "util.h"
 #include "dbg_print.h"
 #include "assert.h"
@@ -60,18 +61,35 @@ typedef struct _PROPERTIES {
     int lsov6;
     int lrov4;
     int lrov6;
+    int rscv4;
+    int rscv6;
     int rss;
+    int num_rss_queues;
+    int rss_base_proc_number;
+    int max_rss_processors;
+    int rss_profile;
+    int numa_node_id;
+    int copy_break;
+    int tx_copy_break;
+    int tx_max_fragments;
+    int rx_csum_validation;
+    int rx_steering;
 } PROPERTIES, *PPROPERTIES;
 
+#define XENNET_RSS_TABLE_MAX_ENTRIES \
+    (NDIS_RSS_INDIRECTION_TABLE_MAX_SIZE_REVISION_2 / sizeof (PROCESSOR_NUMBER))
+
 typedef struct _XENNET_RSS {
-    BOOLEAN Supported;
-    BOOLEAN HashEnabled;
-    BOOLEAN ScaleEnabled;
-    ULONG   Types;
-    UCHAR   Key[NDIS_RSS_HASH_SECRET_KEY_MAX_SIZE_REVISION_1];
-    ULONG   KeySize;
-    CCHAR   Table[NDIS_RSS_INDIRECTION_TABLE_MAX_SIZE_REVISION_1];
-    ULONG   TableSize;
+    BOOLEAN             Supported;
+    BOOLEAN             BackendHash;
+    BOOLEAN             HashEnabled;
+    BOOLEAN             ScaleEnabled;
+    ULONG               Types;
+    ULONG               SoftwareTypes;
+    UCHAR               Key[NDIS_RSS_HASH_SECRET_KEY_MAX_SIZE_REVISION_1];
+    ULONG               KeySize;
+    PROCESSOR_NUMBER    Table[XENNET_RSS_TABLE_MAX_ENTRIES];
+    ULONG               TableSize;
 } XENNET_RSS, *PXENNET_RSS;
 
 struct _XENNET_ADAPTER {
@@ -150,6 +168,7 @@ static NDIS_OID XennetSupportedOids[] =
     OID_802_3_XMIT_MORE_COLLISIONS,
     OID_OFFLOAD_ENCAPSULATION,
     OID_TCP_OFFLOAD_PARAMETERS,
+    OID_TCP_RSC_STATISTICS,
     OID_PNP_CAPABILITIES,
     OID_PNP_QUERY_POWER,
     OID_PNP_SET_POWER,
@@ -337,6 +356,16 @@ DisplayOffload(
              Offload->LsoV2.IPv6.MaxOffLoadSize);
     else
         Trace("LsoV2.IPv6 OFF\n");
+
+    if (Offload->Rsc.IPv4.Enabled)
+        Trace("Rsc.IPv4 ON\n");
+    else
+        Trace("Rsc.IPv4 OFF\n");
+
+    if (Offload->Rsc.IPv6.Enabled)
+        Trace("Rsc.IPv6 ON\n");
+    else
+        Trace("Rsc.IPv6 OFF\n");
 }
 
 #define DISPLAY_OFFLOAD(_Offload) \
@@ -357,8 +386,8 @@ AdapterIndicateOffloadChanged(
 
     RtlZeroMemory(&Current, sizeof(Current));
     Current.Header.Type = NDIS_OBJECT_TYPE_OFFLOAD;
-    Current.Header.Revision = NDIS_OFFLOAD_REVISION_2;
-    Current.Header.Size = NDIS_SIZEOF_NDIS_OFFLOAD_REVISION_2;
+    Current.Header.Revision = NDIS_OFFLOAD_REVISION_3;
+    Current.Header.Size = NDIS_SIZEOF_NDIS_OFFLOAD_REVISION_3;
 
     Current.Checksum.IPv4Receive.Encapsulation = NDIS_ENCAPSULATION_IEEE_802_3;
 
@@ -415,25 +444,25 @@ AdapterIndicateOffloadChanged(
     }
 
     if (TxOptions->OffloadIpVersion4LargePacket) {
-        XENVIF_VIF(TransmitterQueryLargePacketSize,
-                   &Adapter->VifInterface,
-                   4,
-                   &Current.LsoV2.IPv4.MaxOffLoadSize);
+        Current.LsoV2.IPv4.MaxOffLoadSize =
+            TransmitterQueryLargePacketSize(Adapter->Transmitter, 4);
         Current.LsoV2.IPv4.Encapsulation = NDIS_ENCAPSULATION_IEEE_802_3;
         Current.LsoV2.IPv4.MinSegmentCount = 2;
     }
 
     if (TxOptions->OffloadIpVersion6LargePacket) {
-        XENVIF_VIF(TransmitterQueryLargePacketSize,
-                   &Adapter->VifInterface,
-                   6,
-                   &Current.LsoV2.IPv6.MaxOffLoadSize);
+        Current.LsoV2.IPv6.MaxOffLoadSize =
+            TransmitterQueryLargePacketSize(Adapter->Transmitter, 6);
         Current.LsoV2.IPv6.Encapsulation = NDIS_ENCAPSULATION_IEEE_802_3;
         Current.LsoV2.IPv6.MinSegmentCount = 2;
         Current.LsoV2.IPv6.IpExtensionHeadersSupported = 1;
         Current.LsoV2.IPv6.TcpOptionsSupported = 1;
     }
 
+    ReceiverQueryCoalescing(Adapter->Receiver,
+                            &Current.Rsc.IPv4.Enabled,
+                            &Current.Rsc.IPv6.Enabled);
+
     DISPLAY_OFFLOAD(Current);
 
     Adapter->Offload = Current;
@@ -444,7 +473,7 @@ AdapterIndicateOffloadChanged(
     Status.Header.Size = NDIS_SIZEOF_STATUS_INDICATION_REVISION_1;
     Status.StatusCode = NDIS_STATUS_TASK_OFFLOAD_CURRENT_CONFIG;
     Status.StatusBuffer = &Current;
-    Status.StatusBufferSize = NDIS_SIZEOF_NDIS_OFFLOAD_REVISION_2;
+    Status.StatusBufferSize = NDIS_SIZEOF_NDIS_OFFLOAD_REVISION_3;
 
     NdisMIndicateStatusEx(Adapter->NdisAdapterHandle, &Status);
 }
@@ -551,13 +580,37 @@ done:
     return NDIS_STATUS_SUCCESS;
 }
 
+//
+// Large packets from the backend can be indicated as they are when
+// RSC is enabled; otherwise XENVIF must split them up again.
+//
+static VOID
+AdapterUpdateLargePacketSplit(
+    IN  PXENNET_ADAPTER         Adapter
+    )
+{
+    PXENVIF_VIF_OFFLOAD_OPTIONS RxOptions;
+    BOOLEAN                     RscIPv4;
+    BOOLEAN                     RscIPv6;
+
+    RxOptions = ReceiverOffloadOptions(Adapter->Receiver);
+
+    ReceiverQueryCoalescing(Adapter->Receiver, &RscIPv4, &RscIPv6);
+
+    RxOptions->NeedLargePacketSplit = 0;
+
+    if (RxOptions->OffloadIpVersion4LargePacket && !RscIPv4)
+        RxOptions->NeedLargePacketSplit = 1;
+    if (RxOptions->OffloadIpVersion6LargePacket && !RscIPv6)
+        RxOptions->NeedLargePacketSplit = 1;
+}
+
 static NDIS_STATUS
 AdapterGetOffloadEncapsulation(
     IN  PXENNET_ADAPTER     Adapter,
     IN  PNDIS_OFFLOAD_ENCAPSULATION Offload
     )
 {
-    XENVIF_VIF_OFFLOAD_OPTIONS  Options;
     PXENVIF_VIF_OFFLOAD_OPTIONS TxOptions;
     PXENVIF_VIF_OFFLOAD_OPTIONS RxOptions;
 
@@ -569,27 +622,23 @@ AdapterGetOffloadEncapsulation(
         Offload->IPv6.EncapsulationType != NDIS_ENCAPSULATION_IEEE_802_3)
         goto invalid_parameter;
 
-    XENVIF_VIF(TransmitterQueryOffloadOptions,
-               &Adapter->VifInterface,
-               &Options);
-
     TxOptions = TransmitterOffloadOptions(Adapter->Transmitter);
     TxOptions->Value = 0;
     TxOptions->OffloadTagManipulation = 1;
 
-    if (Adapter->Properties.lsov4 && Options.OffloadIpVersion4LargePacket)
+    if (Adapter->Properties.lsov4)
         TxOptions->OffloadIpVersion4LargePacket = 1;
-    if (Adapter->Properties.lsov6 && Options.OffloadIpVersion6LargePacket)
+    if (Adapter->Properties.lsov6)
         TxOptions->OffloadIpVersion6LargePacket = 1;
-    if ((Adapter->Properties.ipv4_csum & 1) && Options.OffloadIpVersion4HeaderChecksum)
+    if (Adapter->Properties.ipv4_csum & 1)
         TxOptions->OffloadIpVersion4HeaderChecksum = 1;
-    if ((Adapter->Properties.tcpv4_csum & 1) && Options.OffloadIpVersion4TcpChecksum)
+    if (Adapter->Properties.tcpv4_csum & 1)
         TxOptions->OffloadIpVersion4TcpChecksum = 1;
-    if ((Adapter->Properties.udpv4_csum & 1) && Options.OffloadIpVersion4UdpChecksum)
+    if (Adapter->Properties.udpv4_csum & 1)
         TxOptions->OffloadIpVersion4UdpChecksum = 1;
-    if ((Adapter->Properties.tcpv6_csum & 1) && Options.OffloadIpVersion6TcpChecksum)
+    if (Adapter->Properties.tcpv6_csum & 1)
         TxOptions->OffloadIpVersion6TcpChecksum = 1;
-    if ((Adapter->Properties.udpv6_csum & 1) && Options.OffloadIpVersion6UdpChecksum)
+    if (Adapter->Properties.udpv6_csum & 1)
         TxOptions->OffloadIpVersion6UdpChecksum = 1;
 
     RxOptions = ReceiverOffloadOptions(Adapter->Receiver);
@@ -601,12 +650,8 @@ AdapterGetOffloadEncapsulation(
         RxOptions->NeedChecksumValue = 1;
     if (Adapter->Properties.lrov4)
         RxOptions->OffloadIpVersion4LargePacket = 1;
-    if (Adapter->Properties.lrov4)
-        RxOptions->NeedLargePacketSplit = 1;
     if (Adapter->Properties.lrov6)
         RxOptions->OffloadIpVersion6LargePacket = 1;
-    if (Adapter->Properties.lrov6)
-        RxOptions->NeedLargePacketSplit = 1;
     if (Adapter->Properties.ipv4_csum & 2)
         RxOptions->OffloadIpVersion4HeaderChecksum = 1;
     if (Adapter->Properties.tcpv4_csum & 2)
@@ -618,6 +663,8 @@ AdapterGetOffloadEncapsulation(
     if (Adapter->Properties.udpv6_csum & 2)
         RxOptions->OffloadIpVersion6UdpChecksum = 1;
 
+    AdapterUpdateLargePacketSplit(Adapter);
+
     AdapterIndicateOffloadChanged(Adapter);
     return NDIS_STATUS_SUCCESS;
 
@@ -638,15 +685,12 @@ AdapterGetTcpOffloadParameters(
     IN  PNDIS_OFFLOAD_PARAMETERS    Offload
     )
 {
-    XENVIF_VIF_OFFLOAD_OPTIONS      Options;
     PXENVIF_VIF_OFFLOAD_OPTIONS     TxOptions;
     PXENVIF_VIF_OFFLOAD_OPTIONS     RxOptions;
+    BOOLEAN                         RscIPv4;
+    BOOLEAN                         RscIPv6;
     BOOLEAN                         Changed;
 
-    XENVIF_VIF(TransmitterQueryOffloadOptions,
-               &Adapter->VifInterface,
-               &Options);
-
     if (!NO_CHANGE(Offload->IPsecV1))
         goto invalid_parameter;
     if (!NO_CHANGE(Offload->LsoV1))
@@ -655,12 +699,6 @@ AdapterGetTcpOffloadParameters(
         goto invalid_parameter;
     if (!NO_CHANGE(Offload->TcpConnectionIPv6))
         goto invalid_parameter;
-    if (!NO_CHANGE(Offload->LsoV2IPv4) &&
-        !(Options.OffloadIpVersion4LargePacket))
-        goto invalid_parameter;
-    if (!NO_CHANGE(Offload->LsoV2IPv6) &&
-        !(Options.OffloadIpVersion6LargePacket))
-        goto invalid_parameter;
     if (!NO_CHANGE(Offload->IPsecV2))
         goto invalid_parameter;
     if (!NO_CHANGE(Offload->IPsecV2IPv4))
@@ -694,6 +732,27 @@ AdapterGetTcpOffloadParameters(
     Changed |= CHANGE(RxOptions->OffloadIpVersion6TcpChecksum, RX_ENABLED(Offload->TCPIPv6Checksum));
     Changed |= CHANGE(RxOptions->OffloadIpVersion6UdpChecksum, RX_ENABLED(Offload->UDPIPv6Checksum));
 
+    ReceiverQueryCoalescing(Adapter->Receiver, &RscIPv4, &RscIPv6);
+
+    if (Offload->Header.Revision >= NDIS_OFFLOAD_PARAMETERS_REVISION_3) {
+        if (Offload->RscIPv4 == NDIS_OFFLOAD_PARAMETERS_RSC_ENABLED) {
+            Changed |= CHANGE(RscIPv4, TRUE);
+        } else if (Offload->RscIPv4 == NDIS_OFFLOAD_PARAMETERS_RSC_DISABLED) {
+            Changed |= CHANGE(RscIPv4, FALSE);
+        }
+
+        if (Offload->RscIPv6 == NDIS_OFFLOAD_PARAMETERS_RSC_ENABLED) {
+            Changed |= CHANGE(RscIPv6, TRUE);
+        } else if (Offload->RscIPv6 == NDIS_OFFLOAD_PARAMETERS_RSC_DISABLED) {
+            Changed |= CHANGE(RscIPv6, FALSE);
+        }
+    }
+
+    ReceiverSetCoalescing(Adapter->Receiver, RscIPv4, RscIPv6);
+
+    // A stack that refuses RSC needs large packets split again
+    AdapterUpdateLargePacketSplit(Adapter);
+
     AdapterIndicateOffloadChanged(Adapter);
     return NDIS_STATUS_SUCCESS;
 
@@ -714,6 +773,10 @@ AdapterDisableRSSHash(
     Adapter->Rss.ScaleEnabled = FALSE;
     Adapter->Rss.HashEnabled = FALSE;
 
+    TransmitterSetHashTypes(Adapter->Transmitter, 0);
+    ReceiverSetHashTypes(Adapter->Receiver, 0);
+    ReceiverUpdateSteeringTable(Adapter->Receiver, NULL, 0);
+
     (VOID) XENVIF_VIF(ReceiverSetHashAlgorithm,
                       &Adapter->VifInterface,
                       XENVIF_PACKET_HASH_ALGORITHM_NONE);
@@ -721,36 +784,47 @@ AdapterDisableRSSHash(
 
 static NDIS_STATUS
 AdapterUpdateRSSTable(
-    IN  PXENNET_ADAPTER Adapter,
-    IN  PCCHAR          Table,
-    IN  ULONG           TableSize
+    IN  PXENNET_ADAPTER     Adapter,
+    IN  PPROCESSOR_NUMBER   Table,
+    IN  ULONG               TableSize
     )
 {
-    PROCESSOR_NUMBER    Mapping[NDIS_RSS_INDIRECTION_TABLE_MAX_SIZE_REVISION_1];
-    ULONG               Index;
-    NTSTATUS            status;
+    ULONG                   Index;
+    NTSTATUS                status;
 
     if (TableSize == 0) {
         AdapterDisableRSSHash(Adapter);
         return NDIS_STATUS_SUCCESS;
     }
 
-    if (TableSize > sizeof (Adapter->Rss.Table))
+    if (TableSize > ARRAYSIZE(Adapter->Rss.Table))
         return NDIS_STATUS_INVALID_DATA;
 
-    RtlZeroMemory(Adapter->Rss.Table, sizeof (Adapter->Rss.Table)) ;
-    RtlCopyMemory(Adapter->Rss.Table, Table, TableSize);
-    Adapter->Rss.TableSize = TableSize;
+    for (Index = 0; Index < TableSize; Index++) {
+        PROCESSOR_NUMBER    ProcNumber = Table[Index];
+
+        ProcNumber.Reserved = 0;
+        if (KeGetProcessorIndexFromNumber(&ProcNumber) == INVALID_PROCESSOR_INDEX)
+            return NDIS_STATUS_INVALID_DATA;
+    }
 
-    RtlZeroMemory(Mapping, sizeof (Mapping));
+    RtlZeroMemory(Adapter->Rss.Table, sizeof (Adapter->Rss.Table));
     for (Index = 0; Index < TableSize; Index++) {
-        Mapping[Index].Group = 0;
-        Mapping[Index].Number = Table[Index];
+        Adapter->Rss.Table[Index].Group = Table[Index].Group;
+        Adapter->Rss.Table[Index].Number = Table[Index].Number;
     }
+    Adapter->Rss.TableSize = TableSize;
+
+    ReceiverUpdateSteeringTable(Adapter->Receiver,
+                                Adapter->Rss.Table,
+                                TableSize);
+
+    if (!Adapter->Rss.BackendHash)
+        return NDIS_STATUS_SUCCESS;
 
     status = XENVIF_VIF(UpdateHashMapping,
                         &Adapter->VifInterface,
-                        Mapping,
+                        Adapter->Rss.Table,
                         TableSize);
 
     return (NT_SUCCESS(status)) ? NDIS_STATUS_SUCCESS : NDIS_STATUS_INVALID_DATA;
@@ -763,6 +837,7 @@ AdapterUpdateRSSKey(
     IN  ULONG           KeySize
     )
 {
+    NDIS_STATUS         ndisStatus;
     NTSTATUS            status;
 
     if (KeySize == 0) {
@@ -773,10 +848,22 @@ AdapterUpdateRSSKey(
     if (KeySize > sizeof (Adapter->Rss.Key))
         return NDIS_STATUS_INVALID_DATA;
 
+    ndisStatus = ReceiverSetHashKey(Adapter->Receiver, Key, KeySize);
+    if (ndisStatus != NDIS_STATUS_SUCCESS)
+        return ndisStatus;
+
+    // Keep transmit side flow hashing consistent with receive side
+    ndisStatus = TransmitterSetHashKey(Adapter->Transmitter, Key, KeySize);
+    if (ndisStatus != NDIS_STATUS_SUCCESS)
+        return ndisStatus;
+
     RtlZeroMemory(Adapter->Rss.Key, sizeof (Adapter->Rss.Key));
     RtlCopyMemory(Adapter->Rss.Key, Key, KeySize);
     Adapter->Rss.KeySize = KeySize;
 
+    if (!Adapter->Rss.BackendHash)
+        return NDIS_STATUS_SUCCESS;
+
     status = XENVIF_VIF(ReceiverUpdateHashParameters,
                         &Adapter->VifInterface,
                         Adapter->Rss.Types,
@@ -791,10 +878,14 @@ AdapterUpdateRSSHash(
     IN  ULONG           Information
     )
 {
-    ULONG               HashType = NDIS_RSS_HASH_TYPE_FROM_HASH_INFO(Information);
+    ULONG               HashType;
     ULONG               HashFunc = NDIS_RSS_HASH_FUNC_FROM_HASH_INFO(Information);
     NTSTATUS            status;
 
+    // Older headers mask the UDP types out of NDIS_HASH_TYPE_MASK
+    HashType = NDIS_RSS_HASH_TYPE_FROM_HASH_INFO(Information) |
+               (Information & HASH_UDP_TYPES);
+
     if (HashFunc == 0) {
         AdapterDisableRSSHash(Adapter);
         return NDIS_STATUS_SUCCESS;
@@ -809,14 +900,17 @@ AdapterUpdateRSSHash(
     if (HashType & ~(NDIS_HASH_TCP_IPV4 |
                      NDIS_HASH_IPV4 |
                      NDIS_HASH_TCP_IPV6 |
-                     NDIS_HASH_IPV6))
+                     NDIS_HASH_IPV6 |
+                     HASH_UDP_TYPES))
         return NDIS_STATUS_FAILURE;
 
-    status = XENVIF_VIF(ReceiverSetHashAlgorithm,
-                        &Adapter->VifInterface,
-                        XENVIF_PACKET_HASH_ALGORITHM_TOEPLITZ);
-    if (!NT_SUCCESS(status))
-        return NDIS_STATUS_FAILURE;
+    if (Adapter->Rss.BackendHash) {
+        status = XENVIF_VIF(ReceiverSetHashAlgorithm,
+                            &Adapter->VifInterface,
+                            XENVIF_PACKET_HASH_ALGORITHM_TOEPLITZ);
+        if (!NT_SUCCESS(status))
+            return NDIS_STATUS_FAILURE;
+    }
 
     Adapter->Rss.Types = 0;
 
@@ -832,6 +926,19 @@ AdapterUpdateRSSHash(
     if (HashType & NDIS_HASH_IPV6)
         Adapter->Rss.Types |= 1 << XENVIF_PACKET_HASH_TYPE_IPV6;
 
+    // There are no XENVIF UDP hash types so these are done in software,
+    // as is everything else if the backend cannot hash at all
+    Adapter->Rss.SoftwareTypes = (Adapter->Rss.BackendHash) ?
+                                 HashType & HASH_UDP_TYPES :
+                                 HashType;
+    ReceiverSetHashTypes(Adapter->Receiver, Adapter->Rss.SoftwareTypes);
+
+    // Transmit side hashes must match whichever side calculates them
+    TransmitterSetHashTypes(Adapter->Transmitter, HashType);
+
+    if (!Adapter->Rss.BackendHash)
+        return NDIS_STATUS_SUCCESS;
+
     status = XENVIF_VIF(ReceiverUpdateHashParameters,
                         &Adapter->VifInterface,
                         Adapter->Rss.Types,
@@ -860,6 +967,22 @@ DisplayRss(
             Trace("- IPv6 + TCP\n");
     }
 
+    if (Rss->SoftwareTypes != 0) {
+        Trace("Software Types:\n");
+        if (Rss->SoftwareTypes & NDIS_HASH_IPV4)
+            Trace("- IPv4\n");
+        if (Rss->SoftwareTypes & NDIS_HASH_TCP_IPV4)
+            Trace("- IPv4 + TCP\n");
+        if (Rss->SoftwareTypes & NDIS_HASH_UDP_IPV4)
+            Trace("- IPv4 + UDP\n");
+        if (Rss->SoftwareTypes & NDIS_HASH_IPV6)
+            Trace("- IPv6\n");
+        if (Rss->SoftwareTypes & NDIS_HASH_TCP_IPV6)
+            Trace("- IPv6 + TCP\n");
+        if (Rss->SoftwareTypes & NDIS_HASH_UDP_IPV6)
+            Trace("- IPv6 + UDP\n");
+    }
+
     if (Rss->KeySize != 0) {
         ULONG   Index;
 
@@ -928,8 +1051,9 @@ DisplayRss(
             String.Length = 0;
 
             for (Column = 0; Column < Count; Column++, Index++) {
-                (VOID) StringPrintf(&String, "%02x ",
-                                    Rss->Table[Index]);
+                (VOID) StringPrintf(&String, "%u:%02u ",
+                                    Rss->Table[Index].Group,
+                                    Rss->Table[Index].Number);
 
                 String.Buffer += String.Length;
                 String.MaximumLength -= String.Length;
@@ -950,7 +1074,7 @@ AdapterGetReceiveScaleParameters(
     NDIS_STATUS                         ndisStatus;
 
     ASSERT3U(Parameters->Header.Type, ==, NDIS_OBJECT_TYPE_RSS_PARAMETERS);
-    ASSERT3U(Parameters->Header.Revision, ==, NDIS_RECEIVE_SCALE_PARAMETERS_REVISION_1);
+    ASSERT3U(Parameters->Header.Revision, >=, NDIS_RECEIVE_SCALE_PARAMETERS_REVISION_1);
     ASSERT3U(Parameters->Header.Size, >=, NDIS_SIZEOF_RECEIVE_SCALE_PARAMETERS_REVISION_1);
 
     if (!Adapter->Rss.Supported)
@@ -984,9 +1108,42 @@ AdapterGetReceiveScaleParameters(
     }
 
     if (!(Parameters->Flags & NDIS_RSS_PARAM_FLAG_ITABLE_UNCHANGED)) {
-        ndisStatus = AdapterUpdateRSSTable(Adapter,
-                                           (PCCHAR)Parameters + Parameters->IndirectionTableOffset,
-                                           Parameters->IndirectionTableSize);
+        PROCESSOR_NUMBER    Table[XENNET_RSS_TABLE_MAX_ENTRIES];
+        ULONG               TableSize;
+
+        // Revision 2 tables are arrays of PROCESSOR_NUMBER (so may span
+        // processor groups), revision 1 tables are group 0 CCHARs
+        if (Parameters->Header.Revision >= NDIS_RECEIVE_SCALE_PARAMETERS_REVISION_2) {
+            PPROCESSOR_NUMBER   Entry;
+
+            Entry = (PPROCESSOR_NUMBER)((PUCHAR)Parameters + Parameters->IndirectionTableOffset);
+            TableSize = Parameters->IndirectionTableSize / sizeof (PROCESSOR_NUMBER);
+
+            ndisStatus = NDIS_STATUS_INVALID_DATA;
+            if (Parameters->IndirectionTableSize % sizeof (PROCESSOR_NUMBER) != 0 ||
+                TableSize > ARRAYSIZE(Table))
+                goto fail;
+
+            RtlCopyMemory(Table, Entry, TableSize * sizeof (PROCESSOR_NUMBER));
+        } else {
+            PCCHAR  Entry;
+            ULONG   Index;
+
+            Entry = (PCCHAR)Parameters + Parameters->IndirectionTableOffset;
+            TableSize = Parameters->IndirectionTableSize;
+
+            ndisStatus = NDIS_STATUS_INVALID_DATA;
+            if (TableSize > ARRAYSIZE(Table))
+                goto fail;
+
+            for (Index = 0; Index < TableSize; Index++) {
+                Table[Index].Group = 0;
+                Table[Index].Number = (UCHAR)Entry[Index];
+                Table[Index].Reserved = 0;
+            }
+        }
+
+        ndisStatus = AdapterUpdateRSSTable(Adapter, Table, TableSize);
         if (ndisStatus != NDIS_STATUS_SUCCESS)
             goto fail;
     }
@@ -1459,6 +1616,8 @@ AdapterReceiveHash(
     if (Adapter->Rss.Types & (1 << XENVIF_PACKET_HASH_TYPE_IPV6))
         HashType |= NDIS_HASH_IPV6;
 
+    HashType |= Adapter->Rss.SoftwareTypes;
+
     Params->HashInformation = NDIS_RSS_HASH_INFO_FROM_TYPE_AND_FUNC(HashType, HashFunc);
     Params->HashSecretKeySize = (USHORT)Adapter->Rss.KeySize;
     Params->HashSecretKeyOffset = NDIS_SIZEOF_RECEIVE_HASH_PARAMETERS_REVISION_1;
@@ -1943,6 +2102,7 @@ AdapterEnable(
         goto fail4;
 
     ReceiverEnable(Adapter->Receiver);
+    TransmitterEnable(Adapter->Transmitter);
 
     AdapterMediaStateChange(Adapter);
 
@@ -1972,10 +2132,13 @@ AdapterDisable(
     Adapter->Enabled = FALSE;
 
     ReceiverDisable(Adapter->Receiver);
+    TransmitterDisable(Adapter->Transmitter);
 
     XENVIF_VIF(Disable,
                &Adapter->VifInterface);
 
+    TransmitterFlush(Adapter->Transmitter);
+
     AdapterMediaStateChange(Adapter);
 
     AdapterClearDistribution(Adapter);
@@ -2545,8 +2708,15 @@ AdapterQueryInformation(
                                 &BytesWritten);
         break;
 
-    case OID_GEN_RCV_NO_BUFFER:
     case OID_GEN_TRANSMIT_QUEUE_LENGTH:
+        BytesNeeded = sizeof(ULONG);
+        ndisStatus = __SetUlong(Buffer,
+                                BufferLength,
+                                TransmitterQueryBacklog(Adapter->Transmitter),
+                                &BytesWritten);
+        break;
+
+    case OID_GEN_RCV_NO_BUFFER:
     case OID_GEN_RCV_CRC_ERROR:
     case OID_802_3_RCV_ERROR_ALIGNMENT:
     case OID_802_3_XMIT_ONE_COLLISION:
@@ -2718,6 +2888,17 @@ AdapterQueryInformation(
                                                 &BytesWritten);
         break;
 
+    case OID_TCP_RSC_STATISTICS:
+        BytesNeeded = NDIS_SIZEOF_RSC_STATISTICS_REVISION_1;
+        if (BufferLength >= BytesNeeded) {
+            ReceiverQueryCoalescingStatistics(Adapter->Receiver,
+                                              (PNDIS_RSC_STATISTICS_INFO)Buffer);
+            BytesWritten = BytesNeeded;
+        } else {
+            ndisStatus = NDIS_STATUS_BUFFER_TOO_SHORT;
+        }
+        break;
+
     case OID_GEN_RECEIVE_HASH:
         BytesNeeded = NDIS_SIZEOF_RECEIVE_HASH_PARAMETERS_REVISION_1 +
                       Adapter->Rss.KeySize;
@@ -2924,11 +3105,32 @@ AdapterGetAdvancedSettings(
     READ_PROPERTY(Adapter->Properties.lsov6, L"*LSOv2IPv6", 1, Handle);
     READ_PROPERTY(Adapter->Properties.lrov4, L"LROIPv4", 1, Handle);
     READ_PROPERTY(Adapter->Properties.lrov6, L"LROIPv6", 1, Handle);
+    READ_PROPERTY(Adapter->Properties.rscv4, L"*RscIPv4", 1, Handle);
+    READ_PROPERTY(Adapter->Properties.rscv6, L"*RscIPv6", 1, Handle);
     READ_PROPERTY(Adapter->Properties.need_csum_value, L"NeedChecksumValue", 1, Handle);
     READ_PROPERTY(Adapter->Properties.rss, L"*RSS", 1, Handle);
+    READ_PROPERTY(Adapter->Properties.num_rss_queues, L"*NumRssQueues", 0, Handle);
+    READ_PROPERTY(Adapter->Properties.rss_base_proc_number, L"*RssBaseProcNumber", 0, Handle);
+    READ_PROPERTY(Adapter->Properties.max_rss_processors, L"*MaxRssProcessors", 0, Handle);
+    READ_PROPERTY(Adapter->Properties.rss_profile, L"*RSSProfile", 0, Handle);
+    READ_PROPERTY(Adapter->Properties.numa_node_id, L"*NumaNodeId", 0xFFFF, Handle);
+    READ_PROPERTY(Adapter->Properties.copy_break, L"RxCopyBreak", 256, Handle);
+    READ_PROPERTY(Adapter->Properties.tx_copy_break, L"TxCopyBreak", 256, Handle);
+    READ_PROPERTY(Adapter->Properties.tx_max_fragments, L"TxMaxFragments", 4, Handle);
+    READ_PROPERTY(Adapter->Properties.rx_csum_validation, L"RxChecksumValidation", 0, Handle);
+    READ_PROPERTY(Adapter->Properties.rx_steering, L"RxSteering", 0, Handle);
 
     NdisCloseConfiguration(Handle);
 
+    ReceiverSetCopyBreak(Adapter->Receiver, Adapter->Properties.copy_break);
+    ReceiverSetChecksumValidation(Adapter->Receiver,
+                                  (BOOLEAN)!!Adapter->Properties.rx_csum_validation);
+    ReceiverSetSteering(Adapter->Receiver,
+                        (BOOLEAN)!!Adapter->Properties.rx_steering);
+    TransmitterSetLinearization(Adapter->Transmitter,
+                                Adapter->Properties.tx_copy_break,
+                                Adapter->Properties.tx_max_fragments);
+
     return NDIS_STATUS_SUCCESS;
 
 fail1:
@@ -2963,21 +3165,196 @@ AdapterSetRegistrationAttributes(
     return ndisStatus;
 }
 
+#define XENNET_RSS_PROFILE_CLOSEST_PROCESSOR          1
+#define XENNET_RSS_PROFILE_CLOSEST_PROCESSOR_STATIC   2
+
+#define XENNET_NUMA_NODE_ANY    0xFFFF
+
+//
+// NDIS builds the RSS processor set from the standard keywords, but
+// older versions ignore some of them, so apply *RssBaseProcNumber,
+// *MaxRssProcessors, *NumaNodeId and *RSSProfile to the set again
+// before using it to size the receive queues.
+//
+static BOOLEAN
+AdapterRssProcessorUsable(
+    IN  PXENNET_ADAPTER         Adapter,
+    IN  PPROCESSOR_NUMBER       ProcNumber,
+    IN  PGROUP_AFFINITY         NodeAffinity
+    )
+{
+    if (ProcNumber->Group == 0 &&
+        ProcNumber->Number < (ULONG)Adapter->Properties.rss_base_proc_number)
+        return FALSE;
+
+    if (NodeAffinity != NULL &&
+        (NodeAffinity->Group != ProcNumber->Group ||
+         (NodeAffinity->Mask & AFFINITY_MASK(ProcNumber->Number)) == 0))
+        return FALSE;
+
+    return TRUE;
+}
+
+static ULONG
+AdapterQueryRssProcessorCount(
+    IN  PXENNET_ADAPTER     Adapter
+    )
+{
+    PNDIS_RSS_PROCESSOR_INFO    RssInfo;
+    PNDIS_RSS_PROCESSOR         Processor;
+    SIZE_T                      Size;
+    ULONG                       Profile;
+    ULONG                       Node;
+    GROUP_AFFINITY              Affinity;
+    PGROUP_AFFINITY             NodeAffinity;
+    ULONG                       Maximum;
+    ULONG                       Count;
+    ULONG                       Index;
+    NDIS_STATUS                 ndisStatus;
+
+    Size = 0;
+    ndisStatus = NdisGetRssProcessorInformation(Adapter->NdisAdapterHandle,
+                                                NULL,
+                                                &Size);
+    if (ndisStatus != NDIS_STATUS_BUFFER_TOO_SHORT)
+        goto fail1;
+
+    RssInfo = __AdapterAllocate((ULONG)Size);
+
+    ndisStatus = NDIS_STATUS_RESOURCES;
+    if (RssInfo == NULL)
+        goto fail2;
+
+    ndisStatus = NdisGetRssProcessorInformation(Adapter->NdisAdapterHandle,
+                                                RssInfo,
+                                                &Size);
+    if (ndisStatus != NDIS_STATUS_SUCCESS)
+        goto fail3;
+
+    Info("%ws: RSS PROCESSORS: BASE %u:%u MAX %u NUMA %u (%u AVAILABLE)\n",
+         Adapter->Location,
+         RssInfo->RssBaseProcessor.Group,
+         RssInfo->RssBaseProcessor.Number,
+         RssInfo->MaxNumRssProcessors,
+         RssInfo->PreferredNumaNode,
+         RssInfo->RssProcessorCount);
+
+    Profile = (RssInfo->Header.Revision >= NDIS_RSS_PROCESSOR_INFO_REVISION_2) ?
+              (ULONG)RssInfo->RssProfile :
+              (ULONG)Adapter->Properties.rss_profile;
+
+    Node = (Adapter->Properties.numa_node_id != XENNET_NUMA_NODE_ANY) ?
+           (ULONG)Adapter->Properties.numa_node_id :
+           (ULONG)RssInfo->PreferredNumaNode;
+
+    // The closest processor profiles keep all the work on one node
+    NodeAffinity = NULL;
+    if ((Profile == XENNET_RSS_PROFILE_CLOSEST_PROCESSOR ||
+         Profile == XENNET_RSS_PROFILE_CLOSEST_PROCESSOR_STATIC) &&
+        Node != XENNET_NUMA_NODE_ANY) {
+        USHORT  NodeCount;
+
+        RtlZeroMemory(&Affinity, sizeof (Affinity));
+        KeQueryNodeActiveAffinity((USHORT)Node, &Affinity, &NodeCount);
+
+        if (NodeCount != 0)
+            NodeAffinity = &Affinity;
+    }
+
+    Maximum = RssInfo->MaxNumRssProcessors;
+    if (Adapter->Properties.max_rss_processors > 0)
+        Maximum = __min(Maximum, (ULONG)Adapter->Properties.max_rss_processors);
+
+    Count = 0;
+
+    Processor = (PNDIS_RSS_PROCESSOR)((PUCHAR)RssInfo + RssInfo->ProcessorArrayOffset);
+    for (Index = 0; Index < RssInfo->RssProcessorCount; Index++) {
+        BOOLEAN Usable;
+
+        Usable = AdapterRssProcessorUsable(Adapter,
+                                           &Processor->ProcNum,
+                                           NodeAffinity);
+
+        Trace("%ws: [%u] %u:%u (PREFERENCE %u)%s\n",
+              Adapter->Location,
+              Index,
+              Processor->ProcNum.Group,
+              Processor->ProcNum.Number,
+              Processor->PreferenceIndex,
+              (Usable) ? "" : " EXCLUDED");
+
+        if (Usable)
+            Count++;
+
+        Processor = (PNDIS_RSS_PROCESSOR)((PUCHAR)Processor +
+                                          RssInfo->RssProcessorEntrySize);
+    }
+
+    // Don't let a stale keyword leave us with nothing to scale across
+    if (Count == 0)
+        Count = RssInfo->RssProcessorCount;
+
+    Count = __min(Count, Maximum);
+
+    Info("%ws: RSS PROFILE %u NODE %u: %u PROCESSORS\n",
+         Adapter->Location,
+         Profile,
+         Node,
+         Count);
+
+    __AdapterFree(RssInfo);
+
+    return Count;
+
+fail3:
+    Error("fail3\n");
+
+    __AdapterFree(RssInfo);
+
+fail2:
+    Error("fail2\n");
+
+fail1:
+    Error("fail1 (%08x)\n", ndisStatus);
+
+    return 0;
+}
+
 static NDIS_STATUS
 AdapterSetGeneralAttributes(
     IN  PXENNET_ADAPTER Adapter
     )
 {
     NDIS_MINIPORT_ADAPTER_GENERAL_ATTRIBUTES    Attribs;
+    NDIS_PM_CAPABILITIES                        PmCapabilities;
     ULONG                                       Types;
     NDIS_RECEIVE_SCALE_CAPABILITIES             Rss;
+    ULONG                                       Count;
     NDIS_STATUS                                 ndisStatus;
     NTSTATUS                                    status;
 
+    // Advertise the same wake-up capabilities as OID_PNP_CAPABILITIES
+    RtlZeroMemory(&PmCapabilities, sizeof(PmCapabilities));
+    PmCapabilities.Header.Type = NDIS_OBJECT_TYPE_DEFAULT;
+    PmCapabilities.Header.Revision = NDIS_PM_CAPABILITIES_REVISION_1;
+    PmCapabilities.Header.Size = NDIS_SIZEOF_NDIS_PM_CAPABILITIES_REVISION_1;
+    PmCapabilities.MinMagicPacketWakeUp =
+        Adapter->Capabilities.WakeUpCapabilities.MinMagicPacketWakeUp;
+    PmCapabilities.MinPatternWakeUp =
+        Adapter->Capabilities.WakeUpCapabilities.MinPatternWakeUp;
+    PmCapabilities.MinLinkChangeWakeUp =
+        Adapter->Capabilities.WakeUpCapabilities.MinLinkChangeWakeUp;
+
+    if (PmCapabilities.MinMagicPacketWakeUp != NdisDeviceStateUnspecified)
+        PmCapabilities.SupportedWoLPacketPatterns |= NDIS_PM_WOL_MAGIC_PACKET_SUPPORTED;
+
+    if (PmCapabilities.MinLinkChangeWakeUp != NdisDeviceStateUnspecified)
+        PmCapabilities.SupportedWakeUpEvents |= NDIS_PM_WAKE_ON_MEDIA_CONNECT_SUPPORTED;
+
     RtlZeroMemory(&Attribs, sizeof(Attribs));
     Attribs.Header.Type = NDIS_OBJECT_TYPE_MINIPORT_ADAPTER_GENERAL_ATTRIBUTES;
-    Attribs.Header.Revision = NDIS_MINIPORT_ADAPTER_GENERAL_ATTRIBUTES_REVISION_1;
-    Attribs.Header.Size = NDIS_SIZEOF_MINIPORT_ADAPTER_GENERAL_ATTRIBUTES_REVISION_1;
+    Attribs.Header.Revision = NDIS_MINIPORT_ADAPTER_GENERAL_ATTRIBUTES_REVISION_2;
+    Attribs.Header.Size = NDIS_SIZEOF_MINIPORT_ADAPTER_GENERAL_ATTRIBUTES_REVISION_2;
     Attribs.MediaType = XENNET_MEDIA_TYPE;
 
     XENVIF_VIF(MacQueryMaximumFrameSize,
@@ -2992,7 +3369,7 @@ AdapterSetGeneralAttributes(
     Attribs.MediaConnectState = MediaConnectStateConnected;
     Attribs.MediaDuplexState = MediaDuplexStateFull;
     Attribs.LookaheadSize = Adapter->MaximumFrameSize;
-    Attribs.PowerManagementCapabilities = &Adapter->Capabilities;
+    Attribs.PowerManagementCapabilitiesEx = &PmCapabilities;
     Attribs.MacOptions = XENNET_MAC_OPTIONS;
     Attribs.SupportedPacketFilters = XENNET_SUPPORTED_PACKET_FILTERS;
     Attribs.MaxMulticastListSize = 32;
@@ -3043,20 +3420,30 @@ AdapterSetGeneralAttributes(
     status = XENVIF_VIF(ReceiverSetHashAlgorithm,
                         &Adapter->VifInterface,
                         XENVIF_PACKET_HASH_ALGORITHM_TOEPLITZ);
-    if (!NT_SUCCESS(status))
-        goto done;
+    if (NT_SUCCESS(status))
+        status = XENVIF_VIF(ReceiverQueryHashCapabilities,
+                            &Adapter->VifInterface,
+                            &Types);
+
+    // If the backend cannot hash then the receiver calculates the hashes
+    Adapter->Rss.BackendHash = NT_SUCCESS(status) ? TRUE : FALSE;
+    if (!Adapter->Rss.BackendHash) {
+        Info("%ws: RSS HASH CALCULATED IN SOFTWARE\n",
+             Adapter->Location);
 
-    status = XENVIF_VIF(ReceiverQueryHashCapabilities,
-                        &Adapter->VifInterface,
-                        &Types);
-    if (!NT_SUCCESS(status))
-        goto done;
+        Types = (1 << XENVIF_PACKET_HASH_TYPE_IPV4) |
+                (1 << XENVIF_PACKET_HASH_TYPE_IPV4_TCP) |
+                (1 << XENVIF_PACKET_HASH_TYPE_IPV6) |
+                (1 << XENVIF_PACKET_HASH_TYPE_IPV6_TCP);
+    }
 
     RtlZeroMemory(&Rss, sizeof(Rss));
     Rss.Header.Type = NDIS_OBJECT_TYPE_RSS_CAPABILITIES;
-    Rss.Header.Revision = NDIS_RECEIVE_SCALE_CAPABILITIES_REVISION_1;
-    Rss.Header.Size = NDIS_SIZEOF_RECEIVE_SCALE_CAPABILITIES_REVISION_1;
+    Rss.Header.Revision = NDIS_RECEIVE_SCALE_CAPABILITIES_REVISION_2;
+    Rss.Header.Size = NDIS_SIZEOF_RECEIVE_SCALE_CAPABILITIES_REVISION_2;
 
+    // Revision 2 capabilities mean NDIS will hand us PROCESSOR_NUMBER
+    // indirection tables that can span processor groups
     Rss.CapabilitiesFlags = NDIS_RSS_CAPS_MESSAGE_SIGNALED_INTERRUPTS |
                             NDIS_RSS_CAPS_CLASSIFICATION_AT_ISR |
                             NDIS_RSS_CAPS_CLASSIFICATION_AT_DPC |
@@ -3068,14 +3455,37 @@ AdapterSetGeneralAttributes(
     if (Types & (1 << XENVIF_PACKET_HASH_TYPE_IPV6_TCP))
         Rss.CapabilitiesFlags |= NDIS_RSS_CAPS_HASH_TYPE_TCP_IPV6;
 
+    // UDP flows are always hashed by the receiver
+    Rss.CapabilitiesFlags |= NDIS_RSS_CAPS_HASH_TYPE_UDP_IPV4 |
+                             NDIS_RSS_CAPS_HASH_TYPE_UDP_IPV6;
+
     XENVIF_VIF(QueryRingCount,
                &Adapter->VifInterface,
                &Rss.NumberOfReceiveQueues);
+
+    Count = AdapterQueryRssProcessorCount(Adapter);
+
+    // With receive steering every RSS processor can act as a queue, and
+    // software hashes are always steered
+    if (Adapter->Properties.rx_steering || !Adapter->Rss.BackendHash)
+        Rss.NumberOfReceiveQueues = __max(Rss.NumberOfReceiveQueues, Count);
+
+    // Honour *NumRssQueues and don't claim more queues than there are
+    // processors available for RSS
+    if (Adapter->Properties.num_rss_queues > 0)
+        Rss.NumberOfReceiveQueues = __min(Rss.NumberOfReceiveQueues,
+                                          (ULONG)Adapter->Properties.num_rss_queues);
+
+    if (Count != 0)
+        Rss.NumberOfReceiveQueues = __min(Rss.NumberOfReceiveQueues, Count);
+
     Rss.NumberOfInterruptMessages = Rss.NumberOfReceiveQueues;
+    Rss.NumberOfIndirectionTableEntries = XENNET_RSS_TABLE_MAX_ENTRIES;
 
-    Info("%ws: RSS ENABLED (%u QUEUES)\n",
+    Info("%ws: RSS ENABLED (%u QUEUES, %u GROUPS)\n",
          Adapter->Location,
-         Rss.NumberOfReceiveQueues);
+         Rss.NumberOfReceiveQueues,
+         KeQueryActiveGroupCount());
 
     Adapter->Rss.Supported = TRUE;
     Attribs.RecvScaleCapabilities = &Rss;
@@ -3093,7 +3503,6 @@ AdapterSetOffloadAttributes(
     )
 {
     NDIS_MINIPORT_ADAPTER_OFFLOAD_ATTRIBUTES    Attribs;
-    XENVIF_VIF_OFFLOAD_OPTIONS                  Options;
     PXENVIF_VIF_OFFLOAD_OPTIONS                 RxOptions;
     PXENVIF_VIF_OFFLOAD_OPTIONS                 TxOptions;
     NDIS_OFFLOAD                                Default;
@@ -3112,28 +3521,26 @@ AdapterSetOffloadAttributes(
     if (Adapter->Properties.need_csum_value)
         RxOptions->NeedChecksumValue = 1;
 
-    if (Adapter->Properties.lrov4) {
+    if (Adapter->Properties.lrov4)
         RxOptions->OffloadIpVersion4LargePacket = 1;
-        RxOptions->NeedLargePacketSplit = 1;
-    }
 
-    if (Adapter->Properties.lrov6) {
+    if (Adapter->Properties.lrov6)
         RxOptions->OffloadIpVersion6LargePacket = 1;
-        RxOptions->NeedLargePacketSplit = 1;
-    }
+
+    ReceiverSetCoalescing(Adapter->Receiver,
+                          (Adapter->Properties.rscv4) ? TRUE : FALSE,
+                          (Adapter->Properties.rscv6) ? TRUE : FALSE);
+
+    AdapterUpdateLargePacketSplit(Adapter);
 
     XENVIF_VIF(ReceiverSetOffloadOptions,
                &Adapter->VifInterface,
                *RxOptions);
 
-    XENVIF_VIF(TransmitterQueryOffloadOptions,
-               &Adapter->VifInterface,
-               &Options);
-
     RtlZeroMemory(&Supported, sizeof(Supported));
     Supported.Header.Type = NDIS_OBJECT_TYPE_OFFLOAD;
-    Supported.Header.Revision = NDIS_OFFLOAD_REVISION_2;
-    Supported.Header.Size = NDIS_SIZEOF_NDIS_OFFLOAD_REVISION_2;
+    Supported.Header.Revision = NDIS_OFFLOAD_REVISION_3;
+    Supported.Header.Size = NDIS_SIZEOF_NDIS_OFFLOAD_REVISION_3;
 
     Supported.Checksum.IPv4Receive.Encapsulation = NDIS_ENCAPSULATION_IEEE_802_3;
 
@@ -3154,52 +3561,52 @@ AdapterSetOffloadAttributes(
 
     Supported.Checksum.IPv6Receive.UdpChecksum = 1;
 
+    //
+    // Transmit checksums that the backend cannot calculate are done
+    // by the transmitter, so they can always be offered.
+    //
     Supported.Checksum.IPv4Transmit.Encapsulation = NDIS_ENCAPSULATION_IEEE_802_3;
 
-    if (Options.OffloadIpVersion4HeaderChecksum) {
-        Supported.Checksum.IPv4Transmit.IpChecksum = 1;
-        Supported.Checksum.IPv4Transmit.IpOptionsSupported = 1;
-    }
+    Supported.Checksum.IPv4Transmit.IpChecksum = 1;
+    Supported.Checksum.IPv4Transmit.IpOptionsSupported = 1;
 
-    if (Options.OffloadIpVersion4TcpChecksum) {
-        Supported.Checksum.IPv4Transmit.TcpChecksum = 1;
-        Supported.Checksum.IPv4Transmit.TcpOptionsSupported = 1;
-    }
+    Supported.Checksum.IPv4Transmit.TcpChecksum = 1;
+    Supported.Checksum.IPv4Transmit.TcpOptionsSupported = 1;
 
-    if (Options.OffloadIpVersion4UdpChecksum)
-        Supported.Checksum.IPv4Transmit.UdpChecksum = 1;
+    Supported.Checksum.IPv4Transmit.UdpChecksum = 1;
 
     Supported.Checksum.IPv6Transmit.Encapsulation = NDIS_ENCAPSULATION_IEEE_802_3;
 
     Supported.Checksum.IPv6Transmit.IpExtensionHeadersSupported = 1;
 
-    if (Options.OffloadIpVersion6TcpChecksum) {
-        Supported.Checksum.IPv6Transmit.TcpChecksum = 1;
-        Supported.Checksum.IPv6Transmit.TcpOptionsSupported = 1;
-    }
-
-    if (Options.OffloadIpVersion6UdpChecksum)
-        Supported.Checksum.IPv6Transmit.UdpChecksum = 1;
-
-    if (Options.OffloadIpVersion4LargePacket) {
-        XENVIF_VIF(TransmitterQueryLargePacketSize,
-                   &Adapter->VifInterface,
-                   4,
-                   &Supported.LsoV2.IPv4.MaxOffLoadSize);
-        Supported.LsoV2.IPv4.Encapsulation = NDIS_ENCAPSULATION_IEEE_802_3;
-        Supported.LsoV2.IPv4.MinSegmentCount = 2;
-    }
-
-    if (Options.OffloadIpVersion6LargePacket) {
-        XENVIF_VIF(TransmitterQueryLargePacketSize,
-                   &Adapter->VifInterface,
-                   6,
-                   &Supported.LsoV2.IPv6.MaxOffLoadSize);
-        Supported.LsoV2.IPv6.Encapsulation = NDIS_ENCAPSULATION_IEEE_802_3;
-        Supported.LsoV2.IPv6.MinSegmentCount = 2;
-        Supported.LsoV2.IPv6.IpExtensionHeadersSupported = 1;
-        Supported.LsoV2.IPv6.TcpOptionsSupported = 1;
-    }
+    Supported.Checksum.IPv6Transmit.TcpChecksum = 1;
+    Supported.Checksum.IPv6Transmit.TcpOptionsSupported = 1;
+
+    Supported.Checksum.IPv6Transmit.UdpChecksum = 1;
+
+    //
+    // Large packets are segmented by the transmitter if the backend
+    // cannot do it, or if they are bigger than the backend can take.
+    //
+    Supported.LsoV2.IPv4.MaxOffLoadSize =
+        TransmitterQueryLargePacketSize(Adapter->Transmitter, 4);
+    Supported.LsoV2.IPv4.Encapsulation = NDIS_ENCAPSULATION_IEEE_802_3;
+    Supported.LsoV2.IPv4.MinSegmentCount = 2;
+
+    Supported.LsoV2.IPv6.MaxOffLoadSize =
+        TransmitterQueryLargePacketSize(Adapter->Transmitter, 6);
+    Supported.LsoV2.IPv6.Encapsulation = NDIS_ENCAPSULATION_IEEE_802_3;
+    Supported.LsoV2.IPv6.MinSegmentCount = 2;
+    Supported.LsoV2.IPv6.IpExtensionHeadersSupported = 1;
+    Supported.LsoV2.IPv6.TcpOptionsSupported = 1;
+
+    //
+    // Segments are coalesced in software so this does not depend on
+    // the backend, but packets coalesced by a backend that supports
+    // LRO are indicated as they are.
+    //
+    Supported.Rsc.IPv4.Enabled = TRUE;
+    Supported.Rsc.IPv6.Enabled = TRUE;
 
     DISPLAY_OFFLOAD(Supported);
 
@@ -3245,6 +3652,12 @@ AdapterSetOffloadAttributes(
         Default.LsoV2.IPv6.MinSegmentCount = 0;
     }
 
+    if (!(Adapter->Properties.rscv4))
+        Default.Rsc.IPv4.Enabled = FALSE;
+
+    if (!(Adapter->Properties.rscv6))
+        Default.Rsc.IPv6.Enabled = FALSE;
+
     DISPLAY_OFFLOAD(Default);
 
     Adapter->Offload = Default;
@@ -0,0 +1,240 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+#include <ndis.h>
+#include <tcpip.h>
+
+#if defined(_M_AMD64)
+#include <emmintrin.h>
+#endif
+
+#include "checksum.h"
+#include "dbg_print.h"
+#include "assert.h"
+
+#if defined(_M_AMD64)
+
+//
+// SSE2 is always available on x64 and the XMM registers may be used
+// freely in kernel mode. (AVX would need the extended processor state
+// saving around every use, which costs more than it saves on packet
+// sized buffers.)
+//
+// Each 16 byte load is split into eight words which are added into
+// two sets of four 32-bit lanes, so each lane can take 0x8000 loads
+// before it could overflow once the two sets are combined.
+//
+#define CHECKSUM_SSE2_BLOCK 0x8000
+
+static FORCEINLINE ULONG64
+__ChecksumSse2(
+    IN      const UCHAR *Data,
+    IN      ULONG       Count
+    )
+{
+    __m128i             Zero = _mm_setzero_si128();
+    ULONG64             Sum = 0;
+
+    while (Count != 0) {
+        ULONG   Block = __min(Count, CHECKSUM_SSE2_BLOCK);
+        __m128i Low = _mm_setzero_si128();
+        __m128i High = _mm_setzero_si128();
+        __m128i Wide;
+
+        Count -= Block;
+
+        while (Block >= 2) {
+            __m128i First = _mm_loadu_si128((const __m128i *)Data);
+            __m128i Second = _mm_loadu_si128((const __m128i *)(Data + 16));
+
+            Low = _mm_add_epi32(Low, _mm_unpacklo_epi16(First, Zero));
+            High = _mm_add_epi32(High, _mm_unpackhi_epi16(First, Zero));
+            Low = _mm_add_epi32(Low, _mm_unpacklo_epi16(Second, Zero));
+            High = _mm_add_epi32(High, _mm_unpackhi_epi16(Second, Zero));
+
+            Data += 32;
+            Block -= 2;
+        }
+
+        if (Block != 0) {
+            __m128i First = _mm_loadu_si128((const __m128i *)Data);
+
+            Low = _mm_add_epi32(Low, _mm_unpacklo_epi16(First, Zero));
+            High = _mm_add_epi32(High, _mm_unpackhi_epi16(First, Zero));
+
+            Data += 16;
+        }
+
+        // Widen the lanes to 64 bits before adding them up
+        Wide = _mm_add_epi64(_mm_unpacklo_epi32(Low, Zero),
+                             _mm_unpackhi_epi32(Low, Zero));
+        Wide = _mm_add_epi64(Wide, _mm_unpacklo_epi32(High, Zero));
+        Wide = _mm_add_epi64(Wide, _mm_unpackhi_epi32(High, Zero));
+
+        Sum += (ULONG64)_mm_cvtsi128_si64(Wide);
+        Sum += (ULONG64)_mm_cvtsi128_si64(_mm_unpackhi_epi64(Wide, Wide));
+    }
+
+    return Sum;
+}
+
+#endif  // _M_AMD64
+
+ULONG
+ChecksumAccumulate(
+    IN  const VOID  *Buffer,
+    IN  ULONG       Length,
+    IN  ULONG       Sum
+    )
+{
+    const UCHAR     *Data = Buffer;
+    ULONG64         Accumulator = Sum;
+
+#if defined(_M_AMD64)
+    if (Length >= 64) {
+        ULONG   Count = Length / 16;
+
+        Accumulator += __ChecksumSse2(Data, Count);
+
+        Data += Count * 16;
+        Length -= Count * 16;
+    }
+#endif  // _M_AMD64
+
+    //
+    // Summing 32-bit words into a 64-bit accumulator gives the same
+    // result, once folded, as summing 16-bit words.
+    //
+    while (Length >= 4 * sizeof (ULONG)) {
+        const ULONG UNALIGNED   *Word = (const ULONG UNALIGNED *)Data;
+
+        Accumulator += (ULONG64)Word[0] + Word[1] + Word[2] + Word[3];
+
+        Data += 4 * sizeof (ULONG);
+        Length -= 4 * sizeof (ULONG);
+    }
+
+    while (Length >= sizeof (ULONG)) {
+        Accumulator += *(const ULONG UNALIGNED *)Data;
+
+        Data += sizeof (ULONG);
+        Length -= sizeof (ULONG);
+    }
+
+    if (Length >= sizeof (USHORT)) {
+        Accumulator += *(const USHORT UNALIGNED *)Data;
+
+        Data += sizeof (USHORT);
+        Length -= sizeof (USHORT);
+    }
+
+    // A trailing odd byte is padded with zero
+    if (Length != 0)
+        Accumulator += *Data;
+
+    return ChecksumFold(Accumulator);
+}
+
+BOOLEAN
+ChecksumAccumulateMdl(
+    IN      PMDL    Mdl,
+    IN      ULONG   Offset,
+    IN      ULONG   Length,
+    IN OUT  PULONG  Sum
+    )
+{
+    ULONG           Accumulator;
+    BOOLEAN         Odd;
+
+    Accumulator = *Sum;
+    Odd = FALSE;
+
+    while (Length != 0) {
+        PUCHAR  MdlMappedSystemVa;
+        ULONG   Count;
+
+        if (Mdl == NULL)
+            return FALSE;
+
+        if (Offset >= Mdl->ByteCount) {
+            Offset -= Mdl->ByteCount;
+            Mdl = Mdl->Next;
+            continue;
+        }
+
+        MdlMappedSystemVa = MmGetSystemAddressForMdlSafe(Mdl, NormalPagePriority);
+        if (MdlMappedSystemVa == NULL)
+            return FALSE;
+
+        Count = __min(Mdl->ByteCount - Offset, Length);
+
+        Accumulator = ChecksumCombine(Accumulator,
+                                      ChecksumAccumulate(MdlMappedSystemVa + Offset,
+                                                         Count,
+                                                         0),
+                                      Odd);
+
+        // A fragment of odd length leaves the next one misaligned
+        if (Count & 1)
+            Odd = !Odd;
+
+        Length -= Count;
+
+        Offset = 0;
+        Mdl = Mdl->Next;
+    }
+
+    *Sum = Accumulator;
+    return TRUE;
+}
+
+ULONG
+ChecksumPseudoHeader(
+    IN  const VOID  *SourceAddress,
+    IN  const VOID  *DestinationAddress,
+    IN  ULONG       AddressLength,
+    IN  UCHAR       Protocol,
+    IN  ULONG       Length
+    )
+{
+    ULONG64         Accumulator;
+
+    ASSERT3U(Length, <=, 0xFFFF);
+
+    Accumulator = ChecksumAccumulate(SourceAddress, AddressLength, 0);
+    Accumulator += ChecksumAccumulate(DestinationAddress, AddressLength, 0);
+
+    // The zero padding contributes nothing, for both IPv4 and IPv6
+    Accumulator += HTONS((USHORT)Protocol);
+    Accumulator += HTONS((USHORT)Length);
+
+    return ChecksumFold(Accumulator);
+}
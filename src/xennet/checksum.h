@@ -0,0 +1,96 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+#ifndef _XENNET_CHECKSUM_H
+#define _XENNET_CHECKSUM_H
+
+#include <ndis.h>
+
+//
+// Partial sums are 16-bit one's complement sums of the data taken as
+// little-endian words in memory order. Since the one's complement sum
+// is independent of byte order, the complement of a folded sum can be
+// stored directly into a header checksum field.
+//
+
+static FORCEINLINE ULONG
+ChecksumFold(
+    IN  ULONG64 Sum
+    )
+{
+    while (Sum >> 16)
+        Sum = (Sum & 0xFFFF) + (Sum >> 16);
+
+    return (ULONG)Sum;
+}
+
+//
+// Add a partial sum computed over data that started at an odd offset
+// from the start of Sum's data, in which case its bytes are swapped.
+//
+static FORCEINLINE ULONG
+ChecksumCombine(
+    IN  ULONG   Sum,
+    IN  ULONG   Partial,
+    IN  BOOLEAN Odd
+    )
+{
+    if (Odd)
+        Partial = ((Partial & 0xFF) << 8) | ((Partial >> 8) & 0xFF);
+
+    return ChecksumFold((ULONG64)Sum + Partial);
+}
+
+extern ULONG
+ChecksumAccumulate(
+    IN  const VOID  *Buffer,
+    IN  ULONG       Length,
+    IN  ULONG       Sum
+    );
+
+extern BOOLEAN
+ChecksumAccumulateMdl(
+    IN      PMDL    Mdl,
+    IN      ULONG   Offset,
+    IN      ULONG   Length,
+    IN OUT  PULONG  Sum
+    );
+
+extern ULONG
+ChecksumPseudoHeader(
+    IN  const VOID  *SourceAddress,
+    IN  const VOID  *DestinationAddress,
+    IN  ULONG       AddressLength,
+    IN  UCHAR       Protocol,
+    IN  ULONG       Length
+    );
+
+#endif  // _XENNET_CHECKSUM_H
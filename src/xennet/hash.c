@@ -0,0 +1,88 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+#include <ndis.h>
+
+#include "hash.h"
+#include "dbg_print.h"
+#include "assert.h"
+
+C_ASSERT(HASH_TOEPLITZ_INPUT_MAX + sizeof (ULONG) <= NDIS_RSS_HASH_SECRET_KEY_MAX_SIZE_REVISION_1);
+
+//
+// Each input bit selects the 32 bits of key that start at the same bit
+// offset, so the entry for a byte value is the XOR of the windows
+// selected by its set bits.
+//
+VOID
+HashToeplitzInitialize(
+    OUT PHASH_TOEPLITZ  Toeplitz,
+    IN  const UCHAR     *Key,
+    IN  ULONG           KeySize
+    )
+{
+    UCHAR               Buffer[NDIS_RSS_HASH_SECRET_KEY_MAX_SIZE_REVISION_1];
+    ULONG               Index;
+
+    // A short key is padded with zeroes
+    RtlZeroMemory(Buffer, sizeof (Buffer));
+    RtlCopyMemory(Buffer, Key, __min(KeySize, sizeof (Buffer)));
+
+    for (Index = 0; Index < HASH_TOEPLITZ_INPUT_MAX; Index++) {
+        ULONG64 Bytes;
+        ULONG   Window[8];
+        ULONG   Bit;
+        ULONG   Value;
+
+        Bytes = ((ULONG64)Buffer[Index] << 32) |
+                ((ULONG64)Buffer[Index + 1] << 24) |
+                ((ULONG64)Buffer[Index + 2] << 16) |
+                ((ULONG64)Buffer[Index + 3] << 8) |
+                ((ULONG64)Buffer[Index + 4]);
+
+        for (Bit = 0; Bit < 8; Bit++)
+            Window[Bit] = (ULONG)(Bytes >> (8 - Bit));
+
+        Toeplitz->Table[Index][0] = 0;
+
+        // Each value differs from one already done by its lowest set bit
+        for (Value = 1; Value < 256; Value++) {
+            ULONG   Lowest = Value & (0 - Value);
+
+            for (Bit = 0; Bit < 8; Bit++)
+                if (Lowest == (0x80u >> Bit))
+                    break;
+
+            Toeplitz->Table[Index][Value] =
+                Toeplitz->Table[Index][Value & ~Lowest] ^ Window[Bit];
+        }
+    }
+}
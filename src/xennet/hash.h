@@ -0,0 +1,96 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+#ifndef _XENNET_HASH_H
+#define _XENNET_HASH_H
+
+#include <ndis.h>
+
+//
+// The UDP hash types only appear in NDIS 6.80 headers, but the values
+// are fixed so they can be used with older ones.
+//
+#ifndef NDIS_HASH_UDP_IPV4
+#define NDIS_HASH_UDP_IPV4                  0x00004000
+#endif
+
+#ifndef NDIS_HASH_UDP_IPV6
+#define NDIS_HASH_UDP_IPV6                  0x00008000
+#endif
+
+#ifndef NDIS_RSS_CAPS_HASH_TYPE_UDP_IPV4
+#define NDIS_RSS_CAPS_HASH_TYPE_UDP_IPV4    0x00000040
+#endif
+
+#ifndef NDIS_RSS_CAPS_HASH_TYPE_UDP_IPV6
+#define NDIS_RSS_CAPS_HASH_TYPE_UDP_IPV6    0x00000080
+#endif
+
+// XENVIF has no UDP hash types so these are always calculated in software
+#define HASH_UDP_TYPES  (NDIS_HASH_UDP_IPV4 | NDIS_HASH_UDP_IPV6)
+
+//
+// The Toeplitz hash is linear in its input, so the contribution of each
+// input byte can be looked up in a table built from the key, one table
+// per byte position. The longest input is an IPv6 address pair plus a
+// pair of ports.
+//
+#define HASH_TOEPLITZ_INPUT_MAX (2 * 16 + 2 * sizeof (USHORT))
+
+typedef struct _HASH_TOEPLITZ {
+    ULONG   Table[HASH_TOEPLITZ_INPUT_MAX][256];
+} HASH_TOEPLITZ, *PHASH_TOEPLITZ;
+
+extern VOID
+HashToeplitzInitialize(
+    OUT PHASH_TOEPLITZ  Toeplitz,
+    IN  const UCHAR     *Key,
+    IN  ULONG           KeySize
+    );
+
+static FORCEINLINE ULONG
+HashToeplitz(
+    IN  const HASH_TOEPLITZ *Toeplitz,
+    IN  const UCHAR         *Input,
+    IN  ULONG               Length
+    )
+{
+    ULONG                   Result;
+    ULONG                   Index;
+
+    Result = 0;
+    for (Index = 0; Index < Length; Index++)
+        Result ^= Toeplitz->Table[Index][Input[Index]];
+
+    return Result;
+}
+
+#endif  // _XENNET_HASH_H
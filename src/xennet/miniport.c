@@ -217,8 +217,10 @@ MiniportCancelSend(
     IN  PVOID       CancelId
     )
 {
-    UNREFERENCED_PARAMETER(MiniportAdapterContext);
-    UNREFERENCED_PARAMETER(CancelId);
+    PXENNET_ADAPTER     Adapter = (PXENNET_ADAPTER)MiniportAdapterContext;
+    PXENNET_TRANSMITTER Transmitter = AdapterGetTransmitter(Adapter);
+
+    TransmitterCancelSendNetBufferLists(Transmitter, CancelId);
 }
 
 static
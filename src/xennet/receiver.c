@@ -37,22 +37,191 @@
 #include "util.h"
 #include "receiver.h"
 #include "adapter.h"
+#include "checksum.h"
+#include "hash.h"
 #include "dbg_print.h"
 #include "assert.h"
 
+//
+// In-order TCP segments of the same flow that arrive within a single
+// batch are coalesced into the first segment of that flow, which
+// becomes a single coalesced unit (SCU). The payload of each absorbed
+// segment is appended to the SCU by reference and the absorbed NBL is
+// parked on the SCU until NDIS returns it.
+//
+#define RECEIVER_FLOW_COUNT     8
+
+typedef struct _XENNET_RECEIVER_FLOW {
+    PNET_BUFFER_LIST    NetBufferList;  // The SCU
+    PUCHAR              Frame;
+    PIP_HEADER          IpHeader;
+    PTCP_HEADER         TcpHeader;
+    PUCHAR              Timestamp;      // NULL if there is no timestamp option
+    ULONG               HeaderLength;
+    ULONG               PayloadLength;
+    ULONG               Sequence;       // Next expected sequence number
+    ULONG               TimestampValue; // Most recent TSval
+    PMDL                Tail;
+    PNET_BUFFER_LIST    Last;           // Most recently parked NBL
+    USHORT              Segments;
+    USHORT              DupAcks;
+} XENNET_RECEIVER_FLOW, *PXENNET_RECEIVER_FLOW;
+
+//
+// To bound the time spent in the DPC, each queue may only indicate so
+// many packets, or for so long, in a single run of activity. Once that
+// budget is exhausted, everything that follows is handed off to a
+// threaded DPC, targeted at the queue's processor, until it has caught
+// up. That DPC also indicates no more than a budget's worth in one go,
+// and queues itself again for the rest, so that it takes turns with
+// the ring.
+//
+#define RECEIVER_PACKET_BUDGET  256
+#define RECEIVER_TIME_BUDGET    2500    // 250us in 100ns units
+
+//
+// Each queue is only ever touched by the DPC that XENVIF uses to
+// process the corresponding receive ring: that DPC both stages packets
+// and pushes them up to NDIS, so no lock is required. Only the list of
+// deferred packets, which is shared with the threaded DPC, is locked.
+//
+// This relies on XENVIF calling back for a given ring from that ring's
+// own KDPC and nowhere else. A KDPC cannot run on two processors at
+// once, so packets for one queue never arrive concurrently. Should
+// that ever change the queue would be corrupted silently, so the owner
+// is checked in free builds too: with plain accesses, which catch any
+// overlap that is not perfectly simultaneous, and atomically in
+// checked builds.
+//
 typedef struct _XENNET_RECEIVER_QUEUE {
+    PVOID                   Owner;
+    PNET_BUFFER_LIST        Head;
+    PNET_BUFFER_LIST        Tail;
+    ULONG                   Count;
+    ULONG                   Held;   // NBLs still holding a XENVIF cookie
+    XENNET_RECEIVER_FLOW    Flow[RECEIVER_FLOW_COUNT];
+    ULONG                   FlowCount;
+    ULONGLONG               CoalescedPackets;
+    ULONGLONG               CoalescedOctets;
+    ULONGLONG               CoalesceEvents;
+    ULONGLONG               CoalesceAborts;
+    ULONG                   Packets;    // Indicated in the current run
+    ULONGLONG               Start;      // Start of the current run
+    ULONGLONG               Last;       // Time of the last push
+    ULONG                   Exhausted;
+    KSPIN_LOCK              Lock;
+    BOOLEAN                 Deferring;
+    PNET_BUFFER_LIST        DeferredHead;
+    PNET_BUFFER_LIST        DeferredTail;
+    ULONG                   DeferredCount;
+    ULONG                   DeferredHeld;
+    KDPC                    Dpc;
+    ULONG                   IpChecksumsValidated;
+    ULONG                   TcpChecksumsValidated;
+    ULONG                   UdpChecksumsValidated;
+    ULONG                   ChecksumsFailed;
+} XENNET_RECEIVER_QUEUE, *PXENNET_RECEIVER_QUEUE;
+
+//
+// When the indirection table spreads flows over more processors than
+// the backend has rings, or when hashes are calculated here rather than
+// by the backend (so the backend cannot have used them to pick a ring),
+// packets are steered in software: each one is looked up in the table
+// by its hash and, if it belongs elsewhere, handed to the target
+// processor to be indicated from its own threaded DPC. That DPC is
+// subject to the same per-run budget as the deferral DPC.
+//
+#define RECEIVER_STEERING_TABLE_SIZE    128
+
+typedef struct _XENNET_RECEIVER_TARGET {
     KSPIN_LOCK          Lock;
     PNET_BUFFER_LIST    Head;
     PNET_BUFFER_LIST    Tail;
     ULONG               Count;
-} XENNET_RECEIVER_QUEUE, *PXENNET_RECEIVER_QUEUE;
+    ULONG               Held;
+    KDPC                Dpc;
+    ULONG               Steered;    // Packets handed to this processor
+    ULONG               Kept;       // Packets indicated where they arrived
+    KDPC                QuiesceDpc;
+} XENNET_RECEIVER_TARGET, *PXENNET_RECEIVER_TARGET;
+
+//
+// Receive NET_BUFFER_LISTs are cached using a magazine scheme: each
+// processor owns a pair of bounded magazines, which it can allocate
+// from and free to without touching any shared state. Only when both
+// are empty (or both are full) does it need to exchange a magazine
+// with the depot, which is protected by a spin lock.
+//
+#define RECEIVER_MAGAZINE_SIZE  32
+
+typedef struct _XENNET_RECEIVER_MAGAZINE {
+    LIST_ENTRY          ListEntry;
+    ULONG               Count;
+    PNET_BUFFER_LIST    Slot[RECEIVER_MAGAZINE_SIZE];
+} XENNET_RECEIVER_MAGAZINE, *PXENNET_RECEIVER_MAGAZINE;
+
+typedef struct _XENNET_RECEIVER_PROCESSOR {
+    PXENNET_RECEIVER_MAGAZINE   Loaded;
+    PXENNET_RECEIVER_MAGAZINE   Previous;
+    ULONG                       Hit;
+    ULONG                       Miss;
+} XENNET_RECEIVER_PROCESSOR, *PXENNET_RECEIVER_PROCESSOR;
+
+typedef PNET_BUFFER_LIST
+(*XENNET_RECEIVER_CACHE_CTOR)(
+    IN  PXENNET_RECEIVER    Receiver
+    );
+
+typedef VOID
+(*XENNET_RECEIVER_CACHE_DTOR)(
+    IN  PXENNET_RECEIVER    Receiver,
+    IN  PNET_BUFFER_LIST    NetBufferList
+    );
+
+typedef struct _XENNET_RECEIVER_CACHE {
+    PXENNET_RECEIVER            Receiver;
+    XENNET_RECEIVER_CACHE_CTOR  Ctor;
+    XENNET_RECEIVER_CACHE_DTOR  Dtor;
+    KSPIN_LOCK                  Lock;
+    LIST_ENTRY                  FullList;
+    ULONG                       FullCount;
+    ULONG                       FullLimit;
+    LIST_ENTRY                  EmptyList;
+    XENNET_RECEIVER_PROCESSOR   Processor[HVM_MAX_VCPUS];
+} XENNET_RECEIVER_CACHE, *PXENNET_RECEIVER_CACHE;
+
+#define RECEIVER_DEPOT_LIMIT    64
+
+//
+// Frames no bigger than the copy-break threshold are copied into
+// driver-owned buffers so the ring buffer can go straight back to
+// XENVIF. The buffers are pre-bound to their NBLs and kept in their
+// own cache. The number of copy buffers in existence is bounded; once
+// they are all in use frames are indicated in place instead.
+//
+#define RECEIVER_COPY_BREAK_MAX 512
+#define RECEIVER_COPY_POOL_MAX  2048
 
 struct _XENNET_RECEIVER {
     PXENNET_ADAPTER             Adapter;
+    BOOLEAN                     Enabled;
     NDIS_HANDLE                 NetBufferListPool;
-    PNET_BUFFER_LIST            PutList;
-    PNET_BUFFER_LIST            GetList[HVM_MAX_VCPUS];
+    XENNET_RECEIVER_CACHE       Cache;
+    XENNET_RECEIVER_CACHE       CopyCache;
+    ULONG                       CopyBreak;
+    LONG                        CopyCount;
+    BOOLEAN                     CoalesceIpVersion4;
+    BOOLEAN                     CoalesceIpVersion6;
+    BOOLEAN                     ValidateChecksums;
+    ULONG                       HashTypes;
+    PHASH_TOEPLITZ              Toeplitz;
+    BOOLEAN                     Steering;
+    ULONG                       SteeringTable[RECEIVER_STEERING_TABLE_SIZE];
+    ULONG                       SteeringEntries;
+    ULONG                       SteeringProcessors;
+    ULONG                       SteeringTableSize;
     XENNET_RECEIVER_QUEUE       Queue[HVM_MAX_VCPUS];
+    XENNET_RECEIVER_TARGET      Target[HVM_MAX_VCPUS];
     LONG                        Indicated;
     LONG                        Returned;
     XENVIF_VIF_OFFLOAD_OPTIONS  OffloadOptions;
@@ -61,365 +230,2000 @@ struct _XENNET_RECEIVER {
 #define RECEIVER_POOL_TAG       'RteN'
 #define IN_NDIS_MAX             1024
 
+//
+// Once the receiver is disabled nothing more is indicated: packets that
+// are still staged, deferred or steered are returned straight to
+// XENVIF, and pausing waits for NDIS to return everything that has
+// already been indicated.
+//
+#define RECEIVER_RETURN_POLL    100000  // 10ms in 100ns units
+#define RECEIVER_RETURN_WARN    100     // Polls between warnings
+
+#define RECEIVER_NBL_FLAGS      (NDIS_NBL_FLAGS_IS_IPV4 |   \
+                                 NDIS_NBL_FLAGS_IS_IPV6 |   \
+                                 NDIS_NBL_FLAGS_IS_TCP |    \
+                                 NDIS_NBL_FLAGS_IS_UDP)
+
 typedef struct _NET_BUFFER_LIST_RESERVED {
-    PVOID   Cookie;
+    PVOID               Cookie;
+    PNET_BUFFER_LIST    Coalesced;  // NBLs parked on an SCU
 } NET_BUFFER_LIST_RESERVED, *PNET_BUFFER_LIST_RESERVED;
 
 C_ASSERT(sizeof (NET_BUFFER_LIST_RESERVED) <= RTL_FIELD_SIZE(NET_BUFFER_LIST, MiniportReserved));
 
-static FORCEINLINE PNET_BUFFER_LIST
-__ReceiverGetNetBufferList(
-    IN  PXENNET_RECEIVER    Receiver
+static FORCEINLINE PVOID
+__ReceiverGetCookie(
+    IN  PNET_BUFFER_LIST        NetBufferList
     )
 {
-    ULONG                   Index;
-    PNET_BUFFER_LIST        NetBufferList;
-
-    Index = KeGetCurrentProcessorNumberEx(NULL);
+    PNET_BUFFER_LIST_RESERVED   ListReserved;
 
-    NetBufferList = Receiver->GetList[Index];
+    ListReserved = (PNET_BUFFER_LIST_RESERVED)NET_BUFFER_LIST_MINIPORT_RESERVED(NetBufferList);
+    return ListReserved->Cookie;
+}
 
-    if (NetBufferList == NULL)
-        Receiver->GetList[Index] =
-            InterlockedExchangePointer(&Receiver->PutList, NULL);
+static FORCEINLINE VOID
+__ReceiverQueueAcquire(
+    IN  PXENNET_RECEIVER_QUEUE  Queue
+    )
+{
+    PVOID                       Owner;
+
+#if DBG
+    Owner = InterlockedCompareExchangePointer(&Queue->Owner,
+                                              KeGetCurrentThread(),
+                                              NULL);
+#else
+    Owner = Queue->Owner;
+    Queue->Owner = KeGetCurrentThread();
+#endif
+
+    if (Owner != NULL)
+        BUG("CONCURRENT RECEIVE QUEUE PRODUCERS");
+}
 
-    NetBufferList = Receiver->GetList[Index];
+static FORCEINLINE VOID
+__ReceiverQueueRelease(
+    IN  PXENNET_RECEIVER_QUEUE  Queue
+    )
+{
+    PVOID                       Owner;
 
-    if (NetBufferList == NULL)
-        return NULL;
+#if DBG
+    Owner = InterlockedExchangePointer(&Queue->Owner, NULL);
+#else
+    Owner = Queue->Owner;
+    Queue->Owner = NULL;
+#endif
 
-    Receiver->GetList[Index] = NET_BUFFER_LIST_NEXT_NBL(NetBufferList);
-    NET_BUFFER_LIST_NEXT_NBL(NetBufferList) = NULL;
+    if (Owner != KeGetCurrentThread())
+        BUG("CONCURRENT RECEIVE QUEUE PRODUCERS");
+}
 
-    return NetBufferList;
+static VOID
+__ReceiverCacheInitialize(
+    IN  PXENNET_RECEIVER_CACHE      Cache,
+    IN  PXENNET_RECEIVER            Receiver,
+    IN  XENNET_RECEIVER_CACHE_CTOR  Ctor,
+    IN  XENNET_RECEIVER_CACHE_DTOR  Dtor,
+    IN  ULONG                       FullLimit
+    )
+{
+    Cache->Receiver = Receiver;
+    Cache->Ctor = Ctor;
+    Cache->Dtor = Dtor;
+
+    KeInitializeSpinLock(&Cache->Lock);
+    InitializeListHead(&Cache->FullList);
+    InitializeListHead(&Cache->EmptyList);
+    Cache->FullLimit = FullLimit;
 }
 
-static FORCEINLINE VOID
-__ReceiverPutNetBufferList(
-    IN  PXENNET_RECEIVER    Receiver,
-    IN  PNET_BUFFER_LIST    NetBufferList
+static VOID
+__ReceiverCacheFreeMagazine(
+    IN  PXENNET_RECEIVER_CACHE      Cache,
+    IN  PXENNET_RECEIVER_MAGAZINE   Magazine
     )
 {
-    PNET_BUFFER_LIST        Old;
-    PNET_BUFFER_LIST        New;
+    while (Magazine->Count != 0) {
+        PNET_BUFFER_LIST    NetBufferList;
 
-    ASSERT3P(NET_BUFFER_LIST_NEXT_NBL(NetBufferList), ==, NULL);
+        NetBufferList = Magazine->Slot[--Magazine->Count];
+        Magazine->Slot[Magazine->Count] = NULL;
 
-    do {
-        Old = Receiver->PutList;
+        Cache->Dtor(Cache->Receiver, NetBufferList);
+    }
 
-        NET_BUFFER_LIST_NEXT_NBL(NetBufferList) = Old;
-        New = NetBufferList;
-    } while (InterlockedCompareExchangePointer(&Receiver->PutList, New, Old) != Old);
+    __FreePoolWithTag(Magazine, RECEIVER_POOL_TAG);
 }
 
-static PNET_BUFFER_LIST
-__ReceiverAllocateNetBufferList(
-    IN  PXENNET_RECEIVER        Receiver,
-    IN  PMDL                    Mdl,
-    IN  ULONG                   Offset,
-    IN  ULONG                   Length,
-    IN  PVOID                   Cookie
+static VOID
+__ReceiverCacheTeardown(
+    IN  PXENNET_RECEIVER_CACHE  Cache
     )
 {
-    PNET_BUFFER_LIST            NetBufferList;
+    ULONG                       Index;
 
-    ASSERT3U(KeGetCurrentIrql(), ==, DISPATCH_LEVEL);
+    for (Index = 0; Index < HVM_MAX_VCPUS; Index++) {
+        PXENNET_RECEIVER_PROCESSOR  Processor = &Cache->Processor[Index];
+
+        if (Processor->Loaded != NULL) {
+            __ReceiverCacheFreeMagazine(Cache, Processor->Loaded);
+            Processor->Loaded = NULL;
+        }
 
-    NetBufferList = __ReceiverGetNetBufferList(Receiver);
-    if (NetBufferList != NULL) {
-        PNET_BUFFER NetBuffer;
+        if (Processor->Previous != NULL) {
+            __ReceiverCacheFreeMagazine(Cache, Processor->Previous);
+            Processor->Previous = NULL;
+        }
 
-        NET_BUFFER_LIST_INFO(NetBufferList, TcpIpChecksumNetBufferListInfo) = NULL;
-        NET_BUFFER_LIST_INFO(NetBufferList, Ieee8021QNetBufferListInfo) = NULL;
-        NET_BUFFER_LIST_INFO(NetBufferList, NetBufferListHashInfo) = NULL;
-        NET_BUFFER_LIST_INFO(NetBufferList, NetBufferListHashValue) = NULL;
+        Processor->Hit = 0;
+        Processor->Miss = 0;
+    }
 
-        NetBuffer = NET_BUFFER_LIST_FIRST_NB(NetBufferList);
-        NET_BUFFER_FIRST_MDL(NetBuffer) = Mdl;
-        NET_BUFFER_CURRENT_MDL(NetBuffer) = Mdl;
-        NET_BUFFER_DATA_OFFSET(NetBuffer) = Offset;
-        NET_BUFFER_DATA_LENGTH(NetBuffer) = Length;
-        NET_BUFFER_CURRENT_MDL_OFFSET(NetBuffer) = Offset;
+    while (!IsListEmpty(&Cache->FullList)) {
+        PLIST_ENTRY ListEntry;
 
-        ASSERT3P(NET_BUFFER_NEXT_NB(NetBuffer), ==, NULL);
-    } else {
-        NetBufferList = NdisAllocateNetBufferAndNetBufferList(Receiver->NetBufferListPool,
-                                                              0,
-                                                              0,
-                                                              Mdl,
-                                                              Offset,
-                                                              Length);
-        ASSERT(IMPLY(NetBufferList != NULL, NET_BUFFER_LIST_NEXT_NBL(NetBufferList) == NULL));
+        ListEntry = RemoveHeadList(&Cache->FullList);
+        __ReceiverCacheFreeMagazine(Cache,
+                                    CONTAINING_RECORD(ListEntry,
+                                                      XENNET_RECEIVER_MAGAZINE,
+                                                      ListEntry));
+        --Cache->FullCount;
     }
+    ASSERT3U(Cache->FullCount, ==, 0);
 
-    if (NetBufferList != NULL) {
-        PNET_BUFFER_LIST_RESERVED   ListReserved;
+    while (!IsListEmpty(&Cache->EmptyList)) {
+        PLIST_ENTRY ListEntry;
 
-        ListReserved = (PNET_BUFFER_LIST_RESERVED)NET_BUFFER_LIST_MINIPORT_RESERVED(NetBufferList);
-        ASSERT3P(ListReserved->Cookie, ==, NULL);
-        ListReserved->Cookie = Cookie;
+        ListEntry = RemoveHeadList(&Cache->EmptyList);
+        __ReceiverCacheFreeMagazine(Cache,
+                                    CONTAINING_RECORD(ListEntry,
+                                                      XENNET_RECEIVER_MAGAZINE,
+                                                      ListEntry));
     }
 
-    return NetBufferList;
-}        
+    Cache->FullLimit = 0;
 
-static PVOID
-__ReceiverReleaseNetBufferList(
-    IN  PXENNET_RECEIVER        Receiver,
-    IN  PNET_BUFFER_LIST        NetBufferList,
-    IN  BOOLEAN                 Cache
+    Cache->Dtor = NULL;
+    Cache->Ctor = NULL;
+    Cache->Receiver = NULL;
+}
+
+// Pre-load the depot with enough full magazines to hold Count NBLs
+static NDIS_STATUS
+__ReceiverCacheFill(
+    IN  PXENNET_RECEIVER_CACHE  Cache,
+    IN  ULONG                   Count
     )
 {
-    PNET_BUFFER_LIST_RESERVED   ListReserved;
-    PVOID                       Cookie;
+    ULONG                       Magazines;
+    KIRQL                       Irql;
+    NDIS_STATUS                 status;
 
-    ListReserved = (PNET_BUFFER_LIST_RESERVED)NET_BUFFER_LIST_MINIPORT_RESERVED(NetBufferList);
-    Cookie = ListReserved->Cookie;
-    ListReserved->Cookie = NULL;
+    ASSERT3U(KeGetCurrentIrql(), ==, PASSIVE_LEVEL);
 
-    if (Cache)
-        __ReceiverPutNetBufferList(Receiver, NetBufferList);
-    else
-        NdisFreeNetBufferList(NetBufferList);
+    Magazines = (Count + RECEIVER_MAGAZINE_SIZE - 1) / RECEIVER_MAGAZINE_SIZE;
 
-    return Cookie;
-}
+    KeAcquireSpinLock(&Cache->Lock, &Irql);
+    if (Cache->FullLimit < Magazines)
+        Cache->FullLimit = Magazines;
+    KeReleaseSpinLock(&Cache->Lock, Irql);
 
-static FORCEINLINE VOID
-__ReceiverReturnNetBufferLists(
-    IN  PXENNET_RECEIVER    Receiver,
-    IN  PNET_BUFFER_LIST    NetBufferList,
-    IN  BOOLEAN             Cache
-    )
-{
-    PXENVIF_VIF_INTERFACE   VifInterface;
-    LONG                    Count;
+    for (;;) {
+        PXENNET_RECEIVER_MAGAZINE   Magazine;
+        BOOLEAN                     Complete;
 
-    VifInterface = AdapterGetVifInterface(Receiver->Adapter);
+        KeAcquireSpinLock(&Cache->Lock, &Irql);
+        Complete = (Cache->FullCount >= Magazines) ? TRUE : FALSE;
+        KeReleaseSpinLock(&Cache->Lock, Irql);
 
-    Count = 0;
+        if (Complete)
+            break;
 
-    while (NetBufferList != NULL) {
-        PNET_BUFFER_LIST        Next;
-        PVOID                   Cookie;
+        Magazine = __AllocatePoolWithTag(NonPagedPool,
+                                         sizeof (XENNET_RECEIVER_MAGAZINE),
+                                         RECEIVER_POOL_TAG);
 
-        Next = NET_BUFFER_LIST_NEXT_NBL(NetBufferList);
-        NET_BUFFER_LIST_NEXT_NBL(NetBufferList) = NULL;
+        status = NDIS_STATUS_RESOURCES;
+        if (Magazine == NULL)
+            goto fail1;
 
-        Cookie = __ReceiverReleaseNetBufferList(Receiver, NetBufferList, Cache);
+        while (Magazine->Count < RECEIVER_MAGAZINE_SIZE) {
+            PNET_BUFFER_LIST    NetBufferList;
 
-        XENVIF_VIF(ReceiverReturnPacket,
-                   VifInterface,
-                   Cookie);
+            NetBufferList = Cache->Ctor(Cache->Receiver);
+            if (NetBufferList == NULL)
+                break;
 
-        Count++;
+            Magazine->Slot[Magazine->Count++] = NetBufferList;
+        }
 
-        NetBufferList = Next;
+        status = NDIS_STATUS_RESOURCES;
+        if (Magazine->Count == 0)
+            goto fail2;
+
+        KeAcquireSpinLock(&Cache->Lock, &Irql);
+        InsertTailList(&Cache->FullList, &Magazine->ListEntry);
+        Cache->FullCount++;
+        KeReleaseSpinLock(&Cache->Lock, Irql);
+
+        // A partial magazine means we have run out of memory
+        status = NDIS_STATUS_RESOURCES;
+        if (Magazine->Count < RECEIVER_MAGAZINE_SIZE)
+            goto fail1;
     }
 
-    (VOID) InterlockedAdd(&Receiver->Returned, Count);
+    return NDIS_STATUS_SUCCESS;
+
+fail2:
+    Error("fail2\n");
+
+    __FreePoolWithTag(Magazine, RECEIVER_POOL_TAG);
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
 }
 
-static PNET_BUFFER_LIST
-__ReceiverReceivePacket(
-    IN  PXENNET_RECEIVER                        Receiver,
-    IN  PMDL                                    Mdl,
-    IN  ULONG                                   Offset,
-    IN  ULONG                                   Length,
-    IN  XENVIF_PACKET_CHECKSUM_FLAGS            Flags,
-    IN  USHORT                                  MaximumSegmentSize,
-    IN  USHORT                                  TagControlInformation,
-    IN  PXENVIF_PACKET_INFO                     Info,
-    IN  PXENVIF_PACKET_HASH                     Hash,
-    IN  PVOID                                   Cookie
+// Swap an empty (or absent) previous magazine for a full one from the depot
+static BOOLEAN
+__ReceiverCacheExchangeFull(
+    IN  PXENNET_RECEIVER_CACHE      Cache,
+    IN  PXENNET_RECEIVER_PROCESSOR  Processor
     )
 {
-    PNET_BUFFER_LIST                            NetBufferList;
-    NDIS_TCP_IP_CHECKSUM_NET_BUFFER_LIST_INFO   csumInfo;
+    PLIST_ENTRY                     ListEntry;
 
-    UNREFERENCED_PARAMETER(MaximumSegmentSize);
-    UNREFERENCED_PARAMETER(Info);
+    ASSERT(IMPLY(Processor->Previous != NULL, Processor->Previous->Count == 0));
 
-    NetBufferList = __ReceiverAllocateNetBufferList(Receiver,
-                                                    Mdl,
-                                                    Offset,
-                                                    Length,
-                                                    Cookie);
-    if (NetBufferList == NULL)
-        goto fail1;
+    KeAcquireSpinLockAtDpcLevel(&Cache->Lock);
 
-    NetBufferList->SourceHandle = AdapterGetHandle(Receiver->Adapter);
+    if (IsListEmpty(&Cache->FullList)) {
+        KeReleaseSpinLockFromDpcLevel(&Cache->Lock);
+        return FALSE;
+    }
 
-    csumInfo.Value = 0;
+    ListEntry = RemoveHeadList(&Cache->FullList);
+    --Cache->FullCount;
 
-    csumInfo.Receive.IpChecksumSucceeded = Flags.IpChecksumSucceeded;
-    csumInfo.Receive.IpChecksumFailed = Flags.IpChecksumFailed;
+    if (Processor->Previous != NULL)
+        InsertTailList(&Cache->EmptyList, &Processor->Previous->ListEntry);
 
-    csumInfo.Receive.TcpChecksumSucceeded = Flags.TcpChecksumSucceeded;
-    csumInfo.Receive.TcpChecksumFailed = Flags.TcpChecksumFailed;
+    KeReleaseSpinLockFromDpcLevel(&Cache->Lock);
 
-    csumInfo.Receive.UdpChecksumSucceeded = Flags.UdpChecksumSucceeded;
-    csumInfo.Receive.UdpChecksumFailed = Flags.UdpChecksumFailed;
+    Processor->Previous = Processor->Loaded;
+    Processor->Loaded = CONTAINING_RECORD(ListEntry,
+                                          XENNET_RECEIVER_MAGAZINE,
+                                          ListEntry);
+    ASSERT(Processor->Loaded->Count != 0);
 
-    NET_BUFFER_LIST_INFO(NetBufferList, TcpIpChecksumNetBufferListInfo) = (PVOID)(ULONG_PTR)csumInfo.Value;
+    return TRUE;
+}
 
-    if (TagControlInformation != 0) {
-        NDIS_NET_BUFFER_LIST_8021Q_INFO Ieee8021QInfo;
+// Swap a full (or absent) previous magazine for an empty one from the depot
+static BOOLEAN
+__ReceiverCacheExchangeEmpty(
+    IN  PXENNET_RECEIVER_CACHE      Cache,
+    IN  PXENNET_RECEIVER_PROCESSOR  Processor
+    )
+{
+    PXENNET_RECEIVER_MAGAZINE       Magazine;
+    PLIST_ENTRY                     ListEntry;
 
-        UNPACK_TAG_CONTROL_INFORMATION(TagControlInformation,
-                                       Ieee8021QInfo.TagHeader.UserPriority,
-                                       Ieee8021QInfo.TagHeader.CanonicalFormatId,
-                                       Ieee8021QInfo.TagHeader.VlanId);
+    ASSERT(IMPLY(Processor->Previous != NULL,
+                 Processor->Previous->Count == RECEIVER_MAGAZINE_SIZE));
 
-        if (Ieee8021QInfo.TagHeader.VlanId != 0)
-            goto fail2;
+    KeAcquireSpinLockAtDpcLevel(&Cache->Lock);
 
-        NET_BUFFER_LIST_INFO(NetBufferList, Ieee8021QNetBufferListInfo) = Ieee8021QInfo.Value;
-    }
+    if (Processor->Previous != NULL &&
+        Cache->FullCount >= Cache->FullLimit)
+        goto fail1;
 
-    switch (Hash->Algorithm) {
-    case XENVIF_PACKET_HASH_ALGORITHM_TOEPLITZ:
-        NET_BUFFER_LIST_SET_HASH_FUNCTION(NetBufferList,
-                                          NdisHashFunctionToeplitz);
-        break;
+    if (IsListEmpty(&Cache->EmptyList)) {
+        KeReleaseSpinLockFromDpcLevel(&Cache->Lock);
 
-    default:
-        goto done;
-    }
+        // Don't hold the depot lock across the allocation; publish the
+        // new magazine on the empty list once the lock is retaken
+        Magazine = __AllocatePoolWithTag(NonPagedPool,
+                                         sizeof (XENNET_RECEIVER_MAGAZINE),
+                                         RECEIVER_POOL_TAG);
+        if (Magazine == NULL)
+            return FALSE;
 
-    switch (Hash->Type) {
-    case XENVIF_PACKET_HASH_TYPE_IPV4:
-        NET_BUFFER_LIST_SET_HASH_TYPE(NetBufferList,
-                                      NDIS_HASH_IPV4);
-        break;
+        KeAcquireSpinLockAtDpcLevel(&Cache->Lock);
 
-    case XENVIF_PACKET_HASH_TYPE_IPV4_TCP:
-        NET_BUFFER_LIST_SET_HASH_TYPE(NetBufferList,
-                                      NDIS_HASH_TCP_IPV4);
-        break;
+        InsertTailList(&Cache->EmptyList, &Magazine->ListEntry);
 
-    case XENVIF_PACKET_HASH_TYPE_IPV6:
-        NET_BUFFER_LIST_SET_HASH_TYPE(NetBufferList,
-                                      NDIS_HASH_IPV6);
-        break;
+        // The depot may have filled up while the lock was dropped
+        if (Processor->Previous != NULL &&
+            Cache->FullCount >= Cache->FullLimit)
+            goto fail2;
+    }
 
-    case XENVIF_PACKET_HASH_TYPE_IPV6_TCP:
-        NET_BUFFER_LIST_SET_HASH_TYPE(NetBufferList,
-                                      NDIS_HASH_TCP_IPV6);
-        break;
+    ListEntry = RemoveHeadList(&Cache->EmptyList);
+    Magazine = CONTAINING_RECORD(ListEntry,
+                                 XENNET_RECEIVER_MAGAZINE,
+                                 ListEntry);
 
-    default:
-        ASSERT(FALSE);
-        break;
+    if (Processor->Previous != NULL) {
+        InsertTailList(&Cache->FullList, &Processor->Previous->ListEntry);
+        Cache->FullCount++;
     }
 
-    NET_BUFFER_LIST_SET_HASH_VALUE(NetBufferList,
-                                   Hash->Value);
+    KeReleaseSpinLockFromDpcLevel(&Cache->Lock);
 
-done:
-    return NetBufferList;
+    ASSERT3U(Magazine->Count, ==, 0);
 
-fail2:
-    (VOID) __ReceiverReleaseNetBufferList(Receiver, NetBufferList, TRUE);
+    Processor->Previous = Processor->Loaded;
+    Processor->Loaded = Magazine;
 
+    return TRUE;
+
+fail2:
 fail1:
-    return NULL;
+    KeReleaseSpinLockFromDpcLevel(&Cache->Lock);
+
+    return FALSE;
 }
 
-static FORCEINLINE VOID __IndicateReceiveNetBufferLists(
-    IN  PXENNET_RECEIVER    Receiver,
-    IN  PNET_BUFFER_LIST    NetBufferLists,
-    IN  NDIS_PORT_NUMBER    PortNumber,
-    IN  ULONG               NumberOfNetBufferLists,
-    IN  ULONG               ReceiveFlags
+static FORCEINLINE PNET_BUFFER_LIST
+__ReceiverCacheGet(
+    IN  PXENNET_RECEIVER_CACHE  Cache
     )
 {
-    PXENNET_ADAPTER         Adapter = Receiver->Adapter;
-    NDIS_HANDLE             MiniportAdapterHandle = AdapterGetHandle(Adapter);
-    PXENVIF_VIF_INTERFACE   VifInterface;
-    ULONG                   Count;
+    PXENNET_RECEIVER_PROCESSOR  Processor;
+    PXENNET_RECEIVER_MAGAZINE   Magazine;
+    PNET_BUFFER_LIST            NetBufferList;
 
-    VifInterface = AdapterGetVifInterface(Receiver->Adapter);
+    ASSERT3U(KeGetCurrentIrql(), ==, DISPATCH_LEVEL);
 
-    Count = 0;
-    while (NetBufferLists != NULL) {
-        PNET_BUFFER_LIST        Next;
+    Processor = &Cache->Processor[KeGetCurrentProcessorNumberEx(NULL)];
+
+    Magazine = Processor->Loaded;
+    if (Magazine == NULL || Magazine->Count == 0) {
+        if (Processor->Previous != NULL &&
+            Processor->Previous->Count != 0) {
+            Processor->Loaded = Processor->Previous;
+            Processor->Previous = Magazine;
+        } else if (!__ReceiverCacheExchangeFull(Cache, Processor)) {
+            Processor->Miss++;
+            return Cache->Ctor(Cache->Receiver);
+        }
+
+        Magazine = Processor->Loaded;
+    }
 
-        Next = NET_BUFFER_LIST_NEXT_NBL(NetBufferLists);
-        NET_BUFFER_LIST_NEXT_NBL(NetBufferLists) = NULL;
+    NetBufferList = Magazine->Slot[--Magazine->Count];
+    Magazine->Slot[Magazine->Count] = NULL;
 
-        NdisMIndicateReceiveNetBufferLists(MiniportAdapterHandle,
-                                           NetBufferLists,
-                                           PortNumber,
-                                           1,
-                                           ReceiveFlags);
+    Processor->Hit++;
 
-        if (ReceiveFlags & NDIS_RECEIVE_FLAGS_RESOURCES) {
-            PVOID   Cookie;
+    return NetBufferList;
+}
 
-            Cookie = __ReceiverReleaseNetBufferList(Receiver,
-                                                    NetBufferLists,
-                                                    FALSE);
+static FORCEINLINE VOID
+__ReceiverCachePut(
+    IN  PXENNET_RECEIVER_CACHE  Cache,
+    IN  PNET_BUFFER_LIST        NetBufferList
+    )
+{
+    PXENNET_RECEIVER_PROCESSOR  Processor;
+    PXENNET_RECEIVER_MAGAZINE   Magazine;
 
-            XENVIF_VIF(ReceiverReturnPacket,
-                       VifInterface,
-                       Cookie);
+    ASSERT3U(KeGetCurrentIrql(), ==, DISPATCH_LEVEL);
+    ASSERT3P(NET_BUFFER_LIST_NEXT_NBL(NetBufferList), ==, NULL);
 
-            (VOID) InterlockedIncrement(&Receiver->Returned);
+    Processor = &Cache->Processor[KeGetCurrentProcessorNumberEx(NULL)];
+
+    Magazine = Processor->Loaded;
+    if (Magazine == NULL || Magazine->Count == RECEIVER_MAGAZINE_SIZE) {
+        if (Processor->Previous != NULL &&
+            Processor->Previous->Count != RECEIVER_MAGAZINE_SIZE) {
+            Processor->Loaded = Processor->Previous;
+            Processor->Previous = Magazine;
+        } else if (!__ReceiverCacheExchangeEmpty(Cache, Processor)) {
+            Cache->Dtor(Cache->Receiver, NetBufferList);
+            return;
         }
 
-        Count++;
-        NetBufferLists = Next;
+        Magazine = Processor->Loaded;
     }
-    ASSERT3U(Count, ==, NumberOfNetBufferLists);
+
+    Magazine->Slot[Magazine->Count++] = NetBufferList;
 }
 
 static VOID
-__ReceiverPushPackets(
+__ReceiverCacheStatistics(
+    IN  PXENNET_RECEIVER_CACHE  Cache,
+    OUT PULONG                  Hit,
+    OUT PULONG                  Miss
+    )
+{
+    ULONG                       Index;
+
+    *Hit = *Miss = 0;
+
+    for (Index = 0; Index < HVM_MAX_VCPUS; Index++) {
+        PXENNET_RECEIVER_PROCESSOR  Processor = &Cache->Processor[Index];
+
+        *Hit += Processor->Hit;
+        *Miss += Processor->Miss;
+    }
+}
+
+static PNET_BUFFER_LIST
+__ReceiverPacketCtor(
+    IN  PXENNET_RECEIVER    Receiver
+    )
+{
+    return NdisAllocateNetBufferAndNetBufferList(Receiver->NetBufferListPool,
+                                                 0,
+                                                 0,
+                                                 NULL,
+                                                 0,
+                                                 0);
+}
+
+static VOID
+__ReceiverPacketDtor(
     IN  PXENNET_RECEIVER    Receiver,
-    IN  ULONG               Index
+    IN  PNET_BUFFER_LIST    NetBufferList
     )
 {
-    ULONG                   Flags;
-    LONG                    Indicated;
-    LONG                    Returned;
-    PXENNET_RECEIVER_QUEUE  Queue;
+    UNREFERENCED_PARAMETER(Receiver);
+
+    NdisFreeNetBufferList(NetBufferList);
+}
+
+static PNET_BUFFER_LIST
+__ReceiverCopyCtor(
+    IN  PXENNET_RECEIVER    Receiver
+    )
+{
+    PUCHAR                  Buffer;
+    PMDL                    Mdl;
     PNET_BUFFER_LIST        NetBufferList;
-    ULONG                   Count;
 
-    Queue = &Receiver->Queue[Index];
+    if (InterlockedIncrement(&Receiver->CopyCount) > RECEIVER_COPY_POOL_MAX)
+        goto fail1;
+
+    Buffer = __AllocatePoolWithTag(NonPagedPool,
+                                   RECEIVER_COPY_BREAK_MAX,
+                                   RECEIVER_POOL_TAG);
+    if (Buffer == NULL)
+        goto fail2;
+
+    Mdl = NdisAllocateMdl(AdapterGetHandle(Receiver->Adapter),
+                          Buffer,
+                          RECEIVER_COPY_BREAK_MAX);
+    if (Mdl == NULL)
+        goto fail3;
+
+    NetBufferList = NdisAllocateNetBufferAndNetBufferList(Receiver->NetBufferListPool,
+                                                          0,
+                                                          0,
+                                                          Mdl,
+                                                          0,
+                                                          0);
+    if (NetBufferList == NULL)
+        goto fail4;
+
+    return NetBufferList;
+
+fail4:
+    NdisFreeMdl(Mdl);
+
+fail3:
+    __FreePoolWithTag(Buffer, RECEIVER_POOL_TAG);
+
+fail2:
+fail1:
+    (VOID) InterlockedDecrement(&Receiver->CopyCount);
+
+    return NULL;
+}
+
+static VOID
+__ReceiverCopyDtor(
+    IN  PXENNET_RECEIVER    Receiver,
+    IN  PNET_BUFFER_LIST    NetBufferList
+    )
+{
+    PNET_BUFFER             NetBuffer;
+    PMDL                    Mdl;
+    PUCHAR                  Buffer;
+
+    NetBuffer = NET_BUFFER_LIST_FIRST_NB(NetBufferList);
+    Mdl = NET_BUFFER_FIRST_MDL(NetBuffer);
+    Buffer = MmGetMdlVirtualAddress(Mdl);
+
+    NdisFreeNetBufferList(NetBufferList);
+    NdisFreeMdl(Mdl);
+    __FreePoolWithTag(Buffer, RECEIVER_POOL_TAG);
+
+    (VOID) InterlockedDecrement(&Receiver->CopyCount);
+}
+
+static FORCEINLINE VOID
+__ReceiverResetNetBufferList(
+    IN  PNET_BUFFER_LIST    NetBufferList
+    )
+{
+    NET_BUFFER_LIST_INFO(NetBufferList, TcpIpChecksumNetBufferListInfo) = NULL;
+    NET_BUFFER_LIST_INFO(NetBufferList, Ieee8021QNetBufferListInfo) = NULL;
+    NET_BUFFER_LIST_INFO(NetBufferList, NetBufferListHashInfo) = NULL;
+    NET_BUFFER_LIST_INFO(NetBufferList, NetBufferListHashValue) = NULL;
+    NET_BUFFER_LIST_INFO(NetBufferList, TcpRecvSegCoalesceInfo) = NULL;
+    NET_BUFFER_LIST_INFO(NetBufferList, RscTcpTimestampDelta) = NULL;
+    NET_BUFFER_LIST_INFO(NetBufferList, NetBufferListFrameType) = NULL;
+
+    NdisClearNblFlag(NetBufferList, RECEIVER_NBL_FLAGS);
+
+    ASSERT3P(NET_BUFFER_LIST_NEXT_NBL(NetBufferList), ==, NULL);
+    ASSERT3P(NET_BUFFER_NEXT_NB(NET_BUFFER_LIST_FIRST_NB(NetBufferList)), ==, NULL);
+}
+
+static PNET_BUFFER_LIST
+__ReceiverAllocateNetBufferList(
+    IN  PXENNET_RECEIVER        Receiver,
+    IN  PMDL                    Mdl,
+    IN  ULONG                   Offset,
+    IN  ULONG                   Length,
+    IN  PVOID                   Cookie
+    )
+{
+    PNET_BUFFER_LIST            NetBufferList;
+    PNET_BUFFER                 NetBuffer;
+    PNET_BUFFER_LIST_RESERVED   ListReserved;
+
+    ASSERT3U(KeGetCurrentIrql(), ==, DISPATCH_LEVEL);
+
+    NetBufferList = __ReceiverCacheGet(&Receiver->Cache);
+    if (NetBufferList == NULL)
+        return NULL;
+
+    __ReceiverResetNetBufferList(NetBufferList);
+
+    NetBuffer = NET_BUFFER_LIST_FIRST_NB(NetBufferList);
+    NET_BUFFER_FIRST_MDL(NetBuffer) = Mdl;
+    NET_BUFFER_CURRENT_MDL(NetBuffer) = Mdl;
+    NET_BUFFER_DATA_OFFSET(NetBuffer) = Offset;
+    NET_BUFFER_DATA_LENGTH(NetBuffer) = Length;
+    NET_BUFFER_CURRENT_MDL_OFFSET(NetBuffer) = Offset;
+
+    ListReserved = (PNET_BUFFER_LIST_RESERVED)NET_BUFFER_LIST_MINIPORT_RESERVED(NetBufferList);
+    ASSERT3P(ListReserved->Cookie, ==, NULL);
+    ASSERT3P(ListReserved->Coalesced, ==, NULL);
+    ListReserved->Cookie = Cookie;
+
+    return NetBufferList;
+}
+
+static PNET_BUFFER_LIST
+__ReceiverCopyNetBufferList(
+    IN  PXENNET_RECEIVER        Receiver,
+    IN  PMDL                    Mdl,
+    IN  ULONG                   Offset,
+    IN  ULONG                   Length
+    )
+{
+    PNET_BUFFER_LIST            NetBufferList;
+    PNET_BUFFER                 NetBuffer;
+    PMDL                        CopyMdl;
+    PUCHAR                      Buffer;
+
+    ASSERT3U(KeGetCurrentIrql(), ==, DISPATCH_LEVEL);
+    ASSERT3U(Length, <=, RECEIVER_COPY_BREAK_MAX);
+
+    NetBufferList = __ReceiverCacheGet(&Receiver->CopyCache);
+    if (NetBufferList == NULL)
+        goto fail1;
+
+    __ReceiverResetNetBufferList(NetBufferList);
+
+    NetBuffer = NET_BUFFER_LIST_FIRST_NB(NetBufferList);
+    CopyMdl = NET_BUFFER_FIRST_MDL(NetBuffer);
+
+    Buffer = MmGetSystemAddressForMdlSafe(CopyMdl, NormalPagePriority);
+    ASSERT(Buffer != NULL);
+
+    NET_BUFFER_CURRENT_MDL(NetBuffer) = CopyMdl;
+    NET_BUFFER_DATA_OFFSET(NetBuffer) = 0;
+    NET_BUFFER_DATA_LENGTH(NetBuffer) = Length;
+    NET_BUFFER_CURRENT_MDL_OFFSET(NetBuffer) = 0;
+
+    while (Length != 0) {
+        PUCHAR  MdlMappedSystemVa;
+        ULONG   Count;
+
+        ASSERT(Mdl != NULL);
+
+        if (Offset >= Mdl->ByteCount) {
+            Offset -= Mdl->ByteCount;
+            Mdl = Mdl->Next;
+            continue;
+        }
+
+        MdlMappedSystemVa = MmGetSystemAddressForMdlSafe(Mdl, NormalPagePriority);
+        if (MdlMappedSystemVa == NULL)
+            goto fail2;
+
+        Count = __min(Mdl->ByteCount - Offset, Length);
+
+        RtlCopyMemory(Buffer, MdlMappedSystemVa + Offset, Count);
+        Buffer += Count;
+        Length -= Count;
+
+        Offset = 0;
+        Mdl = Mdl->Next;
+    }
+
+    // Copied packets do not hold a cookie
+    ASSERT3P(__ReceiverGetCookie(NetBufferList), ==, NULL);
+
+    return NetBufferList;
+
+fail2:
+    __ReceiverCachePut(&Receiver->CopyCache, NetBufferList);
+
+fail1:
+    return NULL;
+}
+
+static PVOID
+__ReceiverReleaseNetBufferList(
+    IN  PXENNET_RECEIVER        Receiver,
+    IN  PNET_BUFFER_LIST        NetBufferList,
+    IN  BOOLEAN                 Cache
+    )
+{
+    PNET_BUFFER_LIST_RESERVED   ListReserved;
+    PXENNET_RECEIVER_CACHE      NetBufferListCache;
+    PVOID                       Cookie;
+
+    ListReserved = (PNET_BUFFER_LIST_RESERVED)NET_BUFFER_LIST_MINIPORT_RESERVED(NetBufferList);
+    Cookie = ListReserved->Cookie;
+    ListReserved->Cookie = NULL;
+
+    NetBufferListCache = (Cookie != NULL) ?
+                         &Receiver->Cache :
+                         &Receiver->CopyCache;
+
+    if (Cache)
+        __ReceiverCachePut(NetBufferListCache, NetBufferList);
+    else
+        NetBufferListCache->Dtor(Receiver, NetBufferList);
+
+    return Cookie;
+}
+
+// Free the MDLs describing an SCU and hand back the NBLs parked on it
+static PNET_BUFFER_LIST
+__ReceiverUncoalesceNetBufferList(
+    IN  PNET_BUFFER_LIST        NetBufferList
+    )
+{
+    PNET_BUFFER_LIST_RESERVED   ListReserved;
+    PNET_BUFFER_LIST            Coalesced;
+    PNET_BUFFER                 NetBuffer;
+    PMDL                        Mdl;
+
+    ListReserved = (PNET_BUFFER_LIST_RESERVED)NET_BUFFER_LIST_MINIPORT_RESERVED(NetBufferList);
+    Coalesced = ListReserved->Coalesced;
+    ListReserved->Coalesced = NULL;
+
+    if (Coalesced == NULL)
+        return NULL;
+
+    // Every MDL in the chain of an SCU belongs to us
+    NetBuffer = NET_BUFFER_LIST_FIRST_NB(NetBufferList);
+    Mdl = NET_BUFFER_FIRST_MDL(NetBuffer);
+
+    NET_BUFFER_FIRST_MDL(NetBuffer) = NULL;
+    NET_BUFFER_CURRENT_MDL(NetBuffer) = NULL;
+
+    while (Mdl != NULL) {
+        PMDL    Next;
+
+        Next = Mdl->Next;
+        Mdl->Next = NULL;
+
+        NdisFreeMdl(Mdl);
+
+        Mdl = Next;
+    }
+
+    return Coalesced;
+}
+
+static FORCEINLINE VOID
+__ReceiverReturnNetBufferLists(
+    IN  PXENNET_RECEIVER    Receiver,
+    IN  PNET_BUFFER_LIST    NetBufferList,
+    IN  BOOLEAN             Cache
+    )
+{
+    PXENVIF_VIF_INTERFACE   VifInterface;
+    LONG                    Count;
+
+    VifInterface = AdapterGetVifInterface(Receiver->Adapter);
+
+    Count = 0;
+
+    while (NetBufferList != NULL) {
+        PNET_BUFFER_LIST        Next;
+        PNET_BUFFER_LIST        Coalesced;
+        PVOID                   Cookie;
+
+        Next = NET_BUFFER_LIST_NEXT_NBL(NetBufferList);
+        NET_BUFFER_LIST_NEXT_NBL(NetBufferList) = NULL;
+
+        // Parked NBLs are returned along with their SCU
+        Coalesced = __ReceiverUncoalesceNetBufferList(NetBufferList);
+        if (Coalesced != NULL) {
+            PNET_BUFFER_LIST    Last;
+
+            Last = Coalesced;
+            while (NET_BUFFER_LIST_NEXT_NBL(Last) != NULL)
+                Last = NET_BUFFER_LIST_NEXT_NBL(Last);
+
+            NET_BUFFER_LIST_NEXT_NBL(Last) = Next;
+            Next = Coalesced;
+        }
+
+        Cookie = __ReceiverReleaseNetBufferList(Receiver, NetBufferList, Cache);
+
+        if (Cookie != NULL) {
+            XENVIF_VIF(ReceiverReturnPacket,
+                       VifInterface,
+                       Cookie);
+
+            Count++;
+        }
+
+        NetBufferList = Next;
+    }
+
+    (VOID) InterlockedAdd(&Receiver->Returned, Count);
+}
+
+//
+// XENVIF has already parsed the headers, so pass on what it found to
+// save the protocol stack from doing it again.
+//
+static FORCEINLINE VOID
+__ReceiverClassifyPacket(
+    IN  PNET_BUFFER_LIST    NetBufferList,
+    IN  PMDL                Mdl,
+    IN  ULONG               Offset,
+    IN  PXENVIF_PACKET_INFO Info
+    )
+{
+    PUCHAR                  Frame;
+    PIP_HEADER              IpHeader;
+    USHORT                  FrameType;
+
+    if (Info->IpHeader.Length == 0 ||
+        Offset + Info->IpHeader.Offset + Info->IpHeader.Length > Mdl->ByteCount)
+        return;
+
+    Frame = MmGetSystemAddressForMdlSafe(Mdl, NormalPagePriority);
+    if (Frame == NULL)
+        return;
+
+    // The header length does not tell us the version (an IPv4 header
+    // with options can be as long as an IPv6 header) so look at the
+    // version field itself
+    IpHeader = (PIP_HEADER)(Frame + Offset + Info->IpHeader.Offset);
+
+    switch (IpHeader->Version) {
+    case 4:
+        NdisSetNblFlag(NetBufferList, NDIS_NBL_FLAGS_IS_IPV4);
+        FrameType = ETHERTYPE_IPV4;
+        break;
+
+    case 6:
+        NdisSetNblFlag(NetBufferList, NDIS_NBL_FLAGS_IS_IPV6);
+        FrameType = ETHERTYPE_IPV6;
+        break;
+
+    default:
+        return;
+    }
+
+    NET_BUFFER_LIST_INFO(NetBufferList, NetBufferListFrameType) =
+        (PVOID)(ULONG_PTR)HTONS(FrameType);
+
+    if (Info->IsAFragment)
+        return;
+
+    if (Info->TcpHeader.Length != 0)
+        NdisSetNblFlag(NetBufferList, NDIS_NBL_FLAGS_IS_TCP);
+    else if (Info->UdpHeader.Length != 0)
+        NdisSetNblFlag(NetBufferList, NDIS_NBL_FLAGS_IS_UDP);
+}
+
+//
+// Calculate the hash for any packet whose hash type is done in software:
+// UDP flows always (XENVIF has no UDP hash types and falls back to an
+// IP address hash), and everything else if the backend cannot hash.
+//
+static BOOLEAN
+__ReceiverHashPacket(
+    IN  PXENNET_RECEIVER    Receiver,
+    IN  PNET_BUFFER_LIST    NetBufferList,
+    IN  PMDL                Mdl,
+    IN  ULONG               Offset,
+    IN  PXENVIF_PACKET_INFO Info
+    )
+{
+    PUCHAR                  Frame;
+    PIP_HEADER              IpHeader;
+    PUCHAR                  Ports;
+    UCHAR                   Input[HASH_TOEPLITZ_INPUT_MAX];
+    ULONG                   AddressLength;
+    ULONG                   Types;
+    ULONG                   Type;
+
+    Types = Receiver->HashTypes;
+
+    if (Types == 0 ||
+        Info->IpHeader.Length == 0 ||
+        Offset + Info->Length > Mdl->ByteCount)
+        return FALSE;
+
+    Frame = MmGetSystemAddressForMdlSafe(Mdl, NormalPagePriority);
+    if (Frame == NULL)
+        return FALSE;
+
+    Frame += Offset;
+    IpHeader = (PIP_HEADER)(Frame + Info->IpHeader.Offset);
+
+    Ports = NULL;
+
+    if (IpHeader->Version == 4) {
+        PIPV4_HEADER    Version4 = &IpHeader->Version4;
+
+        AddressLength = IPV4_ADDRESS_LENGTH;
+        RtlCopyMemory(&Input[0], &Version4->SourceAddress, AddressLength);
+        RtlCopyMemory(&Input[AddressLength], &Version4->DestinationAddress, AddressLength);
+
+        if (Info->IsAFragment) {
+            Type = NDIS_HASH_IPV4;
+        } else if (Info->TcpHeader.Length != 0) {
+            Type = NDIS_HASH_TCP_IPV4;
+            Ports = Frame + Info->TcpHeader.Offset;
+        } else if (Info->UdpHeader.Length != 0) {
+            Type = NDIS_HASH_UDP_IPV4;
+            Ports = Frame + Info->UdpHeader.Offset;
+        } else {
+            Type = NDIS_HASH_IPV4;
+        }
+
+        // Fall back to an IP address hash if the 4-tuple is not wanted
+        if (!(Types & Type)) {
+            Type = NDIS_HASH_IPV4;
+            Ports = NULL;
+        }
+    } else {
+        PIPV6_HEADER    Version6 = &IpHeader->Version6;
+
+        AddressLength = IPV6_ADDRESS_LENGTH;
+        RtlCopyMemory(&Input[0], &Version6->SourceAddress, AddressLength);
+        RtlCopyMemory(&Input[AddressLength], &Version6->DestinationAddress, AddressLength);
+
+        if (Info->IsAFragment) {
+            Type = NDIS_HASH_IPV6;
+        } else if (Info->TcpHeader.Length != 0) {
+            Type = NDIS_HASH_TCP_IPV6;
+            Ports = Frame + Info->TcpHeader.Offset;
+        } else if (Info->UdpHeader.Length != 0) {
+            Type = NDIS_HASH_UDP_IPV6;
+            Ports = Frame + Info->UdpHeader.Offset;
+        } else {
+            Type = NDIS_HASH_IPV6;
+        }
+
+        if (!(Types & Type)) {
+            Type = NDIS_HASH_IPV6;
+            Ports = NULL;
+        }
+    }
+
+    if (!(Types & Type))
+        return FALSE;
+
+    // Source port then destination port
+    if (Ports != NULL)
+        RtlCopyMemory(&Input[2 * AddressLength], Ports, 2 * sizeof (USHORT));
+
+    NET_BUFFER_LIST_SET_HASH_VALUE(NetBufferList,
+                                   HashToeplitz(Receiver->Toeplitz,
+                                                Input,
+                                                2 * AddressLength +
+                                                ((Ports != NULL) ? 2 * sizeof (USHORT) : 0)));
+    NET_BUFFER_LIST_SET_HASH_TYPE(NetBufferList, Type);
+    NET_BUFFER_LIST_SET_HASH_FUNCTION(NetBufferList, NdisHashFunctionToeplitz);
+
+    return TRUE;
+}
+
+static PNET_BUFFER_LIST
+__ReceiverReceivePacket(
+    IN  PXENNET_RECEIVER                        Receiver,
+    IN  PMDL                                    Mdl,
+    IN  ULONG                                   Offset,
+    IN  ULONG                                   Length,
+    IN  XENVIF_PACKET_CHECKSUM_FLAGS            Flags,
+    IN  USHORT                                  MaximumSegmentSize,
+    IN  USHORT                                  TagControlInformation,
+    IN  PXENVIF_PACKET_INFO                     Info,
+    IN  PXENVIF_PACKET_HASH                     Hash,
+    IN  PVOID                                   Cookie
+    )
+{
+    PNET_BUFFER_LIST                            NetBufferList;
+    NDIS_TCP_IP_CHECKSUM_NET_BUFFER_LIST_INFO   csumInfo;
+
+    NetBufferList = NULL;
+
+    if (Length <= Receiver->CopyBreak)
+        NetBufferList = __ReceiverCopyNetBufferList(Receiver,
+                                                    Mdl,
+                                                    Offset,
+                                                    Length);
+
+    if (NetBufferList == NULL)
+        NetBufferList = __ReceiverAllocateNetBufferList(Receiver,
+                                                        Mdl,
+                                                        Offset,
+                                                        Length,
+                                                        Cookie);
+    if (NetBufferList == NULL)
+        goto fail1;
+
+    NetBufferList->SourceHandle = AdapterGetHandle(Receiver->Adapter);
+
+    __ReceiverClassifyPacket(NetBufferList, Mdl, Offset, Info);
+
+    csumInfo.Value = 0;
+
+    csumInfo.Receive.IpChecksumSucceeded = Flags.IpChecksumSucceeded;
+    csumInfo.Receive.IpChecksumFailed = Flags.IpChecksumFailed;
+
+    csumInfo.Receive.TcpChecksumSucceeded = Flags.TcpChecksumSucceeded;
+    csumInfo.Receive.TcpChecksumFailed = Flags.TcpChecksumFailed;
+
+    csumInfo.Receive.UdpChecksumSucceeded = Flags.UdpChecksumSucceeded;
+    csumInfo.Receive.UdpChecksumFailed = Flags.UdpChecksumFailed;
+
+    NET_BUFFER_LIST_INFO(NetBufferList, TcpIpChecksumNetBufferListInfo) = (PVOID)(ULONG_PTR)csumInfo.Value;
+
+    // The backend has already coalesced this packet so indicate it as an SCU
+    if (MaximumSegmentSize != 0 &&
+        Info->TcpHeader.Length != 0 &&
+        Length > Info->Length) {
+        NDIS_RSC_NBL_INFO   RscInfo;
+        ULONG               PayloadLength;
+
+        PayloadLength = Length - Info->Length;
+
+        RscInfo.Value = NULL;
+        RscInfo.Info.CoalescedSegCount = (USHORT)((PayloadLength + MaximumSegmentSize - 1) /
+                                                  MaximumSegmentSize);
+
+        NET_BUFFER_LIST_INFO(NetBufferList, TcpRecvSegCoalesceInfo) = RscInfo.Value;
+    }
+
+    if (TagControlInformation != 0) {
+        NDIS_NET_BUFFER_LIST_8021Q_INFO Ieee8021QInfo;
+
+        UNPACK_TAG_CONTROL_INFORMATION(TagControlInformation,
+                                       Ieee8021QInfo.TagHeader.UserPriority,
+                                       Ieee8021QInfo.TagHeader.CanonicalFormatId,
+                                       Ieee8021QInfo.TagHeader.VlanId);
+
+        if (Ieee8021QInfo.TagHeader.VlanId != 0)
+            goto fail2;
+
+        NET_BUFFER_LIST_INFO(NetBufferList, Ieee8021QNetBufferListInfo) = Ieee8021QInfo.Value;
+    }
+
+    if (__ReceiverHashPacket(Receiver, NetBufferList, Mdl, Offset, Info))
+        goto done;
+
+    switch (Hash->Algorithm) {
+    case XENVIF_PACKET_HASH_ALGORITHM_TOEPLITZ:
+        NET_BUFFER_LIST_SET_HASH_FUNCTION(NetBufferList,
+                                          NdisHashFunctionToeplitz);
+        break;
+
+    default:
+        goto done;
+    }
+
+    switch (Hash->Type) {
+    case XENVIF_PACKET_HASH_TYPE_IPV4:
+        NET_BUFFER_LIST_SET_HASH_TYPE(NetBufferList,
+                                      NDIS_HASH_IPV4);
+        break;
+
+    case XENVIF_PACKET_HASH_TYPE_IPV4_TCP:
+        NET_BUFFER_LIST_SET_HASH_TYPE(NetBufferList,
+                                      NDIS_HASH_TCP_IPV4);
+        break;
+
+    case XENVIF_PACKET_HASH_TYPE_IPV6:
+        NET_BUFFER_LIST_SET_HASH_TYPE(NetBufferList,
+                                      NDIS_HASH_IPV6);
+        break;
+
+    case XENVIF_PACKET_HASH_TYPE_IPV6_TCP:
+        NET_BUFFER_LIST_SET_HASH_TYPE(NetBufferList,
+                                      NDIS_HASH_TCP_IPV6);
+        break;
+
+    default:
+        ASSERT(FALSE);
+        break;
+    }
+
+    NET_BUFFER_LIST_SET_HASH_VALUE(NetBufferList,
+                                   Hash->Value);
+
+done:
+    // If the packet was copied then the ring buffer can be returned now
+    if (__ReceiverGetCookie(NetBufferList) == NULL)
+        XENVIF_VIF(ReceiverReturnPacket,
+                   AdapterGetVifInterface(Receiver->Adapter),
+                   Cookie);
+
+    return NetBufferList;
+
+fail2:
+    (VOID) __ReceiverReleaseNetBufferList(Receiver, NetBufferList, TRUE);
+
+fail1:
+    return NULL;
+}
+
+// RFC 1624: HC' = ~(~HC + ~m + m')
+static FORCEINLINE USHORT
+__ReceiverUpdateChecksum(
+    IN  USHORT  Checksum,
+    IN  USHORT  Old,
+    IN  USHORT  New
+    )
+{
+    ULONG       Accumulator;
+
+    Accumulator = (USHORT)~Checksum;
+    Accumulator += (USHORT)~Old;
+    Accumulator += New;
+
+    Accumulator = (Accumulator & 0xFFFF) + (Accumulator >> 16);
+    Accumulator = (Accumulator & 0xFFFF) + (Accumulator >> 16);
+
+    return (USHORT)~Accumulator;
+}
+
+static FORCEINLINE ULONG
+__ReceiverGetTimestampValue(
+    IN  PUCHAR  Timestamp
+    )
+{
+    return NTOHL(*(ULONG UNALIGNED *)(Timestamp + 2));
+}
+
+static BOOLEAN
+__ReceiverIsCoalescable(
+    IN  PXENNET_RECEIVER                        Receiver,
+    IN  PNET_BUFFER_LIST                        NetBufferList,
+    IN  PUCHAR                                  Frame,
+    IN  PXENVIF_PACKET_INFO                     Info,
+    OUT PUCHAR                                  *Timestamp,
+    OUT PULONG                                  PayloadLength
+    )
+{
+    PNET_BUFFER                                 NetBuffer;
+    PIP_HEADER                                  IpHeader;
+    PTCP_HEADER                                 TcpHeader;
+    NDIS_TCP_IP_CHECKSUM_NET_BUFFER_LIST_INFO   csumInfo;
+    ULONG                                       Length;
+
+    NetBuffer = NET_BUFFER_LIST_FIRST_NB(NetBufferList);
+
+    IpHeader = (PIP_HEADER)(Frame + Info->IpHeader.Offset);
+    TcpHeader = (PTCP_HEADER)(Frame + Info->TcpHeader.Offset);
+
+    *Timestamp = NULL;
+    *PayloadLength = 0;
+
+    if (Info->IsAFragment || Info->IpOptions.Length != 0)
+        return FALSE;
+
+    if (NET_BUFFER_LIST_INFO(NetBufferList, Ieee8021QNetBufferListInfo) != NULL)
+        return FALSE;
+
+    // Packets coalesced by the backend are already SCUs
+    if (NET_BUFFER_LIST_INFO(NetBufferList, TcpRecvSegCoalesceInfo) != NULL)
+        return FALSE;
+
+    csumInfo.Value = (ULONG)(ULONG_PTR)NET_BUFFER_LIST_INFO(NetBufferList, TcpIpChecksumNetBufferListInfo);
+
+    if (!csumInfo.Receive.TcpChecksumSucceeded)
+        return FALSE;
+
+    if (IpHeader->Version == 4) {
+        if (!Receiver->CoalesceIpVersion4 ||
+            !csumInfo.Receive.IpChecksumSucceeded)
+            return FALSE;
+
+        Length = NTOHS(IpHeader->Version4.PacketLength);
+        if (Length < IPV4_HEADER_LENGTH(&IpHeader->Version4))
+            return FALSE;
+
+        Length -= IPV4_HEADER_LENGTH(&IpHeader->Version4);
+    } else {
+        ASSERT3U(IpHeader->Version, ==, 6);
+
+        if (!Receiver->CoalesceIpVersion6)
+            return FALSE;
+
+        Length = NTOHS(IpHeader->Version6.PayloadLength);
+    }
+
+    if (Length < TCP_HEADER_LENGTH(TcpHeader))
+        return FALSE;
+
+    Length -= TCP_HEADER_LENGTH(TcpHeader);
+
+    // Only plain (possibly pushed) ACK segments are coalesced
+    if ((TcpHeader->Flags & ~TCP_PSH) != TCP_ACK)
+        return FALSE;
+
+    // The only option allowed is a timestamp, laid out as most stacks do
+    if (Info->TcpOptions.Length != 0) {
+        PUCHAR  Option = Frame + Info->TcpOptions.Offset;
+
+        if (Info->TcpOptions.Length != 12 ||
+            Option[0] != TCPOPT_NOP ||
+            Option[1] != TCPOPT_NOP ||
+            Option[2] != TCPOPT_TIMESTAMP ||
+            Option[3] != TCPOLEN_TIMESTAMP)
+            return FALSE;
+
+        *Timestamp = &Option[2];
+    }
+
+    // The payload must not be padded and must lie within the first MDL
+    if (Info->Length + Length > NET_BUFFER_DATA_LENGTH(NetBuffer) ||
+        NET_BUFFER_CURRENT_MDL_OFFSET(NetBuffer) + Info->Length + Length >
+        NET_BUFFER_CURRENT_MDL(NetBuffer)->ByteCount)
+        return FALSE;
+
+    *PayloadLength = Length;
+    return TRUE;
+}
+
+static PXENNET_RECEIVER_FLOW
+__ReceiverFindFlow(
+    IN  PXENNET_RECEIVER_QUEUE  Queue,
+    IN  PIP_HEADER              IpHeader,
+    IN  PTCP_HEADER             TcpHeader
+    )
+{
+    ULONG                       Index;
+
+    for (Index = 0; Index < Queue->FlowCount; Index++) {
+        PXENNET_RECEIVER_FLOW   Flow = &Queue->Flow[Index];
+
+        if (Flow->TcpHeader->SourcePort != TcpHeader->SourcePort ||
+            Flow->TcpHeader->DestinationPort != TcpHeader->DestinationPort)
+            continue;
+
+        if (Flow->IpHeader->Version != IpHeader->Version)
+            continue;
+
+        if (IpHeader->Version == 4) {
+            if (Flow->IpHeader->Version4.SourceAddress.Dword[0] !=
+                IpHeader->Version4.SourceAddress.Dword[0] ||
+                Flow->IpHeader->Version4.DestinationAddress.Dword[0] !=
+                IpHeader->Version4.DestinationAddress.Dword[0])
+                continue;
+        } else {
+            if (!RtlEqualMemory(&Flow->IpHeader->Version6.SourceAddress,
+                                &IpHeader->Version6.SourceAddress,
+                                2 * IPV6_ADDRESS_LENGTH))
+                continue;
+        }
+
+        return Flow;
+    }
+
+    return NULL;
+}
+
+static VOID
+__ReceiverOpenFlow(
+    IN  PXENNET_RECEIVER_QUEUE  Queue,
+    IN  PNET_BUFFER_LIST        NetBufferList,
+    IN  PUCHAR                  Frame,
+    IN  PXENVIF_PACKET_INFO     Info,
+    IN  PUCHAR                  Timestamp,
+    IN  ULONG                   PayloadLength
+    )
+{
+    PXENNET_RECEIVER_FLOW       Flow;
+
+    ASSERT3U(Queue->FlowCount, <, RECEIVER_FLOW_COUNT);
+    Flow = &Queue->Flow[Queue->FlowCount++];
+
+    RtlZeroMemory(Flow, sizeof (XENNET_RECEIVER_FLOW));
+
+    Flow->NetBufferList = NetBufferList;
+    Flow->Frame = Frame;
+    Flow->IpHeader = (PIP_HEADER)(Frame + Info->IpHeader.Offset);
+    Flow->TcpHeader = (PTCP_HEADER)(Frame + Info->TcpHeader.Offset);
+    Flow->Timestamp = Timestamp;
+    Flow->HeaderLength = Info->Length;
+    Flow->PayloadLength = PayloadLength;
+    Flow->Sequence = NTOHL(Flow->TcpHeader->Seq) + PayloadLength;
+
+    if (Timestamp != NULL)
+        Flow->TimestampValue = __ReceiverGetTimestampValue(Timestamp);
+
+    Flow->Segments = 1;
+}
+
+static VOID
+__ReceiverCloseFlow(
+    IN  PXENNET_RECEIVER_QUEUE  Queue,
+    IN  PXENNET_RECEIVER_FLOW   Flow,
+    IN  BOOLEAN                 Abort
+    )
+{
+    PNET_BUFFER_LIST            NetBufferList = Flow->NetBufferList;
+    ULONG                       Index;
+
+    if (Flow->Segments > 1 || Flow->DupAcks != 0) {
+        NDIS_RSC_NBL_INFO   RscInfo;
+
+        RscInfo.Value = NULL;
+        RscInfo.Info.CoalescedSegCount = Flow->Segments;
+        RscInfo.Info.DupAckCount = Flow->DupAcks;
+
+        NET_BUFFER_LIST_INFO(NetBufferList, TcpRecvSegCoalesceInfo) = RscInfo.Value;
+
+        // The SCU carries the TSval of its first segment
+        if (Flow->Timestamp != NULL)
+            NET_BUFFER_LIST_INFO(NetBufferList, RscTcpTimestampDelta) =
+                (PVOID)(ULONG_PTR)(Flow->TimestampValue -
+                                   __ReceiverGetTimestampValue(Flow->Timestamp));
+
+        Queue->CoalesceEvents++;
+    }
+
+    if (Abort)
+        Queue->CoalesceAborts++;
+
+    Index = (ULONG)(Flow - &Queue->Flow[0]);
+    ASSERT3U(Index, <, Queue->FlowCount);
+
+    Queue->Flow[Index] = Queue->Flow[--Queue->FlowCount];
+}
+
+static BOOLEAN
+__ReceiverMergeFlow(
+    IN  PXENNET_RECEIVER        Receiver,
+    IN  PXENNET_RECEIVER_QUEUE  Queue,
+    IN  PXENNET_RECEIVER_FLOW   Flow,
+    IN  PNET_BUFFER_LIST        NetBufferList,
+    IN  PUCHAR                  Frame,
+    IN  PXENVIF_PACKET_INFO     Info,
+    IN  PUCHAR                  Timestamp,
+    IN  ULONG                   PayloadLength
+    )
+{
+    PIP_HEADER                  IpHeader;
+    PTCP_HEADER                 TcpHeader;
+    PNET_BUFFER                 NetBuffer;
+    PNET_BUFFER_LIST_RESERVED   ListReserved;
+    ULONG                       TimestampValue;
+    PMDL                        Mdl;
+
+    IpHeader = (PIP_HEADER)(Frame + Info->IpHeader.Offset);
+    TcpHeader = (PTCP_HEADER)(Frame + Info->TcpHeader.Offset);
+
+    if (NTOHL(TcpHeader->Seq) != Flow->Sequence)
+        return FALSE;
+
+    // Identical header lengths also imply identical option layouts
+    if (Info->Length != Flow->HeaderLength)
+        return FALSE;
+
+    if ((LONG)(NTOHL(TcpHeader->Ack) - NTOHL(Flow->TcpHeader->Ack)) < 0)
+        return FALSE;
+
+    if (IpHeader->Version == 4) {
+        if (IpHeader->Version4.TypeOfService != Flow->IpHeader->Version4.TypeOfService ||
+            IpHeader->Version4.TimeToLive != Flow->IpHeader->Version4.TimeToLive)
+            return FALSE;
+    } else {
+        if (IpHeader->Version6.VCF != Flow->IpHeader->Version6.VCF ||
+            IpHeader->Version6.HopLimit != Flow->IpHeader->Version6.HopLimit)
+            return FALSE;
+    }
+
+    TimestampValue = 0;
+
+    if (Timestamp != NULL) {
+        TimestampValue = __ReceiverGetTimestampValue(Timestamp);
+
+        if ((LONG)(TimestampValue - Flow->TimestampValue) < 0)
+            return FALSE;
+    }
+
+    if (PayloadLength == 0) {
+        PVOID   Cookie;
+
+        // Without data only a duplicate ACK can be absorbed
+        if (TcpHeader->Flags != TCP_ACK ||
+            TcpHeader->Ack != Flow->TcpHeader->Ack ||
+            TcpHeader->Window != Flow->TcpHeader->Window ||
+            Flow->DupAcks == MAXUSHORT)
+            return FALSE;
+
+        Flow->DupAcks++;
+
+        Cookie = __ReceiverReleaseNetBufferList(Receiver, NetBufferList, TRUE);
+        if (Cookie != NULL)
+            XENVIF_VIF(ReceiverReturnPacket,
+                       AdapterGetVifInterface(Receiver->Adapter),
+                       Cookie);
+
+        return TRUE;
+    }
+
+    if (Flow->HeaderLength - Info->IpHeader.Offset +
+        Flow->PayloadLength + PayloadLength > MAXUSHORT)
+        return FALSE;
+
+    Mdl = NdisAllocateMdl(AdapterGetHandle(Receiver->Adapter),
+                          Frame + Info->Length,
+                          PayloadLength);
+    if (Mdl == NULL)
+        return FALSE;
+
+    NetBuffer = NET_BUFFER_LIST_FIRST_NB(Flow->NetBufferList);
+
+    //
+    // On the first merge the SCU's own headers and payload are
+    // re-described by an MDL of our own, so that the payload of
+    // absorbed segments can be chained on to it.
+    //
+    if (Flow->Tail == NULL) {
+        PMDL    ScuMdl;
+
+        ScuMdl = NdisAllocateMdl(AdapterGetHandle(Receiver->Adapter),
+                                 Flow->Frame,
+                                 Flow->HeaderLength + Flow->PayloadLength);
+        if (ScuMdl == NULL) {
+            NdisFreeMdl(Mdl);
+            return FALSE;
+        }
+
+        NET_BUFFER_FIRST_MDL(NetBuffer) = ScuMdl;
+        NET_BUFFER_CURRENT_MDL(NetBuffer) = ScuMdl;
+        NET_BUFFER_DATA_OFFSET(NetBuffer) = 0;
+        NET_BUFFER_DATA_LENGTH(NetBuffer) = Flow->HeaderLength + Flow->PayloadLength;
+        NET_BUFFER_CURRENT_MDL_OFFSET(NetBuffer) = 0;
+
+        Flow->Tail = ScuMdl;
+    }
+
+    Flow->Tail->Next = Mdl;
+    Flow->Tail = Mdl;
+
+    NET_BUFFER_DATA_LENGTH(NetBuffer) += PayloadLength;
+
+    ListReserved = (PNET_BUFFER_LIST_RESERVED)NET_BUFFER_LIST_MINIPORT_RESERVED(Flow->NetBufferList);
+
+    ASSERT3P(NET_BUFFER_LIST_NEXT_NBL(NetBufferList), ==, NULL);
+    if (Flow->Last == NULL)
+        ListReserved->Coalesced = NetBufferList;
+    else
+        NET_BUFFER_LIST_NEXT_NBL(Flow->Last) = NetBufferList;
+    Flow->Last = NetBufferList;
+
+    if (__ReceiverGetCookie(NetBufferList) != NULL)
+        Queue->Held++;
+
+    if (Flow->IpHeader->Version == 4) {
+        PIPV4_HEADER    Version4 = &Flow->IpHeader->Version4;
+        USHORT          PacketLength;
+
+        PacketLength = HTONS((USHORT)(NTOHS(Version4->PacketLength) + PayloadLength));
+
+        Version4->Checksum = __ReceiverUpdateChecksum(Version4->Checksum,
+                                                      Version4->PacketLength,
+                                                      PacketLength);
+        Version4->PacketLength = PacketLength;
+    } else {
+        PIPV6_HEADER    Version6 = &Flow->IpHeader->Version6;
+
+        Version6->PayloadLength = HTONS((USHORT)(NTOHS(Version6->PayloadLength) + PayloadLength));
+    }
+
+    Flow->TcpHeader->Ack = TcpHeader->Ack;
+    Flow->TcpHeader->Window = TcpHeader->Window;
+    Flow->TcpHeader->Flags |= TcpHeader->Flags & TCP_PSH;
+
+    // The SCU keeps its original TSval but echoes the latest TSecr
+    if (Timestamp != NULL) {
+        RtlCopyMemory(Flow->Timestamp + 6, Timestamp + 6, sizeof (ULONG));
+        Flow->TimestampValue = TimestampValue;
+    }
+
+    Flow->PayloadLength += PayloadLength;
+    Flow->Sequence += PayloadLength;
+    Flow->Segments++;
+
+    Queue->CoalescedPackets++;
+    Queue->CoalescedOctets += PayloadLength;
+
+    return TRUE;
+}
+
+// Returns TRUE if the packet has been absorbed into an SCU
+static BOOLEAN
+__ReceiverCoalescePacket(
+    IN  PXENNET_RECEIVER        Receiver,
+    IN  PXENNET_RECEIVER_QUEUE  Queue,
+    IN  PNET_BUFFER_LIST        NetBufferList,
+    IN  PXENVIF_PACKET_INFO     Info
+    )
+{
+    PNET_BUFFER                 NetBuffer;
+    PMDL                        Mdl;
+    PUCHAR                      Frame;
+    PXENNET_RECEIVER_FLOW       Flow;
+    PUCHAR                      Timestamp;
+    ULONG                       PayloadLength;
+    BOOLEAN                     Coalescable;
+    UCHAR                       Flags;
+
+    if (!Receiver->CoalesceIpVersion4 && !Receiver->CoalesceIpVersion6)
+        return FALSE;
+
+    if (Info->TcpHeader.Length == 0)
+        return FALSE;
+
+    NetBuffer = NET_BUFFER_LIST_FIRST_NB(NetBufferList);
+    Mdl = NET_BUFFER_CURRENT_MDL(NetBuffer);
+
+    // A segment whose headers cannot be inspected may overtake any SCU
+    if (NET_BUFFER_CURRENT_MDL_OFFSET(NetBuffer) + Info->Length > Mdl->ByteCount)
+        goto flush;
+
+    Frame = MmGetSystemAddressForMdlSafe(Mdl, NormalPagePriority);
+    if (Frame == NULL)
+        goto flush;
+
+    Frame += NET_BUFFER_CURRENT_MDL_OFFSET(NetBuffer);
+
+    Flow = __ReceiverFindFlow(Queue,
+                              (PIP_HEADER)(Frame + Info->IpHeader.Offset),
+                              (PTCP_HEADER)(Frame + Info->TcpHeader.Offset));
+
+    Coalescable = __ReceiverIsCoalescable(Receiver,
+                                          NetBufferList,
+                                          Frame,
+                                          Info,
+                                          &Timestamp,
+                                          &PayloadLength);
+
+    // The segment may be released by a merge
+    Flags = ((PTCP_HEADER)(Frame + Info->TcpHeader.Offset))->Flags;
+
+    if (Flow != NULL) {
+        if (Coalescable &&
+            __ReceiverMergeFlow(Receiver,
+                                Queue,
+                                Flow,
+                                NetBufferList,
+                                Frame,
+                                Info,
+                                Timestamp,
+                                PayloadLength)) {
+            // A pushed segment completes the SCU
+            if (Flags & TCP_PSH)
+                __ReceiverCloseFlow(Queue, Flow, FALSE);
+
+            return TRUE;
+        }
+
+        __ReceiverCloseFlow(Queue, Flow, TRUE);
+    }
+
+    // Copied packets cannot be re-described so they cannot become an SCU
+    if (Coalescable &&
+        PayloadLength != 0 &&
+        !(Flags & TCP_PSH) &&
+        __ReceiverGetCookie(NetBufferList) != NULL &&
+        Queue->FlowCount < RECEIVER_FLOW_COUNT)
+        __ReceiverOpenFlow(Queue,
+                           NetBufferList,
+                           Frame,
+                           Info,
+                           Timestamp,
+                           PayloadLength);
+
+    return FALSE;
+
+flush:
+    while (Queue->FlowCount != 0)
+        __ReceiverCloseFlow(Queue, &Queue->Flow[0], TRUE);
+
+    return FALSE;
+}
+
+static FORCEINLINE VOID __IndicateReceiveNetBufferLists(
+    IN  PXENNET_RECEIVER    Receiver,
+    IN  PNET_BUFFER_LIST    NetBufferLists,
+    IN  NDIS_PORT_NUMBER    PortNumber,
+    IN  ULONG               NumberOfNetBufferLists,
+    IN  ULONG               ReceiveFlags
+    )
+{
+    PXENNET_ADAPTER         Adapter = Receiver->Adapter;
+    NDIS_HANDLE             MiniportAdapterHandle = AdapterGetHandle(Adapter);
+
+    if (NumberOfNetBufferLists == 0)
+        return;
+
+    NdisMIndicateReceiveNetBufferLists(MiniportAdapterHandle,
+                                       NetBufferLists,
+                                       PortNumber,
+                                       NumberOfNetBufferLists,
+                                       ReceiveFlags);
+
+    //
+    // If NDIS_RECEIVE_FLAGS_RESOURCES was set then ownership of the
+    // whole chain is passed straight back to us when the call returns.
+    //
+    if (ReceiveFlags & NDIS_RECEIVE_FLAGS_RESOURCES) {
+        KIRQL   Irql;
+
+        // The receive cache is per-processor so we must not be preempted
+        KeRaiseIrql(DISPATCH_LEVEL, &Irql);
+        __ReceiverReturnNetBufferLists(Receiver, NetBufferLists, FALSE);
+        KeLowerIrql(Irql);
+    }
+}
+
+static VOID
+__ReceiverIndicatePackets(
+    IN  PXENNET_RECEIVER    Receiver,
+    IN  PNET_BUFFER_LIST    NetBufferList,
+    IN  ULONG               Count,
+    IN  ULONG               Held
+    )
+{
+    ULONG                   Flags;
+    LONG                    Indicated;
+    LONG                    Returned;
+
+    // Only NBLs that are holding on to ring buffers are counted
+    (VOID) InterlockedAdd(&Receiver->Indicated, Held);
+
+    if (!Receiver->Enabled) {
+        KIRQL   Irql;
+
+        // Deferred packets may be dropped from a threaded DPC
+        KeRaiseIrql(DISPATCH_LEVEL, &Irql);
+        __ReceiverReturnNetBufferLists(Receiver, NetBufferList, TRUE);
+        KeLowerIrql(Irql);
+
+        return;
+    }
+
+    Returned = Receiver->Returned;
+
+    KeMemoryBarrier();
+
+    Indicated = Receiver->Indicated;
+
+    Flags = NDIS_RECEIVE_FLAGS_PERFECT_FILTERED;
+
+    // Deferred packets may be indicated from a threaded DPC
+    if (KeGetCurrentIrql() == DISPATCH_LEVEL)
+        Flags |= NDIS_RECEIVE_FLAGS_DISPATCH_LEVEL;
+
+    ASSERT3S(Indicated - Returned, >=, 0);
+    if (Indicated - Returned > IN_NDIS_MAX)
+        Flags |= NDIS_RECEIVE_FLAGS_RESOURCES;
+
+    __IndicateReceiveNetBufferLists(Receiver,
+                                    NetBufferList,
+                                    NDIS_DEFAULT_PORT_NUMBER,
+                                    Count,
+                                    Flags);
+}
+
+// Count the XENVIF cookies held by an NBL and any NBLs parked on it
+static ULONG
+__ReceiverGetHeld(
+    IN  PNET_BUFFER_LIST        NetBufferList
+    )
+{
+    PNET_BUFFER_LIST_RESERVED   ListReserved;
+    PNET_BUFFER_LIST            Coalesced;
+    ULONG                       Held;
+
+    Held = (__ReceiverGetCookie(NetBufferList) != NULL) ? 1 : 0;
+
+    ListReserved = (PNET_BUFFER_LIST_RESERVED)NET_BUFFER_LIST_MINIPORT_RESERVED(NetBufferList);
+
+    for (Coalesced = ListReserved->Coalesced;
+         Coalesced != NULL;
+         Coalesced = NET_BUFFER_LIST_NEXT_NBL(Coalesced))
+        if (__ReceiverGetCookie(Coalesced) != NULL)
+            Held++;
+
+    return Held;
+}
+
+static VOID
+__ReceiverSteerPacket(
+    IN  PXENNET_RECEIVER    Receiver,
+    IN  ULONG               Index,
+    IN  PNET_BUFFER_LIST    NetBufferList
+    )
+{
+    PXENNET_RECEIVER_TARGET Target = &Receiver->Target[Index];
+
+    KeAcquireSpinLockAtDpcLevel(&Target->Lock);
+
+    if (Target->Head == NULL) {
+        ASSERT3U(Target->Count, ==, 0);
+        Target->Head = NetBufferList;
+    } else {
+        NET_BUFFER_LIST_NEXT_NBL(Target->Tail) = NetBufferList;
+    }
+    Target->Tail = NetBufferList;
+    Target->Count++;
+    Target->Held += __ReceiverGetHeld(NetBufferList);
+    Target->Steered++;
+
+    KeReleaseSpinLockFromDpcLevel(&Target->Lock);
+
+    (VOID) KeInsertQueueDpc(&Target->Dpc,
+                            (PVOID)(ULONG_PTR)Index,
+                            NULL);
+}
+
+//
+// Hand off every packet that the indirection table assigns to another
+// processor, leaving behind only those that belong to this one.
+//
+static VOID
+__ReceiverSteerPackets(
+    IN      PXENNET_RECEIVER    Receiver,
+    IN OUT  PNET_BUFFER_LIST    *NetBufferList,
+    OUT     PNET_BUFFER_LIST    *Tail,
+    IN OUT  PULONG              Count,
+    IN OUT  PULONG              Held
+    )
+{
+    ULONG                       Current;
+    ULONG                       TableSize;
+    PNET_BUFFER_LIST            Head;
+    PNET_BUFFER_LIST            Next;
+
+    TableSize = Receiver->SteeringTableSize;
+    KeMemoryBarrier();
+
+    if (TableSize == 0)
+        return;
+
+    Current = KeGetCurrentProcessorNumberEx(NULL);
+
+    Head = *Tail = NULL;
+    *Count = 0;
+    *Held = 0;
+
+    for (Next = *NetBufferList; Next != NULL; ) {
+        PNET_BUFFER_LIST    This = Next;
+        ULONG               Index;
+
+        Next = NET_BUFFER_LIST_NEXT_NBL(This);
+        NET_BUFFER_LIST_NEXT_NBL(This) = NULL;
+
+        Index = Current;
+        if (NET_BUFFER_LIST_GET_HASH_FUNCTION(This) != 0)
+            Index = Receiver->SteeringTable[NET_BUFFER_LIST_GET_HASH_VALUE(This) &
+                                            (TableSize - 1)];
+
+        if (Index != Current) {
+            __ReceiverSteerPacket(Receiver, Index, This);
+            continue;
+        }
+
+        if (Head == NULL)
+            Head = This;
+        else
+            NET_BUFFER_LIST_NEXT_NBL(*Tail) = This;
+        *Tail = This;
+        (*Count)++;
+        *Held += __ReceiverGetHeld(This);
+    }
+
+    Receiver->Target[Current].Kept += *Count;
+
+    *NetBufferList = Head;
+}
+
+static VOID
+__ReceiverPushPackets(
+    IN  PXENNET_RECEIVER    Receiver,
+    IN  ULONG               Index
+    )
+{
+    PXENNET_RECEIVER_QUEUE  Queue;
+    PNET_BUFFER_LIST        NetBufferList;
+    PNET_BUFFER_LIST        Tail;
+    ULONG                   Count;
+    ULONG                   Held;
+    ULONGLONG               Now;
+
+    Queue = &Receiver->Queue[Index];
+
+    __ReceiverQueueAcquire(Queue);
+
+    // Any SCU in the batch is now complete
+    while (Queue->FlowCount != 0)
+        __ReceiverCloseFlow(Queue, &Queue->Flow[0], FALSE);
+
+    NetBufferList = Queue->Head;
+    Tail = Queue->Tail;
+    Count = Queue->Count;
+    Held = Queue->Held;
+
+    Queue->Tail = Queue->Head = NULL;
+    Queue->Count = 0;
+    Queue->Held = 0;
+
+    if (Count != 0)
+        __ReceiverSteerPackets(Receiver, &NetBufferList, &Tail, &Count, &Held);
+
+    if (Count == 0)
+        goto done;
+
+    KeAcquireSpinLockAtDpcLevel(&Queue->Lock);
+
+    if (Queue->Deferring) {
+        if (Queue->DeferredHead == NULL) {
+            ASSERT3U(Queue->DeferredCount, ==, 0);
+            Queue->DeferredHead = NetBufferList;
+        } else {
+            NET_BUFFER_LIST_NEXT_NBL(Queue->DeferredTail) = NetBufferList;
+        }
+        Queue->DeferredTail = Tail;
+        Queue->DeferredCount += Count;
+        Queue->DeferredHeld += Held;
+
+        KeReleaseSpinLockFromDpcLevel(&Queue->Lock);
+
+        (VOID) KeInsertQueueDpc(&Queue->Dpc,
+                                (PVOID)(ULONG_PTR)Index,
+                                NULL);
+        goto done;
+    }
+
+    KeReleaseSpinLockFromDpcLevel(&Queue->Lock);
+
+    Now = KeQueryInterruptTime();
+
+    // A run ends when the queue has been idle for a while
+    if (Now - Queue->Last > RECEIVER_TIME_BUDGET)
+        Queue->Packets = 0;
+
+    Queue->Last = Now;
+
+    if (Queue->Packets == 0)
+        Queue->Start = Now;
+
+    Queue->Packets += Count;
+
+    //
+    // If the budget is exhausted then indicate what we have, but defer
+    // everything that follows until the threaded DPC has caught up.
+    //
+    if (Queue->Packets >= RECEIVER_PACKET_BUDGET ||
+        Now - Queue->Start >= RECEIVER_TIME_BUDGET) {
+        KeAcquireSpinLockAtDpcLevel(&Queue->Lock);
+        Queue->Deferring = TRUE;
+        KeReleaseSpinLockFromDpcLevel(&Queue->Lock);
+
+        Queue->Packets = 0;
+        Queue->Exhausted++;
+    }
+
+    __ReceiverQueueRelease(Queue);
+
+    __ReceiverIndicatePackets(Receiver, NetBufferList, Count, Held);
+    return;
+
+done:
+    __ReceiverQueueRelease(Queue);
+}
+
+static KDEFERRED_ROUTINE    ReceiverDpc;
+
+__drv_functionClass(KDEFERRED_ROUTINE)
+__drv_maxIRQL(DISPATCH_LEVEL)
+__drv_minIRQL(PASSIVE_LEVEL)
+__drv_sameIRQL
+static VOID
+ReceiverDpc(
+    IN  PKDPC               Dpc,
+    IN  PVOID               Context,
+    IN  PVOID               Argument1,
+    IN  PVOID               Argument2
+    )
+{
+    PXENNET_RECEIVER        Receiver = Context;
+    ULONG                   Index = (ULONG)(ULONG_PTR)Argument1;
+    PXENNET_RECEIVER_QUEUE  Queue;
+    PNET_BUFFER_LIST        NetBufferList;
+    PNET_BUFFER_LIST        Tail;
+    ULONG                   Count;
+    ULONG                   Held;
+    BOOLEAN                 Requeue;
+    KIRQL                   Irql;
+
+    UNREFERENCED_PARAMETER(Argument2);
+
+    ASSERT(Receiver != NULL);
+    ASSERT3U(Index, <, HVM_MAX_VCPUS);
+
+    Queue = &Receiver->Queue[Index];
+
+    KeAcquireSpinLock(&Queue->Lock, &Irql);
+
+    NetBufferList = Queue->DeferredHead;
+    Tail = NULL;
+    Count = 0;
+    Held = 0;
+
+    // Take no more than a budget's worth
+    while (Queue->DeferredHead != NULL && Count < RECEIVER_PACKET_BUDGET) {
+        Tail = Queue->DeferredHead;
+        Queue->DeferredHead = NET_BUFFER_LIST_NEXT_NBL(Tail);
+
+        Count++;
+        Held += __ReceiverGetHeld(Tail);
+    }
+
+    if (Tail != NULL)
+        NET_BUFFER_LIST_NEXT_NBL(Tail) = NULL;
+
+    if (Queue->DeferredHead == NULL)
+        Queue->DeferredTail = NULL;
+
+    ASSERT3U(Queue->DeferredCount, >=, Count);
+    Queue->DeferredCount -= Count;
+    ASSERT3U(Queue->DeferredHeld, >=, Held);
+    Queue->DeferredHeld -= Held;
+
+    Requeue = (Queue->DeferredHead != NULL) ? TRUE : FALSE;
+
+    // Once we have caught up packets can be indicated in-line again
+    if (!Requeue)
+        Queue->Deferring = FALSE;
+
+    KeReleaseSpinLock(&Queue->Lock, Irql);
+
+    if (Count != 0)
+        __ReceiverIndicatePackets(Receiver, NetBufferList, Count, Held);
+
+    // Let the ring have a turn before doing any more
+    if (Requeue)
+        (VOID) KeInsertQueueDpc(Dpc, Argument1, NULL);
+}
+
+static KDEFERRED_ROUTINE    ReceiverSteeringDpc;
+
+__drv_functionClass(KDEFERRED_ROUTINE)
+__drv_maxIRQL(DISPATCH_LEVEL)
+__drv_minIRQL(PASSIVE_LEVEL)
+__drv_sameIRQL
+static VOID
+ReceiverSteeringDpc(
+    IN  PKDPC               Dpc,
+    IN  PVOID               Context,
+    IN  PVOID               Argument1,
+    IN  PVOID               Argument2
+    )
+{
+    PXENNET_RECEIVER        Receiver = Context;
+    ULONG                   Index = (ULONG)(ULONG_PTR)Argument1;
+    PXENNET_RECEIVER_TARGET Target;
+    PNET_BUFFER_LIST        NetBufferList;
+    PNET_BUFFER_LIST        Tail;
+    ULONG                   Count;
+    ULONG                   Held;
+    BOOLEAN                 Requeue;
+    KIRQL                   Irql;
+
+    UNREFERENCED_PARAMETER(Argument2);
+
+    ASSERT(Receiver != NULL);
+    ASSERT3U(Index, <, HVM_MAX_VCPUS);
+
+    Target = &Receiver->Target[Index];
 
-    KeAcquireSpinLockAtDpcLevel(&Queue->Lock);
+    KeAcquireSpinLock(&Target->Lock, &Irql);
 
-    NetBufferList = Queue->Head;
-    Count = Queue->Count;
+    NetBufferList = Target->Head;
+    Tail = NULL;
+    Count = 0;
+    Held = 0;
 
-    Queue->Tail = Queue->Head = NULL;
-    Queue->Count = 0;
+    // Take no more than a budget's worth
+    while (Target->Head != NULL && Count < RECEIVER_PACKET_BUDGET) {
+        Tail = Target->Head;
+        Target->Head = NET_BUFFER_LIST_NEXT_NBL(Tail);
 
-    KeReleaseSpinLockFromDpcLevel(&Queue->Lock);
+        Count++;
+        Held += __ReceiverGetHeld(Tail);
+    }
 
-    (VOID) InterlockedAdd(&Receiver->Indicated, Count);
+    if (Tail != NULL)
+        NET_BUFFER_LIST_NEXT_NBL(Tail) = NULL;
 
-    Returned = Receiver->Returned;
+    if (Target->Head == NULL)
+        Target->Tail = NULL;
 
-    KeMemoryBarrier();
+    ASSERT3U(Target->Count, >=, Count);
+    Target->Count -= Count;
+    ASSERT3U(Target->Held, >=, Held);
+    Target->Held -= Held;
 
-    Indicated = Receiver->Indicated;
+    Requeue = (Target->Head != NULL) ? TRUE : FALSE;
 
-    Flags = NDIS_RECEIVE_FLAGS_DISPATCH_LEVEL |
-            NDIS_RECEIVE_FLAGS_PERFECT_FILTERED;
+    KeReleaseSpinLock(&Target->Lock, Irql);
 
-    ASSERT3S(Indicated - Returned, >=, 0);
-    if (Indicated - Returned > IN_NDIS_MAX)
-        Flags |= NDIS_RECEIVE_FLAGS_RESOURCES;
+    if (Count != 0)
+        __ReceiverIndicatePackets(Receiver, NetBufferList, Count, Held);
 
-    __IndicateReceiveNetBufferLists(Receiver,
-                                    NetBufferList,
-                                    NDIS_DEFAULT_PORT_NUMBER,
-                                    Count,
-                                    Flags);
+    // Let the local ring have a turn before doing any more
+    if (Requeue)
+        (VOID) KeInsertQueueDpc(Dpc, Argument1, NULL);
+}
+
+static KDEFERRED_ROUTINE    ReceiverQuiesceDpc;
+
+__drv_functionClass(KDEFERRED_ROUTINE)
+__drv_maxIRQL(DISPATCH_LEVEL)
+__drv_minIRQL(DISPATCH_LEVEL)
+__drv_requiresIRQL(DISPATCH_LEVEL)
+__drv_sameIRQL
+static VOID
+ReceiverQuiesceDpc(
+    IN  PKDPC               Dpc,
+    IN  PVOID               Context,
+    IN  PVOID               Argument1,
+    IN  PVOID               Argument2
+    )
+{
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(Context);
+    UNREFERENCED_PARAMETER(Argument1);
+    UNREFERENCED_PARAMETER(Argument2);
 }
 
 NDIS_STATUS
@@ -459,14 +2263,68 @@ ReceiverInitialize(
     if ((*Receiver)->NetBufferListPool == NULL)
         goto fail2;
 
+    (*Receiver)->Toeplitz = ExAllocatePoolWithTag(NonPagedPool,
+                                                  sizeof (HASH_TOEPLITZ),
+                                                  RECEIVER_POOL_TAG);
+
+    status = NDIS_STATUS_RESOURCES;
+    if ((*Receiver)->Toeplitz == NULL)
+        goto fail3;
+
+    RtlZeroMemory((*Receiver)->Toeplitz, sizeof (HASH_TOEPLITZ));
+
+    __ReceiverCacheInitialize(&(*Receiver)->Cache,
+                              *Receiver,
+                              __ReceiverPacketCtor,
+                              __ReceiverPacketDtor,
+                              RECEIVER_DEPOT_LIMIT);
+
+    __ReceiverCacheInitialize(&(*Receiver)->CopyCache,
+                              *Receiver,
+                              __ReceiverCopyCtor,
+                              __ReceiverCopyDtor,
+                              RECEIVER_DEPOT_LIMIT);
+
+    //
+    // XENVIF processes each receive ring from a DPC targeted at the
+    // processor with the same index, so deferred packets are indicated
+    // there too, but from a thread so that the processor is not held
+    // at DISPATCH_LEVEL for as long as the backlog lasts.
+    //
     for (Index = 0; Index < HVM_MAX_VCPUS; Index++) {
         PXENNET_RECEIVER_QUEUE  Queue = &(*Receiver)->Queue[Index];
+        PROCESSOR_NUMBER        ProcNumber;
 
         KeInitializeSpinLock(&Queue->Lock);
+        KeInitializeThreadedDpc(&Queue->Dpc, ReceiverDpc, *Receiver);
+
+        if (!NT_SUCCESS(KeGetProcessorNumberFromIndex(Index, &ProcNumber)))
+            continue;
+
+        (VOID) KeSetTargetProcessorDpcEx(&Queue->Dpc, &ProcNumber);
+    }
+
+    for (Index = 0; Index < HVM_MAX_VCPUS; Index++) {
+        PXENNET_RECEIVER_TARGET Target = &(*Receiver)->Target[Index];
+        PROCESSOR_NUMBER        ProcNumber;
+
+        KeInitializeSpinLock(&Target->Lock);
+        KeInitializeThreadedDpc(&Target->Dpc, ReceiverSteeringDpc, *Receiver);
+        KeInitializeDpc(&Target->QuiesceDpc, ReceiverQuiesceDpc, *Receiver);
+
+        if (!NT_SUCCESS(KeGetProcessorNumberFromIndex(Index, &ProcNumber)))
+            continue;
+
+        (VOID) KeSetTargetProcessorDpcEx(&Target->Dpc, &ProcNumber);
+        (VOID) KeSetTargetProcessorDpcEx(&Target->QuiesceDpc, &ProcNumber);
     }
 
     return NDIS_STATUS_SUCCESS;
 
+fail3:
+    NdisFreeNetBufferListPool((*Receiver)->NetBufferListPool);
+    (*Receiver)->NetBufferListPool = NULL;
+
 fail2:
 fail1:
     return status;
@@ -477,43 +2335,23 @@ ReceiverTeardown(
     IN  PXENNET_RECEIVER    Receiver
     )
 {
-    ULONG                   Index;
-    PNET_BUFFER_LIST        NetBufferList;
-
     ASSERT(Receiver != NULL);
 
-    ASSERT3U(Receiver->Returned, ==, Receiver->Indicated);
-
-    for (Index = 0; Index < HVM_MAX_VCPUS; Index++) {
-        NetBufferList = Receiver->GetList[Index];
-
-        while (NetBufferList != NULL) {
-            PNET_BUFFER_LIST    Next;
-
-            Next = NET_BUFFER_LIST_NEXT_NBL(NetBufferList);
-            NET_BUFFER_LIST_NEXT_NBL(NetBufferList) = NULL;
-
-            NdisFreeNetBufferList(NetBufferList);
+    KeFlushQueuedDpcs();
 
-            NetBufferList = Next;
-        }
-    }
-
-    NetBufferList = Receiver->PutList;
-    while (NetBufferList != NULL) {
-        PNET_BUFFER_LIST    Next;
-
-        Next = NET_BUFFER_LIST_NEXT_NBL(NetBufferList);
-        NET_BUFFER_LIST_NEXT_NBL(NetBufferList) = NULL;
+    ASSERT3U(Receiver->Returned, ==, Receiver->Indicated);
 
-        NdisFreeNetBufferList(NetBufferList);
+    __ReceiverCacheTeardown(&Receiver->CopyCache);
+    ASSERT3U(Receiver->CopyCount, ==, 0);
 
-        NetBufferList = Next;
-    }
+    __ReceiverCacheTeardown(&Receiver->Cache);
 
     NdisFreeNetBufferListPool(Receiver->NetBufferListPool);
     Receiver->NetBufferListPool = NULL;
 
+    ExFreePoolWithTag(Receiver->Toeplitz, RECEIVER_POOL_TAG);
+    Receiver->Toeplitz = NULL;
+
     Receiver->Adapter = NULL;
 
     ExFreePoolWithTag(Receiver, RECEIVER_POOL_TAG);
@@ -526,9 +2364,174 @@ ReceiverReturnNetBufferLists(
     IN  ULONG               ReturnFlags
     )
 {
-    UNREFERENCED_PARAMETER(ReturnFlags);
+    KIRQL                   Irql = PASSIVE_LEVEL;
+
+    // The receive cache is per-processor so we must not be preempted
+    if (!NDIS_TEST_RETURN_AT_DISPATCH_LEVEL(ReturnFlags)) {
+        ASSERT3U(NDIS_CURRENT_IRQL(), <=, DISPATCH_LEVEL);
+        KeRaiseIrql(DISPATCH_LEVEL, &Irql);
+    }
 
     __ReceiverReturnNetBufferLists(Receiver, NetBufferList, TRUE);
+
+    if (!NDIS_TEST_RETURN_AT_DISPATCH_LEVEL(ReturnFlags))
+        KeLowerIrql(Irql);
+}
+
+//
+// Packets that the backend has not validated would otherwise have
+// their checksums verified again by the stack. While the packet is
+// still cache hot it is cheaper to do that here, so validate whatever
+// receive checksum offloads are enabled and pass on the result.
+//
+static VOID
+__ReceiverValidateChecksums(
+    IN      PXENNET_RECEIVER                Receiver,
+    IN      PXENNET_RECEIVER_QUEUE          Queue,
+    IN      PMDL                            Mdl,
+    IN      ULONG                           Offset,
+    IN      ULONG                           Length,
+    IN      PXENVIF_PACKET_INFO             Info,
+    IN OUT  PXENVIF_PACKET_CHECKSUM_FLAGS   Flags
+    )
+{
+    PXENVIF_VIF_OFFLOAD_OPTIONS             OffloadOptions;
+    PUCHAR                                  Frame;
+    PIP_HEADER                              IpHeader;
+    ULONG                                   PayloadLength;
+    ULONG                                   Sum;
+
+    if (Info->IpHeader.Length == 0 ||
+        Offset + Info->Length > Mdl->ByteCount)
+        return;
+
+    Frame = MmGetSystemAddressForMdlSafe(Mdl, NormalPagePriority);
+    if (Frame == NULL)
+        return;
+
+    Frame += Offset;
+    IpHeader = (PIP_HEADER)(Frame + Info->IpHeader.Offset);
+    OffloadOptions = &Receiver->OffloadOptions;
+
+    if (IpHeader->Version == 4) {
+        PIPV4_HEADER    Version4 = &IpHeader->Version4;
+        ULONG           HeaderLength = IPV4_HEADER_LENGTH(Version4);
+
+        if (Flags->IpChecksumNotValidated &&
+            OffloadOptions->OffloadIpVersion4HeaderChecksum) {
+            Flags->IpChecksumNotValidated = 0;
+
+            if (ChecksumAccumulate(Version4, HeaderLength, 0) == 0xFFFF) {
+                Flags->IpChecksumSucceeded = 1;
+                Queue->IpChecksumsValidated++;
+            } else {
+                Flags->IpChecksumFailed = 1;
+                Queue->ChecksumsFailed++;
+            }
+        }
+
+        if (Info->TcpHeader.Length == 0 &&
+            Info->UdpHeader.Length == 0)
+            return;
+
+        if ((Info->TcpHeader.Length != 0 &&
+             !(Flags->TcpChecksumNotValidated &&
+               OffloadOptions->OffloadIpVersion4TcpChecksum)) ||
+            (Info->UdpHeader.Length != 0 &&
+             !(Flags->UdpChecksumNotValidated &&
+               OffloadOptions->OffloadIpVersion4UdpChecksum)))
+            return;
+
+        if (NTOHS(Version4->PacketLength) < HeaderLength)
+            return;
+
+        PayloadLength = NTOHS(Version4->PacketLength) - HeaderLength;
+
+        Sum = ChecksumPseudoHeader(&Version4->SourceAddress,
+                                   &Version4->DestinationAddress,
+                                   IPV4_ADDRESS_LENGTH,
+                                   Version4->Protocol,
+                                   PayloadLength);
+    } else {
+        PIPV6_HEADER    Version6 = &IpHeader->Version6;
+
+        if (Info->TcpHeader.Length == 0 &&
+            Info->UdpHeader.Length == 0)
+            return;
+
+        if ((Info->TcpHeader.Length != 0 &&
+             !(Flags->TcpChecksumNotValidated &&
+               OffloadOptions->OffloadIpVersion6TcpChecksum)) ||
+            (Info->UdpHeader.Length != 0 &&
+             !(Flags->UdpChecksumNotValidated &&
+               OffloadOptions->OffloadIpVersion6UdpChecksum)))
+            return;
+
+        if (NTOHS(Version6->PayloadLength) < Info->IpOptions.Length)
+            return;
+
+        PayloadLength = NTOHS(Version6->PayloadLength) - Info->IpOptions.Length;
+
+        Sum = ChecksumPseudoHeader(&Version6->SourceAddress,
+                                   &Version6->DestinationAddress,
+                                   IPV6_ADDRESS_LENGTH,
+                                   (Info->TcpHeader.Length != 0) ?
+                                   IPPROTO_TCP :
+                                   IPPROTO_UDP,
+                                   PayloadLength);
+    }
+
+    if (Info->IsAFragment)
+        return;
+
+    if (Info->TcpHeader.Length != 0) {
+        if (Info->TcpHeader.Offset + PayloadLength > Length)
+            return;
+
+        if (!ChecksumAccumulateMdl(Mdl,
+                                   Offset + Info->TcpHeader.Offset,
+                                   PayloadLength,
+                                   &Sum))
+            return;
+
+        Flags->TcpChecksumNotValidated = 0;
+
+        if (Sum == 0xFFFF) {
+            Flags->TcpChecksumSucceeded = 1;
+            Queue->TcpChecksumsValidated++;
+        } else {
+            Flags->TcpChecksumFailed = 1;
+            Queue->ChecksumsFailed++;
+        }
+    } else if (Info->UdpHeader.Length != 0) {
+        PUDP_HEADER UdpHeader = (PUDP_HEADER)(Frame + Info->UdpHeader.Offset);
+
+        if (Info->UdpHeader.Offset + PayloadLength > Length)
+            return;
+
+        // A zero checksum means that the sender did not calculate one
+        if (UdpHeader->Checksum == 0) {
+            if (IpHeader->Version != 4)
+                return;
+
+            Sum = 0xFFFF;
+        } else if (!ChecksumAccumulateMdl(Mdl,
+                                          Offset + Info->UdpHeader.Offset,
+                                          PayloadLength,
+                                          &Sum)) {
+            return;
+        }
+
+        Flags->UdpChecksumNotValidated = 0;
+
+        if (Sum == 0xFFFF) {
+            Flags->UdpChecksumSucceeded = 1;
+            Queue->UdpChecksumsValidated++;
+        } else {
+            Flags->UdpChecksumFailed = 1;
+            Queue->ChecksumsFailed++;
+        }
+    }
 }
 
 VOID
@@ -552,6 +2555,28 @@ ReceiverQueuePacket(
     PXENNET_RECEIVER_QUEUE              Queue;
 
     VifInterface = AdapterGetVifInterface(Receiver->Adapter);
+    Queue = &Receiver->Queue[Index];
+
+    if (!Receiver->Enabled) {
+        XENVIF_VIF(ReceiverReturnPacket,
+                   VifInterface,
+                   Cookie);
+        return;
+    }
+
+    // Packets coalesced by the backend are left alone
+    if (Receiver->ValidateChecksums &&
+        MaximumSegmentSize == 0 &&
+        (Flags.IpChecksumNotValidated ||
+         Flags.TcpChecksumNotValidated ||
+         Flags.UdpChecksumNotValidated))
+        __ReceiverValidateChecksums(Receiver,
+                                    Queue,
+                                    Mdl,
+                                    Offset,
+                                    Length,
+                                    Info,
+                                    &Flags);
 
     NetBufferList = __ReceiverReceivePacket(Receiver,
                                             Mdl,
@@ -570,9 +2595,13 @@ ReceiverQueuePacket(
         goto done;
     }
 
-    Queue = &Receiver->Queue[Index];
+    __ReceiverQueueAcquire(Queue);
 
-    KeAcquireSpinLockAtDpcLevel(&Queue->Lock);
+    // Segments absorbed into an SCU are not queued in their own right
+    if (__ReceiverCoalescePacket(Receiver, Queue, NetBufferList, Info)) {
+        __ReceiverQueueRelease(Queue);
+        goto done;
+    }
 
     if (Queue->Head == NULL) {
         ASSERT3U(Queue->Count, ==, 0);
@@ -583,13 +2612,235 @@ ReceiverQueuePacket(
     }
     Queue->Count++;
 
-    KeReleaseSpinLockFromDpcLevel(&Queue->Lock);
+    if (__ReceiverGetCookie(NetBufferList) != NULL)
+        Queue->Held++;
+
+    __ReceiverQueueRelease(Queue);
 
 done:
-    if (!More)
+    // Don't let a long burst build up more than a budget's worth
+    if (!More || Queue->Count >= RECEIVER_PACKET_BUDGET)
         __ReceiverPushPackets(Receiver, Index);
 }
 
+VOID
+ReceiverSetCopyBreak(
+    IN  PXENNET_RECEIVER    Receiver,
+    IN  ULONG               CopyBreak
+    )
+{
+    Receiver->CopyBreak = __min(CopyBreak, RECEIVER_COPY_BREAK_MAX);
+}
+
+VOID
+ReceiverSetChecksumValidation(
+    IN  PXENNET_RECEIVER    Receiver,
+    IN  BOOLEAN             Enabled
+    )
+{
+    Receiver->ValidateChecksums = Enabled;
+}
+
+//
+// Steering is only worth its cost if the table uses more processors
+// than there are rings, otherwise the backend has already done the job.
+// That is not true of packets hashed here though: the backend chose
+// their ring without the hash, so it is only the table lookup that
+// spreads them out.
+//
+static VOID
+__ReceiverUpdateSteering(
+    IN  PXENNET_RECEIVER    Receiver
+    )
+{
+    ULONG                   RingCount;
+    BOOLEAN                 Enabled;
+
+    Receiver->SteeringTableSize = 0;
+    KeMemoryBarrier();
+
+    if (Receiver->SteeringEntries == 0)
+        return;
+
+    XENVIF_VIF(QueryRingCount,
+               AdapterGetVifInterface(Receiver->Adapter),
+               &RingCount);
+
+    Enabled = FALSE;
+    if (Receiver->HashTypes != 0)
+        Enabled = TRUE;
+    else if (Receiver->Steering && Receiver->SteeringProcessors > RingCount)
+        Enabled = TRUE;
+
+    Info("%ws: STEERING %s (%u PROCESSORS, %u RINGS, SOFTWARE HASH %08x)\n",
+         AdapterGetLocation(Receiver->Adapter),
+         (Enabled) ? "ENABLED" : "DISABLED",
+         Receiver->SteeringProcessors,
+         RingCount,
+         Receiver->HashTypes);
+
+    if (!Enabled)
+        return;
+
+    KeMemoryBarrier();
+
+    Receiver->SteeringTableSize = Receiver->SteeringEntries;
+}
+
+VOID
+ReceiverSetHashTypes(
+    IN  PXENNET_RECEIVER    Receiver,
+    IN  ULONG               Types
+    )
+{
+    Receiver->HashTypes = Types;
+
+    __ReceiverUpdateSteering(Receiver);
+}
+
+//
+// Packets are hashed from the XENVIF receive DPCs without a lock, so the
+// table for a new key is built aside and swapped in. The old one is only
+// freed once a DPC has run on every processor since the swap.
+//
+NDIS_STATUS
+ReceiverSetHashKey(
+    IN  PXENNET_RECEIVER    Receiver,
+    IN  PUCHAR              Key,
+    IN  ULONG               KeySize
+    )
+{
+    PHASH_TOEPLITZ          Toeplitz;
+    ULONG                   Count;
+    ULONG                   Index;
+
+    ASSERT3U(KeGetCurrentIrql(), ==, PASSIVE_LEVEL);
+
+    Toeplitz = ExAllocatePoolWithTag(NonPagedPool,
+                                     sizeof (HASH_TOEPLITZ),
+                                     RECEIVER_POOL_TAG);
+    if (Toeplitz == NULL)
+        return NDIS_STATUS_RESOURCES;
+
+    HashToeplitzInitialize(Toeplitz, Key, KeySize);
+
+    Toeplitz = InterlockedExchangePointer(&Receiver->Toeplitz, Toeplitz);
+
+    Count = __min(KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS),
+                  HVM_MAX_VCPUS);
+    for (Index = 0; Index < Count; Index++)
+        (VOID) KeInsertQueueDpc(&Receiver->Target[Index].QuiesceDpc,
+                                NULL,
+                                NULL);
+
+    KeFlushQueuedDpcs();
+
+    ExFreePoolWithTag(Toeplitz, RECEIVER_POOL_TAG);
+
+    return NDIS_STATUS_SUCCESS;
+}
+
+VOID
+ReceiverSetSteering(
+    IN  PXENNET_RECEIVER    Receiver,
+    IN  BOOLEAN             Enabled
+    )
+{
+    Receiver->Steering = Enabled;
+}
+
+VOID
+ReceiverUpdateSteeringTable(
+    IN  PXENNET_RECEIVER    Receiver,
+    IN  PPROCESSOR_NUMBER   Table,
+    IN  ULONG               TableSize
+    )
+{
+    ULONG                   Processor[RECEIVER_STEERING_TABLE_SIZE];
+    ULONG                   Count;
+    ULONG                   Entry;
+
+    Receiver->SteeringTableSize = 0;
+    KeMemoryBarrier();
+
+    Receiver->SteeringEntries = 0;
+    Receiver->SteeringProcessors = 0;
+
+    if (TableSize == 0 ||
+        TableSize > RECEIVER_STEERING_TABLE_SIZE ||
+        (TableSize & (TableSize - 1)) != 0)
+        goto done;
+
+    Count = 0;
+    for (Entry = 0; Entry < TableSize; Entry++) {
+        ULONG   Other;
+
+        Processor[Entry] = KeGetProcessorIndexFromNumber(&Table[Entry]);
+        if (Processor[Entry] >= HVM_MAX_VCPUS)
+            goto done;
+
+        for (Other = 0; Other < Entry; Other++)
+            if (Processor[Other] == Processor[Entry])
+                break;
+
+        if (Other == Entry)
+            Count++;
+    }
+
+    RtlCopyMemory(Receiver->SteeringTable, Processor, TableSize * sizeof (ULONG));
+
+    Receiver->SteeringEntries = TableSize;
+    Receiver->SteeringProcessors = Count;
+
+done:
+    __ReceiverUpdateSteering(Receiver);
+}
+
+VOID
+ReceiverSetCoalescing(
+    IN  PXENNET_RECEIVER    Receiver,
+    IN  BOOLEAN             IpVersion4,
+    IN  BOOLEAN             IpVersion6
+    )
+{
+    Receiver->CoalesceIpVersion4 = IpVersion4;
+    Receiver->CoalesceIpVersion6 = IpVersion6;
+}
+
+VOID
+ReceiverQueryCoalescing(
+    IN  PXENNET_RECEIVER    Receiver,
+    OUT PBOOLEAN            IpVersion4,
+    OUT PBOOLEAN            IpVersion6
+    )
+{
+    *IpVersion4 = Receiver->CoalesceIpVersion4;
+    *IpVersion6 = Receiver->CoalesceIpVersion6;
+}
+
+VOID
+ReceiverQueryCoalescingStatistics(
+    IN  PXENNET_RECEIVER            Receiver,
+    OUT PNDIS_RSC_STATISTICS_INFO   Statistics
+    )
+{
+    ULONG                           Index;
+
+    RtlZeroMemory(Statistics, sizeof (NDIS_RSC_STATISTICS_INFO));
+    Statistics->Header.Type = NDIS_OBJECT_TYPE_DEFAULT;
+    Statistics->Header.Revision = NDIS_RSC_STATISTICS_REVISION_1;
+    Statistics->Header.Size = NDIS_SIZEOF_RSC_STATISTICS_REVISION_1;
+
+    for (Index = 0; Index < HVM_MAX_VCPUS; Index++) {
+        PXENNET_RECEIVER_QUEUE  Queue = &Receiver->Queue[Index];
+
+        Statistics->CoalescedPkts += Queue->CoalescedPackets;
+        Statistics->CoalescedOctets += Queue->CoalescedOctets;
+        Statistics->CoalesceEvents += Queue->CoalesceEvents;
+        Statistics->Aborts += Queue->CoalesceAborts;
+    }
+}
+
 PXENVIF_VIF_OFFLOAD_OPTIONS
 ReceiverOffloadOptions(
     IN  PXENNET_RECEIVER    Receiver
@@ -604,9 +2855,140 @@ ReceiverEnable(
     )
 {
     PXENNET_ADAPTER         Adapter = Receiver->Adapter;
+    PXENVIF_VIF_INTERFACE   VifInterface;
+    ULONG                   RingCount;
+    ULONG                   RingSize;
+    ULONG                   Count;
+    NDIS_STATUS             status;
+
+    VifInterface = AdapterGetVifInterface(Adapter);
+
+    XENVIF_VIF(QueryRingCount,
+               VifInterface,
+               &RingCount);
+
+    XENVIF_VIF(ReceiverQueryRingSize,
+               VifInterface,
+               &RingSize);
+
+    //
+    // Make sure there are enough NBLs cached to cover every slot in
+    // every ring, plus everything that NDIS may be holding on to,
+    // so that allocation in the receive path is exceptional.
+    //
+    Count = (RingCount * RingSize) + IN_NDIS_MAX;
+
+    status = __ReceiverCacheFill(&Receiver->Cache, Count);
+    if (status != NDIS_STATUS_SUCCESS)
+        Warning("%ws: failed to pre-allocate %u NBLs (%08x)\n",
+                AdapterGetLocation(Adapter),
+                Count,
+                status);
+
+    if (Receiver->CopyBreak != 0) {
+        status = __ReceiverCacheFill(&Receiver->CopyCache, IN_NDIS_MAX);
+        if (status != NDIS_STATUS_SUCCESS)
+            Warning("%ws: failed to pre-allocate %u copy NBLs (%08x)\n",
+                    AdapterGetLocation(Adapter),
+                    IN_NDIS_MAX,
+                    status);
+    }
+
+    Receiver->Enabled = TRUE;
+    KeMemoryBarrier();
+
+    Info("%ws: <====> (RingCount = %u RingSize = %u)\n",
+         AdapterGetLocation(Adapter),
+         RingCount,
+         RingSize);
+}
+
+static VOID
+__ReceiverDrain(
+    IN  PXENNET_RECEIVER    Receiver
+    )
+{
+    PXENNET_ADAPTER         Adapter = Receiver->Adapter;
+    LARGE_INTEGER           Timeout;
+    ULONG                   Polls;
+    ULONG                   Index;
+    KIRQL                   Irql;
+
+    Receiver->Enabled = FALSE;
+    KeMemoryBarrier();
+
+    //
+    // Wait for any XENVIF callback or DPC that may have seen us enabled.
+    // Anything they leave behind is dropped rather than indicated.
+    //
+    KeFlushQueuedDpcs();
+
+    KeRaiseIrql(DISPATCH_LEVEL, &Irql);
+
+    for (Index = 0; Index < HVM_MAX_VCPUS; Index++) {
+        PXENNET_RECEIVER_QUEUE  Queue = &Receiver->Queue[Index];
+        PNET_BUFFER_LIST        NetBufferList;
+        ULONG                   Count;
+        ULONG                   Held;
+
+        // Anything this steers or defers is picked up below
+        if (Queue->Head != NULL || Queue->FlowCount != 0)
+            __ReceiverPushPackets(Receiver, Index);
 
-    Info("%ws: <====>\n",
-         AdapterGetLocation(Adapter));
+        KeAcquireSpinLockAtDpcLevel(&Queue->Lock);
+
+        NetBufferList = Queue->DeferredHead;
+        Count = Queue->DeferredCount;
+        Held = Queue->DeferredHeld;
+
+        Queue->DeferredHead = Queue->DeferredTail = NULL;
+        Queue->DeferredCount = 0;
+        Queue->DeferredHeld = 0;
+        Queue->Deferring = FALSE;
+
+        KeReleaseSpinLockFromDpcLevel(&Queue->Lock);
+
+        if (NetBufferList != NULL)
+            __ReceiverIndicatePackets(Receiver, NetBufferList, Count, Held);
+    }
+
+    for (Index = 0; Index < HVM_MAX_VCPUS; Index++) {
+        PXENNET_RECEIVER_TARGET Target = &Receiver->Target[Index];
+        PNET_BUFFER_LIST        NetBufferList;
+        ULONG                   Count;
+        ULONG                   Held;
+
+        KeAcquireSpinLockAtDpcLevel(&Target->Lock);
+
+        NetBufferList = Target->Head;
+        Count = Target->Count;
+        Held = Target->Held;
+
+        Target->Head = Target->Tail = NULL;
+        Target->Count = 0;
+        Target->Held = 0;
+
+        KeReleaseSpinLockFromDpcLevel(&Target->Lock);
+
+        if (NetBufferList != NULL)
+            __ReceiverIndicatePackets(Receiver, NetBufferList, Count, Held);
+    }
+
+    KeLowerIrql(Irql);
+
+    // The DPCs may still have been queued, but will find nothing to do
+    KeFlushQueuedDpcs();
+
+    Timeout.QuadPart = -RECEIVER_RETURN_POLL;
+
+    for (Polls = 1; Receiver->Returned != Receiver->Indicated; Polls++) {
+        if (Polls % RECEIVER_RETURN_WARN == 0)
+            Warning("%ws: waiting for %d NBLs to be returned\n",
+                    AdapterGetLocation(Adapter),
+                    Receiver->Indicated - Receiver->Returned);
+
+        (VOID) KeDelayExecutionThread(KernelMode, FALSE, &Timeout);
+    }
 }
 
 VOID
@@ -615,9 +2997,67 @@ ReceiverDisable(
     )
 {
     PXENNET_ADAPTER         Adapter = Receiver->Adapter;
+    ULONG                   Hit;
+    ULONG                   Miss;
+    ULONG                   CopyHit;
+    ULONG                   CopyMiss;
+    ULONG                   Exhausted;
+    ULONG                   IpChecksumsValidated;
+    ULONG                   TcpChecksumsValidated;
+    ULONG                   UdpChecksumsValidated;
+    ULONG                   ChecksumsFailed;
+    ULONG                   Index;
+
+    ASSERT3U(KeGetCurrentIrql(), ==, PASSIVE_LEVEL);
+
+    __ReceiverDrain(Receiver);
+
+    __ReceiverCacheStatistics(&Receiver->Cache, &Hit, &Miss);
+    __ReceiverCacheStatistics(&Receiver->CopyCache, &CopyHit, &CopyMiss);
+
+    Exhausted = 0;
+    IpChecksumsValidated = 0;
+    TcpChecksumsValidated = 0;
+    UdpChecksumsValidated = 0;
+    ChecksumsFailed = 0;
+    for (Index = 0; Index < HVM_MAX_VCPUS; Index++) {
+        PXENNET_RECEIVER_QUEUE  Queue = &Receiver->Queue[Index];
+
+        Exhausted += Queue->Exhausted;
+        IpChecksumsValidated += Queue->IpChecksumsValidated;
+        TcpChecksumsValidated += Queue->TcpChecksumsValidated;
+        UdpChecksumsValidated += Queue->UdpChecksumsValidated;
+        ChecksumsFailed += Queue->ChecksumsFailed;
+    }
 
-    Info("%ws: <====> (Indicated = %u Returned = %u)\n",
+    Info("%ws: <====> (Indicated = %u Returned = %u Cache Hit = %u Miss = %u Copy Hit = %u Miss = %u Exhausted = %u)\n",
          AdapterGetLocation(Adapter),
          Receiver->Indicated,
-         Receiver->Returned);
+         Receiver->Returned,
+         Hit,
+         Miss,
+         CopyHit,
+         CopyMiss,
+         Exhausted);
+
+    if (Receiver->ValidateChecksums)
+        Info("%ws: (Validated IP = %u TCP = %u UDP = %u Failed = %u)\n",
+             AdapterGetLocation(Adapter),
+             IpChecksumsValidated,
+             TcpChecksumsValidated,
+             UdpChecksumsValidated,
+             ChecksumsFailed);
+
+    for (Index = 0; Index < HVM_MAX_VCPUS; Index++) {
+        PXENNET_RECEIVER_TARGET Target = &Receiver->Target[Index];
+
+        if (Target->Steered == 0 && Target->Kept == 0)
+            continue;
+
+        Info("%ws: [%u] (Steered = %u Kept = %u)\n",
+             AdapterGetLocation(Adapter),
+             Index,
+             Target->Steered,
+             Target->Kept);
+    }
 }
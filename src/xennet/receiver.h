@@ -71,6 +71,64 @@ ReceiverQueuePacket(
     IN  PVOID                           Cookie
     );
 
+extern VOID
+ReceiverSetCopyBreak(
+    IN  PXENNET_RECEIVER    Receiver,
+    IN  ULONG               CopyBreak
+    );
+
+extern VOID
+ReceiverSetChecksumValidation(
+    IN  PXENNET_RECEIVER    Receiver,
+    IN  BOOLEAN             Enabled
+    );
+
+extern VOID
+ReceiverSetHashTypes(
+    IN  PXENNET_RECEIVER    Receiver,
+    IN  ULONG               Types
+    );
+
+extern NDIS_STATUS
+ReceiverSetHashKey(
+    IN  PXENNET_RECEIVER    Receiver,
+    IN  PUCHAR              Key,
+    IN  ULONG               KeySize
+    );
+
+extern VOID
+ReceiverSetSteering(
+    IN  PXENNET_RECEIVER    Receiver,
+    IN  BOOLEAN             Enabled
+    );
+
+extern VOID
+ReceiverUpdateSteeringTable(
+    IN  PXENNET_RECEIVER    Receiver,
+    IN  PPROCESSOR_NUMBER   Table,
+    IN  ULONG               TableSize
+    );
+
+extern VOID
+ReceiverSetCoalescing(
+    IN  PXENNET_RECEIVER    Receiver,
+    IN  BOOLEAN             IpVersion4,
+    IN  BOOLEAN             IpVersion6
+    );
+
+extern VOID
+ReceiverQueryCoalescing(
+    IN  PXENNET_RECEIVER    Receiver,
+    OUT PBOOLEAN            IpVersion4,
+    OUT PBOOLEAN            IpVersion6
+    );
+
+extern VOID
+ReceiverQueryCoalescingStatistics(
+    IN  PXENNET_RECEIVER            Receiver,
+    OUT PNDIS_RSC_STATISTICS_INFO   Statistics
+    );
+
 extern PXENVIF_VIF_OFFLOAD_OPTIONS
 ReceiverOffloadOptions(
     IN  PXENNET_RECEIVER    Receiver
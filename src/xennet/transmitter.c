@@ -30,27 +30,276 @@
  */
 
 #include <ndis.h>
+#include <procgrp.h>
+#include <xen.h>
+
+#include "util.h"
 #include "transmitter.h"
 #include "adapter.h"
+#include "checksum.h"
+#include "hash.h"
 #include <vif_interface.h>
+#include <ethernet.h>
 #include <tcpip.h>
 #include "dbg_print.h"
 #include "assert.h"
 
+//
+// Completed NBLs are gathered on a per-processor list, which is only
+// ever touched at DISPATCH_LEVEL on its own processor, and handed back
+// to NDIS as a single chain by a DPC targeted at that processor. As
+// the DPC is queued behind whatever is currently running, everything
+// completed by a burst of XENVIF callbacks goes back in one call.
+//
+typedef struct _XENNET_TRANSMITTER_PROCESSOR {
+    PNET_BUFFER_LIST    Head;
+    PNET_BUFFER_LIST    Tail;
+    ULONG               Count;
+    KDPC                Dpc;
+    KDPC                QuiesceDpc;
+    ULONG               Completed;
+    ULONG               Completions;    // Calls to NDIS
+    ULONG               Linearized;
+    ULONG               PassedThrough;
+    ULONG               Checksummed;
+    ULONG               Segmented;
+    ULONG               Segments;
+} XENNET_TRANSMITTER_PROCESSOR, *PXENNET_TRANSMITTER_PROCESSOR;
+
+//
+// Small packets, or packets split across many fragments, are copied
+// into a single page-sized buffer before being handed to XENVIF so
+// that they only need a single grant and ring slot. Buffers are kept
+// on a lock-free list; they are passed to XENVIF as the cookie, with
+// the bottom bit set to distinguish them from NBLs.
+//
+typedef struct _XENNET_TRANSMITTER_BUFFER {
+    SLIST_ENTRY         ListEntry;
+    PMDL                Mdl;
+    PUCHAR              Data;
+    PMDL                Partial;
+    PNET_BUFFER_LIST    NetBufferList;
+} XENNET_TRANSMITTER_BUFFER, *PXENNET_TRANSMITTER_BUFFER;
+
+#define TRANSMITTER_BUFFER_SIZE     PAGE_SIZE
+#define TRANSMITTER_BUFFER_MIN      64
+#define TRANSMITTER_BUFFER_MAX      1024
+#define TRANSMITTER_BUFFER_COOKIE   1
+
+//
+// Checksums that the backend cannot calculate are filled in here. To
+// avoid modifying the stack's buffers the headers are copied into a
+// transmitter buffer first; if the packet does not fit, MDLs are
+// copied until at least this much has been and the rest of the chain
+// is linked on behind the buffer. An MDL too big for the buffer is
+// only copied up to this length, and the remainder of it is described
+// by a partial MDL.
+//
+#define TRANSMITTER_CHECKSUM_HEADER_LENGTH  256
+
+//
+// Large packets that the backend cannot segment, or that are bigger
+// than it will take, are segmented here. Each segment is built in its
+// own transmitter buffer, so the headers plus one MSS must fit in one.
+//
+#define TRANSMITTER_LARGE_PACKET_SIZE       0xFFFF
+#define TRANSMITTER_SEGMENT_HEADER_LENGTH   256
+
+//
+// NET_BUFFERs that XENVIF will not take are held on a bounded backlog
+// rather than failed, and are retried by a DPC whenever XENVIF
+// completes a packet. While anything is on a backlog, new packets for
+// it are added behind it to preserve ordering.
+//
+// XENVIF selects the ring from the hash, so there is a backlog for
+// each of a number of buckets of hash values and packets for the same
+// ring always share one. A ring that is stalled then only holds up
+// the flows that hash alongside it, rather than everything.
+//
+// Only failures that more ring space could cure are backlogged. Any
+// other failure would wedge the head of the backlog, so the NET_BUFFER
+// is failed instead, as is one that is still failing after a number of
+// retries.
+//
+// A packet that follows one queued with More == TRUE is what pushes the
+// ring, so if it fails it is always backlogged (even if the backlog is
+// full) and the batch is marked open. While a batch is open the head
+// of the backlog is retried whatever the failure, and from a timer as
+// well as on completions, since the unpushed packets will never
+// complete. The same goes for a large packet that is only partly
+// segmented: it is backlogged with the batch open, and the rest of its
+// segments are sent when it is retried.
+//
+#define TRANSMITTER_BACKLOG_COUNT   8
+#define TRANSMITTER_BACKLOG_MAX     1024    // Each
+#define TRANSMITTER_BACKLOG_RETRIES 64
+#define TRANSMITTER_BACKLOG_DELAY   10000   // 1ms in 100ns units
+
+typedef struct _XENNET_TRANSMITTER_BACKLOG {
+    KSPIN_LOCK          Lock;
+    PNET_BUFFER         Head;
+    PNET_BUFFER         Tail;
+    ULONG               Count;
+    KDPC                Dpc;
+    KTIMER              Timer;
+    ULONG               Retries;
+    BOOLEAN             Open;
+    ULONG               Backlogged;
+    ULONG               Overflows;
+} XENNET_TRANSMITTER_BACKLOG, *PXENNET_TRANSMITTER_BACKLOG;
+
 struct _XENNET_TRANSMITTER {
-    PXENNET_ADAPTER             Adapter;
-    XENVIF_VIF_OFFLOAD_OPTIONS  OffloadOptions;
-    KSPIN_LOCK                  Lock;
+    PXENNET_ADAPTER                 Adapter;
+    XENVIF_VIF_OFFLOAD_OPTIONS      OffloadOptions;
+    XENVIF_VIF_OFFLOAD_OPTIONS      BackendOffloadOptions;
+    ULONG                           BackendLargePacketSize[2];  // IPv4, IPv6
+    KSPIN_LOCK                      Lock;
+    XENNET_TRANSMITTER_BACKLOG      Backlog[TRANSMITTER_BACKLOG_COUNT];
+    LONG                            Failed;
+    LONG                            Packets;
+    LONG                            Batches;    // Packets queued with More == FALSE
+    SLIST_HEADER                    BufferList;
+    LONG                            BufferCount;
+    ULONG                           CopyBreak;
+    ULONG                           MaximumFragments;
+    PHASH_TOEPLITZ                  Toeplitz;
+    ULONG                           HashTypes;
+    XENNET_TRANSMITTER_PROCESSOR    Processor[HVM_MAX_VCPUS];
+};
+
+//
+// Until NDIS supplies an RSS key, flows are hashed using the default
+// key from the Microsoft RSS specification.
+//
+static const UCHAR  TransmitterDefaultHashKey[XENVIF_VIF_HASH_KEY_SIZE] = {
+    0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2,
+    0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+    0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4,
+    0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+    0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa
 };
 
+//
+// Until NDIS enables RSS, TCP flows are hashed on their ports and
+// everything else on its addresses.
+//
+#define TRANSMITTER_DEFAULT_HASH_TYPES  \
+        (NDIS_HASH_IPV4 | NDIS_HASH_TCP_IPV4 | NDIS_HASH_IPV6 | NDIS_HASH_TCP_IPV6)
+
 #define TRANSMITTER_POOL_TAG        'TteN'
 
+static KDEFERRED_ROUTINE TransmitterDpc;
+static KDEFERRED_ROUTINE TransmitterBacklogDpc;
+static KDEFERRED_ROUTINE TransmitterQuiesceDpc;
+
+static PXENNET_TRANSMITTER_BUFFER
+__TransmitterBufferCtor(
+    IN  PXENNET_TRANSMITTER     Transmitter
+    )
+{
+    PXENNET_TRANSMITTER_BUFFER  Buffer;
+
+    Buffer = __AllocatePoolWithTag(NonPagedPool,
+                                   sizeof (XENNET_TRANSMITTER_BUFFER),
+                                   TRANSMITTER_POOL_TAG);
+    if (Buffer == NULL)
+        goto fail1;
+
+    Buffer->Data = __AllocatePoolWithTag(NonPagedPool,
+                                         TRANSMITTER_BUFFER_SIZE,
+                                         TRANSMITTER_POOL_TAG);
+    if (Buffer->Data == NULL)
+        goto fail2;
+
+    Buffer->Mdl = NdisAllocateMdl(AdapterGetHandle(Transmitter->Adapter),
+                                  Buffer->Data,
+                                  TRANSMITTER_BUFFER_SIZE);
+    if (Buffer->Mdl == NULL)
+        goto fail3;
+
+    return Buffer;
+
+fail3:
+    __FreePoolWithTag(Buffer->Data, TRANSMITTER_POOL_TAG);
+
+fail2:
+    __FreePoolWithTag(Buffer, TRANSMITTER_POOL_TAG);
+
+fail1:
+    return NULL;
+}
+
+static VOID
+__TransmitterBufferDtor(
+    IN  PXENNET_TRANSMITTER         Transmitter,
+    IN  PXENNET_TRANSMITTER_BUFFER  Buffer
+    )
+{
+    UNREFERENCED_PARAMETER(Transmitter);
+
+    ASSERT3P(Buffer->NetBufferList, ==, NULL);
+
+    NdisFreeMdl(Buffer->Mdl);
+    __FreePoolWithTag(Buffer->Data, TRANSMITTER_POOL_TAG);
+    __FreePoolWithTag(Buffer, TRANSMITTER_POOL_TAG);
+}
+
+static PXENNET_TRANSMITTER_BUFFER
+__TransmitterGetBuffer(
+    IN  PXENNET_TRANSMITTER     Transmitter
+    )
+{
+    PSLIST_ENTRY                ListEntry;
+    PXENNET_TRANSMITTER_BUFFER  Buffer;
+
+    ListEntry = InterlockedPopEntrySList(&Transmitter->BufferList);
+    if (ListEntry != NULL)
+        return CONTAINING_RECORD(ListEntry, XENNET_TRANSMITTER_BUFFER, ListEntry);
+
+    if (InterlockedIncrement(&Transmitter->BufferCount) > TRANSMITTER_BUFFER_MAX)
+        goto fail1;
+
+    Buffer = __TransmitterBufferCtor(Transmitter);
+    if (Buffer == NULL)
+        goto fail2;
+
+    return Buffer;
+
+fail2:
+fail1:
+    (VOID) InterlockedDecrement(&Transmitter->BufferCount);
+
+    return NULL;
+}
+
+static FORCEINLINE VOID
+__TransmitterPutBuffer(
+    IN  PXENNET_TRANSMITTER         Transmitter,
+    IN  PXENNET_TRANSMITTER_BUFFER  Buffer
+    )
+{
+    Buffer->NetBufferList = NULL;
+
+    // Undo any chaining done by __TransmitterCopyHeaders()
+    NdisAdjustMdlLength(Buffer->Mdl, TRANSMITTER_BUFFER_SIZE);
+    Buffer->Mdl->Next = NULL;
+
+    if (Buffer->Partial != NULL) {
+        MmPrepareMdlForReuse(Buffer->Partial);
+        IoFreeMdl(Buffer->Partial);
+        Buffer->Partial = NULL;
+    }
+
+    InterlockedPushEntrySList(&Transmitter->BufferList, &Buffer->ListEntry);
+}
+
 NDIS_STATUS
 TransmitterInitialize (
     IN  PXENNET_ADAPTER     Adapter,
     OUT PXENNET_TRANSMITTER *Transmitter
     )
 {
+    ULONG                   Index;
     NTSTATUS                status;
 
     *Transmitter = ExAllocatePoolWithTag(NonPagedPool,
@@ -67,8 +316,65 @@ TransmitterInitialize (
 
     KeInitializeSpinLock(&(*Transmitter)->Lock);
 
+    for (Index = 0; Index < TRANSMITTER_BACKLOG_COUNT; Index++) {
+        PXENNET_TRANSMITTER_BACKLOG Backlog = &(*Transmitter)->Backlog[Index];
+
+        KeInitializeSpinLock(&Backlog->Lock);
+        KeInitializeDpc(&Backlog->Dpc,
+                        TransmitterBacklogDpc,
+                        *Transmitter);
+        KeInitializeTimer(&Backlog->Timer);
+    }
+
+    InitializeSListHead(&(*Transmitter)->BufferList);
+
+    (*Transmitter)->Toeplitz = ExAllocatePoolWithTag(NonPagedPool,
+                                                     sizeof (HASH_TOEPLITZ),
+                                                     TRANSMITTER_POOL_TAG);
+
+    status = STATUS_NO_MEMORY;
+    if ((*Transmitter)->Toeplitz == NULL)
+        goto fail2;
+
+    HashToeplitzInitialize((*Transmitter)->Toeplitz,
+                           TransmitterDefaultHashKey,
+                           XENVIF_VIF_HASH_KEY_SIZE);
+    (*Transmitter)->HashTypes = TRANSMITTER_DEFAULT_HASH_TYPES;
+
+    for (Index = 0; Index < TRANSMITTER_BUFFER_MIN; Index++) {
+        PXENNET_TRANSMITTER_BUFFER  Buffer;
+
+        Buffer = __TransmitterBufferCtor(*Transmitter);
+        if (Buffer == NULL)
+            break;
+
+        (*Transmitter)->BufferCount++;
+        __TransmitterPutBuffer(*Transmitter, Buffer);
+    }
+
+    for (Index = 0; Index < HVM_MAX_VCPUS; Index++) {
+        PXENNET_TRANSMITTER_PROCESSOR   Processor = &(*Transmitter)->Processor[Index];
+        PROCESSOR_NUMBER                ProcNumber;
+
+        KeInitializeDpc(&Processor->Dpc, TransmitterDpc, *Transmitter);
+        KeInitializeDpc(&Processor->QuiesceDpc, TransmitterQuiesceDpc, *Transmitter);
+
+        status = KeGetProcessorNumberFromIndex(Index, &ProcNumber);
+        if (!NT_SUCCESS(status))
+            continue;
+
+        (VOID) KeSetTargetProcessorDpcEx(&Processor->Dpc, &ProcNumber);
+        (VOID) KeSetTargetProcessorDpcEx(&Processor->QuiesceDpc, &ProcNumber);
+    }
+
     return NDIS_STATUS_SUCCESS;
 
+fail2:
+    Error("fail2\n");
+
+    ExFreePoolWithTag(*Transmitter, TRANSMITTER_POOL_TAG);
+    *Transmitter = NULL;
+
 fail1:
     Error("fail1\n (%08x)", status);
 
@@ -80,6 +386,36 @@ TransmitterTeardown(
     IN  PXENNET_TRANSMITTER Transmitter
     )
 {
+    ULONG                   Index;
+
+    for (Index = 0; Index < TRANSMITTER_BACKLOG_COUNT; Index++)
+        (VOID) KeCancelTimer(&Transmitter->Backlog[Index].Timer);
+
+    KeFlushQueuedDpcs();
+
+    for (Index = 0; Index < TRANSMITTER_BACKLOG_COUNT; Index++)
+        ASSERT3U(Transmitter->Backlog[Index].Count, ==, 0);
+
+    for (;;) {
+        PSLIST_ENTRY                ListEntry;
+        PXENNET_TRANSMITTER_BUFFER  Buffer;
+
+        ListEntry = InterlockedPopEntrySList(&Transmitter->BufferList);
+        if (ListEntry == NULL)
+            break;
+
+        Buffer = CONTAINING_RECORD(ListEntry, XENNET_TRANSMITTER_BUFFER, ListEntry);
+        __TransmitterBufferDtor(Transmitter, Buffer);
+
+        --Transmitter->BufferCount;
+    }
+
+    ASSERT3U(Transmitter->BufferCount, ==, 0);
+
+    ExFreePoolWithTag(Transmitter->Toeplitz, TRANSMITTER_POOL_TAG);
+    Transmitter->Toeplitz = NULL;
+    Transmitter->HashTypes = 0;
+
     Transmitter->Adapter = NULL;
     Transmitter->OffloadOptions.Value = 0;
 
@@ -95,13 +431,68 @@ typedef struct _NET_BUFFER_LIST_RESERVED {
 
 C_ASSERT(sizeof (NET_BUFFER_LIST_RESERVED) <= RTL_FIELD_SIZE(NET_BUFFER_LIST, MiniportReserved));
 
+typedef struct _NET_BUFFER_RESERVED {
+    PNET_BUFFER         Next;   // Backlog link
+    PNET_BUFFER_LIST    NetBufferList;
+    ULONG               Segment;    // First segment still to be sent
+    LONG                Reference;  // NBL references held
+} NET_BUFFER_RESERVED, *PNET_BUFFER_RESERVED;
+
+C_ASSERT(sizeof (NET_BUFFER_RESERVED) <= RTL_FIELD_SIZE(NET_BUFFER, MiniportReserved));
+
+__drv_functionClass(KDEFERRED_ROUTINE)
+__drv_maxIRQL(DISPATCH_LEVEL)
+__drv_minIRQL(DISPATCH_LEVEL)
+__drv_requiresIRQL(DISPATCH_LEVEL)
+__drv_sameIRQL
+static VOID
+TransmitterDpc(
+    IN  PKDPC                       Dpc,
+    IN  PVOID                       Context,
+    IN  PVOID                       Argument1,
+    IN  PVOID                       Argument2
+    )
+{
+    PXENNET_TRANSMITTER             Transmitter = Context;
+    PXENNET_TRANSMITTER_PROCESSOR   Processor;
+    PNET_BUFFER_LIST                NetBufferList;
+    ULONG                           Count;
+
+    UNREFERENCED_PARAMETER(Argument1);
+    UNREFERENCED_PARAMETER(Argument2);
+
+    ASSERT(Transmitter != NULL);
+
+    Processor = CONTAINING_RECORD(Dpc, XENNET_TRANSMITTER_PROCESSOR, Dpc);
+    ASSERT3P(Processor, ==, &Transmitter->Processor[KeGetCurrentProcessorNumberEx(NULL)]);
+
+    NetBufferList = Processor->Head;
+    Count = Processor->Count;
+
+    Processor->Head = Processor->Tail = NULL;
+    Processor->Count = 0;
+
+    if (NetBufferList == NULL)
+        return;
+
+    Processor->Completed += Count;
+    Processor->Completions++;
+
+    NdisMSendNetBufferListsComplete(AdapterGetHandle(Transmitter->Adapter),
+                                    NetBufferList,
+                                    NDIS_SEND_COMPLETE_FLAGS_DISPATCH_LEVEL);
+}
+
 static VOID
 __TransmitterCompleteNetBufferList(
-    IN  PXENNET_TRANSMITTER     Transmitter,
-    IN  PNET_BUFFER_LIST        NetBufferList,
-    IN  NDIS_STATUS             Status
+    IN  PXENNET_TRANSMITTER         Transmitter,
+    IN  PNET_BUFFER_LIST            NetBufferList,
+    IN  NDIS_STATUS                 Status
     )
 {
+    PXENNET_TRANSMITTER_PROCESSOR   Processor;
+
+    ASSERT3U(KeGetCurrentIrql(), ==, DISPATCH_LEVEL);
     ASSERT3P(NET_BUFFER_LIST_NEXT_NBL(NetBufferList), ==, NULL);
 
     NET_BUFFER_LIST_STATUS(NetBufferList) = Status;
@@ -116,39 +507,81 @@ __TransmitterCompleteNetBufferList(
             LargeSendInfo->LsoV2TransmitComplete.Reserved = 0;
     }
 
-    NdisMSendNetBufferListsComplete(AdapterGetHandle(Transmitter->Adapter),
-                                    NetBufferList,
-                                    NDIS_SEND_COMPLETE_FLAGS_DISPATCH_LEVEL);
+    Processor = &Transmitter->Processor[KeGetCurrentProcessorNumberEx(NULL)];
+
+    if (Processor->Head == NULL) {
+        ASSERT3U(Processor->Count, ==, 0);
+        Processor->Head = Processor->Tail = NetBufferList;
+
+        (VOID) KeInsertQueueDpc(&Processor->Dpc, NULL, NULL);
+    } else {
+        NET_BUFFER_LIST_NEXT_NBL(Processor->Tail) = NetBufferList;
+        Processor->Tail = NetBufferList;
+    }
+    Processor->Count++;
 }
 
-__TransmitterGetNetBufferList(
+//
+// The reference count of an NBL is set to the number of NET_BUFFERs it
+// contains before any of them are queued, so each completion only
+// needs a single atomic decrement. Any NET_BUFFERs that cannot be
+// queued are dropped from the count in one go. The status only ever
+// changes on failure, and the store is ordered before the decrement
+// that publishes it. A NET_BUFFER that is segmented takes a reference
+// per segment instead, and keeps count of those it still holds.
+//
+static FORCEINLINE LONG
+__TransmitterPrepareNetBufferList(
     IN  PXENNET_TRANSMITTER     Transmitter,
     IN  PNET_BUFFER_LIST        NetBufferList
     )
 {
     PNET_BUFFER_LIST_RESERVED   ListReserved;
+    PNET_BUFFER                 NetBuffer;
+    LONG                        Count;
 
     UNREFERENCED_PARAMETER(Transmitter);
 
+    Count = 0;
+    for (NetBuffer = NET_BUFFER_LIST_FIRST_NB(NetBufferList);
+         NetBuffer != NULL;
+         NetBuffer = NET_BUFFER_NEXT_NB(NetBuffer)) {
+        PNET_BUFFER_RESERVED    BufferReserved;
+
+        BufferReserved = (PNET_BUFFER_RESERVED)NET_BUFFER_MINIPORT_RESERVED(NetBuffer);
+        BufferReserved->Segment = 0;
+        BufferReserved->Reference = 1;
+
+        Count++;
+    }
+
+    ASSERT(Count != 0);
+
     ListReserved = (PNET_BUFFER_LIST_RESERVED)NET_BUFFER_LIST_MINIPORT_RESERVED(NetBufferList);
 
-    if (InterlockedIncrement(&ListReserved->Reference) == 1)
-        ListReserved->Status = NDIS_STATUS_PENDING;
+    ListReserved->Reference = Count;
+    ListReserved->Status = NDIS_STATUS_SUCCESS;
+
+    return Count;
 }
 
-__TransmitterPutNetBufferList(
+static FORCEINLINE VOID
+__TransmitterReleaseNetBufferList(
     IN  PXENNET_TRANSMITTER     Transmitter,
-    IN  PNET_BUFFER_LIST        NetBufferList
+    IN  PNET_BUFFER_LIST        NetBufferList,
+    IN  LONG                    Count,
+    IN  NDIS_STATUS             Status
     )
 {
     PNET_BUFFER_LIST_RESERVED   ListReserved;
 
-    UNREFERENCED_PARAMETER(Transmitter);
-
     ListReserved = (PNET_BUFFER_LIST_RESERVED)NET_BUFFER_LIST_MINIPORT_RESERVED(NetBufferList);
 
-    ASSERT(ListReserved->Reference != 0);
-    if (InterlockedDecrement(&ListReserved->Reference) == 0)
+    if (Status != NDIS_STATUS_SUCCESS)
+        ListReserved->Status = Status;
+
+    ASSERT3S(ListReserved->Reference, >=, Count);
+    if (InterlockedAdd(&ListReserved->Reference, -Count) == 0)
         __TransmitterCompleteNetBufferList(Transmitter,
                                            NetBufferList,
                                            ListReserved->Status);
@@ -162,14 +595,10 @@ __TransmitterReturnPacket(
     )
 {
     PNET_BUFFER_LIST            NetBufferList = Cookie;
-    PNET_BUFFER_LIST_RESERVED   ListReserved;
 
     ASSERT(NetBufferList != NULL);
 
-    ListReserved = (PNET_BUFFER_LIST_RESERVED)NET_BUFFER_LIST_MINIPORT_RESERVED(NetBufferList);
-
-    (VOID) InterlockedExchange(&ListReserved->Status, Status);
-    __TransmitterPutNetBufferList(Transmitter, NetBufferList);
+    __TransmitterReleaseNetBufferList(Transmitter, NetBufferList, 1, Status);
 }
 
 static VOID
@@ -241,12 +670,188 @@ __TransmitterOffloadOptions(
     }
 }
 
+//
+// Checksum offloads never need to be refused since they can always be
+// done in software.
+//
+static FORCEINLINE BOOLEAN
+__TransmitterIsOffloadEnabled(
+    IN  PXENNET_TRANSMITTER         Transmitter,
+    IN  PXENVIF_VIF_OFFLOAD_OPTIONS OffloadOptions
+    )
+{
+    XENVIF_VIF_OFFLOAD_OPTIONS      Disabled;
+
+    Disabled.Value = OffloadOptions->Value & ~Transmitter->OffloadOptions.Value;
+
+    Disabled.OffloadIpVersion4HeaderChecksum = 0;
+    Disabled.OffloadIpVersion4TcpChecksum = 0;
+    Disabled.OffloadIpVersion4UdpChecksum = 0;
+    Disabled.OffloadIpVersion6TcpChecksum = 0;
+    Disabled.OffloadIpVersion6UdpChecksum = 0;
+
+    return (Disabled.Value == 0) ? TRUE : FALSE;
+}
+
+// Enough for an IPv6 header followed by a few extension headers
+#define TRANSMITTER_HASH_HEADER_LENGTH  128
+
+//
+// Compute the Toeplitz hash that the receive side would see for the
+// reverse direction of the flow (i.e. with source and destination
+// swapped), so that both directions of a flow are steered to the same
+// ring. As on the receive side, TCP and UDP ports are only hashed if
+// that hash type is enabled, IPv6 extension headers are skipped to find
+// them, and fragments only get an IP address hash. The result is cached
+// in the NBL.
+//
+static VOID
+__TransmitterComputeHash(
+    IN  PXENNET_TRANSMITTER         Transmitter,
+    IN  PNET_BUFFER_LIST            NetBufferList
+    )
+{
+    PNET_BUFFER                     NetBuffer;
+    UCHAR                           Storage[TRANSMITTER_HASH_HEADER_LENGTH];
+    PUCHAR                          Frame;
+    ULONG                           Length;
+    PETHERNET_UNTAGGED_HEADER       EthernetHeader;
+    PIP_HEADER                      IpHeader;
+    PUCHAR                          Ports;
+    UCHAR                           Input[2 * IPV6_ADDRESS_LENGTH + 2 * sizeof (USHORT)];
+    ULONG                           InputLength;
+    ULONG                           AddressLength;
+    ULONG                           Types;
+    ULONG                           Type;
+    PHASH_TOEPLITZ                  Toeplitz;
+
+    NetBuffer = NET_BUFFER_LIST_FIRST_NB(NetBufferList);
+
+    Length = __min(NET_BUFFER_DATA_LENGTH(NetBuffer),
+                   TRANSMITTER_HASH_HEADER_LENGTH);
+    if (Length < sizeof (ETHERNET_UNTAGGED_HEADER) + sizeof (IPV4_HEADER))
+        return;
+
+    Frame = NdisGetDataBuffer(NetBuffer, Length, Storage, 1, 0);
+    if (Frame == NULL)
+        return;
+
+    EthernetHeader = (PETHERNET_UNTAGGED_HEADER)Frame;
+    IpHeader = (PIP_HEADER)(Frame + sizeof (ETHERNET_UNTAGGED_HEADER));
+    Length -= sizeof (ETHERNET_UNTAGGED_HEADER);
+
+    Types = Transmitter->HashTypes;
+    Ports = NULL;
+
+    switch (NTOHS(EthernetHeader->TypeOrLength)) {
+    case ETHERTYPE_IPV4: {
+        PIPV4_HEADER    Version4 = &IpHeader->Version4;
+        ULONG           HeaderLength;
+
+        HeaderLength = IPV4_HEADER_LENGTH(Version4);
+        if (Version4->Version != 4 ||
+            HeaderLength < sizeof (IPV4_HEADER) ||
+            HeaderLength > Length)
+            return;
+
+        AddressLength = IPV4_ADDRESS_LENGTH;
+        RtlCopyMemory(&Input[0], &Version4->DestinationAddress, AddressLength);
+        RtlCopyMemory(&Input[AddressLength], &Version4->SourceAddress, AddressLength);
+
+        Type = NDIS_HASH_IPV4;
+        if (!IPV4_IS_A_FRAGMENT(NTOHS(Version4->FragmentOffsetAndFlags)) &&
+            HeaderLength + 2 * sizeof (USHORT) <= Length) {
+            if (Version4->Protocol == IPPROTO_TCP)
+                Type = NDIS_HASH_TCP_IPV4;
+            else if (Version4->Protocol == IPPROTO_UDP)
+                Type = NDIS_HASH_UDP_IPV4;
+        }
+
+        // Fall back to an IP address hash if the 4-tuple is not wanted
+        if (Type != NDIS_HASH_IPV4 && (Types & Type))
+            Ports = (PUCHAR)Version4 + HeaderLength;
+        else
+            Type = NDIS_HASH_IPV4;
+        break;
+    }
+    case ETHERTYPE_IPV6: {
+        PIPV6_HEADER    Version6 = &IpHeader->Version6;
+        ULONG           Offset;
+        UCHAR           Protocol;
+
+        if (Length < sizeof (IPV6_HEADER) ||
+            Version6->Version != 6)
+            return;
+
+        AddressLength = IPV6_ADDRESS_LENGTH;
+        RtlCopyMemory(&Input[0], &Version6->DestinationAddress, AddressLength);
+        RtlCopyMemory(&Input[AddressLength], &Version6->SourceAddress, AddressLength);
+
+        Protocol = Version6->NextHeader;
+        Offset = sizeof (IPV6_HEADER);
+
+        // Anything we cannot see past only gets an IP address hash
+        while (Protocol == IPPROTO_HOP_OPTIONS ||
+               Protocol == IPPROTO_DST_OPTIONS ||
+               Protocol == IPPROTO_ROUTING) {
+            PIPV6_OPTION_HEADER Option = (PIPV6_OPTION_HEADER)((PUCHAR)Version6 + Offset);
+
+            if (Offset + sizeof (IPV6_OPTION_HEADER) > Length)
+                break;
+
+            // The length is in 8 octet units, not counting the first 8
+            Protocol = Option->NextHeader;
+            Offset += ((ULONG)Option->PayloadLength + 1) * 8;
+        }
+
+        Type = NDIS_HASH_IPV6;
+        if (Offset + 2 * sizeof (USHORT) <= Length) {
+            if (Protocol == IPPROTO_TCP)
+                Type = NDIS_HASH_TCP_IPV6;
+            else if (Protocol == IPPROTO_UDP)
+                Type = NDIS_HASH_UDP_IPV6;
+        }
+
+        if (Type != NDIS_HASH_IPV6 && (Types & Type))
+            Ports = (PUCHAR)Version6 + Offset;
+        else
+            Type = NDIS_HASH_IPV6;
+        break;
+    }
+    default:
+        return;
+    }
+
+    InputLength = 2 * AddressLength;
+
+    if (Ports != NULL) {
+        // Destination port then source port
+        RtlCopyMemory(&Input[InputLength], Ports + sizeof (USHORT), sizeof (USHORT));
+        RtlCopyMemory(&Input[InputLength + sizeof (USHORT)], Ports, sizeof (USHORT));
+        InputLength += 2 * sizeof (USHORT);
+    }
+
+    // The table may be swapped by TransmitterSetHashKey() at any time
+    Toeplitz = Transmitter->Toeplitz;
+
+    NET_BUFFER_LIST_SET_HASH_VALUE(NetBufferList,
+                                   HashToeplitz(Toeplitz,
+                                                Input,
+                                                InputLength));
+    NET_BUFFER_LIST_SET_HASH_TYPE(NetBufferList, Type);
+    NET_BUFFER_LIST_SET_HASH_FUNCTION(NetBufferList, NdisHashFunctionToeplitz);
+}
+
 static VOID
 __TransmitterHash(
+    IN  PXENNET_TRANSMITTER     Transmitter,
     IN  PNET_BUFFER_LIST        NetBufferList,
     OUT PXENVIF_PACKET_HASH     Hash
     )
 {
+    if (NET_BUFFER_LIST_GET_HASH_FUNCTION(NetBufferList) == 0)
+        __TransmitterComputeHash(Transmitter, NetBufferList);
+
     switch (NET_BUFFER_LIST_GET_HASH_FUNCTION(NetBufferList)) {
     case NdisHashFunctionToeplitz:
         Hash->Algorithm = XENVIF_PACKET_HASH_ALGORITHM_TOEPLITZ;
@@ -274,135 +879,1547 @@ __TransmitterHash(
         Hash->Type = XENVIF_PACKET_HASH_TYPE_IPV6_TCP;
         break;
 
+    // XENVIF has no UDP hash types; only the value selects the ring
+    case NDIS_HASH_UDP_IPV4:
+        Hash->Type = XENVIF_PACKET_HASH_TYPE_IPV4;
+        break;
+
+    case NDIS_HASH_UDP_IPV6:
+        Hash->Type = XENVIF_PACKET_HASH_TYPE_IPV6;
+        break;
+
     default:
+        Hash->Type = XENVIF_PACKET_HASH_TYPE_NONE;
         break;
     }
 
     Hash->Value = NET_BUFFER_LIST_GET_HASH_VALUE(NetBufferList);
 }
 
-static VOID
-__TransmitterSendNetBufferList(
+static FORCEINLINE BOOLEAN
+__TransmitterIsSameRing(
+    IN  PXENVIF_PACKET_HASH     Hash,
+    IN  PXENVIF_PACKET_HASH     Next
+    )
+{
+    // XENVIF selects the ring from the hash
+    return (Hash->Algorithm == Next->Algorithm &&
+            Hash->Value == Next->Value) ? TRUE : FALSE;
+}
+
+static FORCEINLINE PXENNET_TRANSMITTER_BACKLOG
+__TransmitterGetBacklog(
     IN  PXENNET_TRANSMITTER     Transmitter,
-    IN  PNET_BUFFER_LIST        NetBufferList
+    IN  PXENVIF_PACKET_HASH     Hash
     )
 {
-    PNET_BUFFER_LIST_RESERVED   ListReserved;
-    PNET_BUFFER                 NetBuffer;
-    XENVIF_VIF_OFFLOAD_OPTIONS  OffloadOptions;
-    USHORT                      TagControlInformation;
-    USHORT                      MaximumSegmentSize;
-    XENVIF_PACKET_HASH          Hash;
+    ULONG                       Index;
 
-    ListReserved = (PNET_BUFFER_LIST_RESERVED)NET_BUFFER_LIST_MINIPORT_RESERVED(NetBufferList);
-    RtlZeroMemory(ListReserved, sizeof (NET_BUFFER_LIST_RESERVED));
+    // Packets that __TransmitterIsSameRing() pairs must share a backlog
+    Index = (Hash->Algorithm != XENVIF_PACKET_HASH_ALGORITHM_NONE) ?
+            Hash->Value % TRANSMITTER_BACKLOG_COUNT :
+            0;
 
-    __TransmitterOffloadOptions(NetBufferList,
-                                &OffloadOptions,
-                                &TagControlInformation,
-                                &MaximumSegmentSize);
+    return &Transmitter->Backlog[Index];
+}
 
-    if (OffloadOptions.Value & ~Transmitter->OffloadOptions.Value) {
-        NET_BUFFER_LIST_STATUS(NetBufferList) = NDIS_STATUS_FAILURE;
+static PXENNET_TRANSMITTER_BUFFER
+__TransmitterLinearize(
+    IN  PXENNET_TRANSMITTER     Transmitter,
+    IN  PMDL                    Mdl,
+    IN  ULONG                   Offset,
+    IN  ULONG                   Length
+    )
+{
+    PXENNET_TRANSMITTER_BUFFER  Buffer;
+    ULONG                       Fragments;
+    PUCHAR                      Data;
 
-        NdisMSendNetBufferListsComplete(AdapterGetHandle(Transmitter->Adapter),
-                                        NetBufferList,
-                                        NDIS_SEND_COMPLETE_FLAGS_DISPATCH_LEVEL);
-        return;
+    if (Length > TRANSMITTER_BUFFER_SIZE)
+        goto done;
+
+    Fragments = 0;
+    if (Transmitter->MaximumFragments != 0) {
+        PMDL    Next = Mdl;
+        ULONG   Remaining = Offset + Length;
+
+        while (Remaining != 0) {
+            ASSERT(Next != NULL);
+
+            // There is no need to count beyond the threshold
+            if (++Fragments > Transmitter->MaximumFragments)
+                break;
+
+            if (Remaining <= Next->ByteCount)
+                break;
+
+            Remaining -= Next->ByteCount;
+            Next = Next->Next;
+        }
     }
 
-    __TransmitterHash(NetBufferList, &Hash);
+    if (Length > Transmitter->CopyBreak &&
+        Fragments <= Transmitter->MaximumFragments)
+        goto done;
 
-    __TransmitterGetNetBufferList(Transmitter, NetBufferList);
+    Buffer = __TransmitterGetBuffer(Transmitter);
+    if (Buffer == NULL)
+        goto done;
 
-    NetBuffer = NET_BUFFER_LIST_FIRST_NB(NetBufferList);
-    while (NetBuffer != NULL) {
-        PNET_BUFFER         NetBufferListNext = NET_BUFFER_NEXT_NB(NetBuffer);
-        PVOID               Cookie = NetBufferList;
-        NTSTATUS            status;
+    Data = Buffer->Data;
 
-        __TransmitterGetNetBufferList(Transmitter, NetBufferList);
+    while (Length != 0) {
+        PUCHAR  MdlMappedSystemVa;
+        ULONG   Count;
 
-        status = XENVIF_VIF(TransmitterQueuePacket,
-                            AdapterGetVifInterface(Transmitter->Adapter),
-                            NET_BUFFER_CURRENT_MDL(NetBuffer),
-                            NET_BUFFER_CURRENT_MDL_OFFSET(NetBuffer),
-                            NET_BUFFER_DATA_LENGTH(NetBuffer),
-                            OffloadOptions,
-                            MaximumSegmentSize,
-                            TagControlInformation,
-                            &Hash,
-                            (NetBufferListNext != NULL) ? TRUE : FALSE,
-                            Cookie);
-        if (!NT_SUCCESS(status)) {
-            __TransmitterReturnPacket(Transmitter, Cookie,
-                                      NDIS_STATUS_NOT_ACCEPTED);
-            break;
+        ASSERT(Mdl != NULL);
+
+        if (Offset >= Mdl->ByteCount) {
+            Offset -= Mdl->ByteCount;
+            Mdl = Mdl->Next;
+            continue;
         }
 
-        NetBuffer = NetBufferListNext;
+        MdlMappedSystemVa = MmGetSystemAddressForMdlSafe(Mdl, NormalPagePriority);
+        if (MdlMappedSystemVa == NULL)
+            goto fail1;
+
+        Count = __min(Mdl->ByteCount - Offset, Length);
+
+        RtlCopyMemory(Data, MdlMappedSystemVa + Offset, Count);
+        Data += Count;
+        Length -= Count;
+
+        Offset = 0;
+        Mdl = Mdl->Next;
     }
 
-    __TransmitterPutNetBufferList(Transmitter, NetBufferList);
-}
+    return Buffer;
 
-#pragma warning(push)
-#pragma warning(disable:28167) // changes IRQL
+fail1:
+    __TransmitterPutBuffer(Transmitter, Buffer);
 
-VOID
-TransmitterSendNetBufferLists(
+done:
+    return NULL;
+}
+
+static PXENNET_TRANSMITTER_BUFFER
+__TransmitterCopyHeaders(
     IN  PXENNET_TRANSMITTER     Transmitter,
-    IN  PNET_BUFFER_LIST        NetBufferList,
-    IN  NDIS_PORT_NUMBER        PortNumber,
-    IN  ULONG                   SendFlags
+    IN  PMDL                    Mdl,
+    IN  ULONG                   Offset,
+    IN  ULONG                   Length
     )
 {
-    LIST_ENTRY                  List;
-    KIRQL                       Irql = PASSIVE_LEVEL;
+    PXENNET_TRANSMITTER_BUFFER  Buffer;
+    ULONG                       Copied;
 
-    UNREFERENCED_PARAMETER(PortNumber);
+    Buffer = __TransmitterGetBuffer(Transmitter);
+    if (Buffer == NULL)
+        goto fail1;
 
-    InitializeListHead(&List);
+    Copied = 0;
+    while (Copied < Length &&
+           Copied < TRANSMITTER_CHECKSUM_HEADER_LENGTH) {
+        PUCHAR  MdlMappedSystemVa;
+        ULONG   Count;
 
-    if (!NDIS_TEST_SEND_AT_DISPATCH_LEVEL(SendFlags)) {
-        ASSERT3U(NDIS_CURRENT_IRQL(), <=, DISPATCH_LEVEL);
-        KeRaiseIrql(DISPATCH_LEVEL, &Irql);
-    }
+        ASSERT(Mdl != NULL);
 
-    while (NetBufferList != NULL) {
-        PNET_BUFFER_LIST            ListNext;
+        if (Offset >= Mdl->ByteCount) {
+            Offset -= Mdl->ByteCount;
+            Mdl = Mdl->Next;
+            continue;
+        }
 
-        ListNext = NET_BUFFER_LIST_NEXT_NBL(NetBufferList);
-        NET_BUFFER_LIST_NEXT_NBL(NetBufferList) = NULL;
+        // Only copy the headers out of an MDL that will not fit
+        Count = __min(Mdl->ByteCount - Offset, Length - Copied);
+        if (Copied + Count > TRANSMITTER_BUFFER_SIZE)
+            Count = TRANSMITTER_CHECKSUM_HEADER_LENGTH - Copied;
 
-        __TransmitterSendNetBufferList(Transmitter, NetBufferList);
+        MdlMappedSystemVa = MmGetSystemAddressForMdlSafe(Mdl, NormalPagePriority);
+        if (MdlMappedSystemVa == NULL)
+            goto fail2;
 
-        NetBufferList = ListNext;
+        RtlCopyMemory(Buffer->Data + Copied, MdlMappedSystemVa + Offset, Count);
+        Copied += Count;
+        Offset += Count;
     }
 
-    if (!NDIS_TEST_SEND_AT_DISPATCH_LEVEL(SendFlags))
-        KeLowerIrql(Irql);
-}
+    if (Copied < Length) {
+        while (Offset >= Mdl->ByteCount) {
+            Offset -= Mdl->ByteCount;
+            Mdl = Mdl->Next;
+            ASSERT(Mdl != NULL);
+        }
 
-#pragma warning(pop)
+        if (Offset != 0) {
+            PUCHAR  VirtualAddress;
+            ULONG   Remaining;
 
-VOID
-TransmitterReturnPacket(
-    IN  PXENNET_TRANSMITTER                         Transmitter,
-    IN  PVOID                                       Cookie,
-    IN  PXENVIF_TRANSMITTER_PACKET_COMPLETION_INFO  Completion
-    )
-{
-    NDIS_STATUS                                     Status;
+            VirtualAddress = (PUCHAR)MmGetMdlVirtualAddress(Mdl) + Offset;
+            Remaining = Mdl->ByteCount - Offset;
 
-    UNREFERENCED_PARAMETER(Completion);
+            Buffer->Partial = IoAllocateMdl(VirtualAddress,
+                                            Remaining,
+                                            FALSE,
+                                            FALSE,
+                                            NULL);
+            if (Buffer->Partial == NULL)
+                goto fail3;
 
-    Status = (Completion->Status == XENVIF_TRANSMITTER_PACKET_OK) ?
-             NDIS_STATUS_SUCCESS :
-             NDIS_STATUS_NOT_ACCEPTED;
+            IoBuildPartialMdl(Mdl, Buffer->Partial, VirtualAddress, Remaining);
+            Buffer->Partial->Next = Mdl->Next;
 
-    __TransmitterReturnPacket(Transmitter, Cookie, Status);
-}
+            Mdl = Buffer->Partial;
+        }
+
+        NdisAdjustMdlLength(Buffer->Mdl, Copied);
+        Buffer->Mdl->Next = Mdl;
+    }
+
+    return Buffer;
+
+fail3:
+fail2:
+    __TransmitterPutBuffer(Transmitter, Buffer);
+
+fail1:
+    return NULL;
+}
+
+//
+// Fill in the checksums requested in OffloadOptions in the packet held
+// in (or, for large packets, headed by) Buffer. Returns FALSE if the
+// headers cannot be parsed.
+//
+static BOOLEAN
+__TransmitterCalculateChecksums(
+    IN  PXENNET_TRANSMITTER_BUFFER  Buffer,
+    IN  ULONG                       Length,
+    IN  XENVIF_VIF_OFFLOAD_OPTIONS  OffloadOptions
+    )
+{
+    PUCHAR                          Data = Buffer->Data;
+    ULONG                           Available;
+    PETHERNET_HEADER                EthernetHeader;
+    ULONG                           Offset;
+    USHORT                          TypeOrLength;
+    UCHAR                           Protocol;
+    ULONG                           PayloadLength;
+    ULONG                           Sum;
+    PUSHORT                         Checksum;
+
+    Available = __min(Length, MmGetMdlByteCount(Buffer->Mdl));
+
+    EthernetHeader = (PETHERNET_HEADER)Data;
+    if (Available < sizeof (ETHERNET_TAGGED_HEADER))
+        return FALSE;
+
+    if (ETHERNET_HEADER_IS_TAGGED(EthernetHeader)) {
+        Offset = sizeof (ETHERNET_TAGGED_HEADER);
+        TypeOrLength = EthernetHeader->Tagged.TypeOrLength;
+    } else {
+        Offset = sizeof (ETHERNET_UNTAGGED_HEADER);
+        TypeOrLength = EthernetHeader->Untagged.TypeOrLength;
+    }
+
+    switch (NTOHS(TypeOrLength)) {
+    case ETHERTYPE_IPV4: {
+        PIPV4_HEADER    Version4 = (PIPV4_HEADER)(Data + Offset);
+        ULONG           HeaderLength;
+
+        if (Offset + sizeof (IPV4_HEADER) > Available ||
+            Version4->Version != 4)
+            return FALSE;
+
+        HeaderLength = IPV4_HEADER_LENGTH(Version4);
+        if (HeaderLength < sizeof (IPV4_HEADER) ||
+            Offset + HeaderLength > Available ||
+            NTOHS(Version4->PacketLength) < HeaderLength ||
+            Offset + NTOHS(Version4->PacketLength) > Length)
+            return FALSE;
+
+        if (OffloadOptions.OffloadIpVersion4HeaderChecksum) {
+            Version4->Checksum = 0;
+            Version4->Checksum = (USHORT)~ChecksumAccumulate(Version4,
+                                                             HeaderLength,
+                                                             0);
+        }
+
+        if (!OffloadOptions.OffloadIpVersion4TcpChecksum &&
+            !OffloadOptions.OffloadIpVersion4UdpChecksum)
+            return TRUE;
+
+        // Only a whole datagram can be checksummed
+        if (IPV4_IS_A_FRAGMENT(NTOHS(Version4->FragmentOffsetAndFlags)))
+            return FALSE;
+
+        Protocol = Version4->Protocol;
+        PayloadLength = NTOHS(Version4->PacketLength) - HeaderLength;
+
+        Sum = ChecksumPseudoHeader(&Version4->SourceAddress,
+                                   &Version4->DestinationAddress,
+                                   IPV4_ADDRESS_LENGTH,
+                                   Protocol,
+                                   PayloadLength);
+
+        Offset += HeaderLength;
+        break;
+    }
+    case ETHERTYPE_IPV6: {
+        PIPV6_HEADER    Version6 = (PIPV6_HEADER)(Data + Offset);
+        ULONG           ExtensionLength;
+
+        if (Offset + sizeof (IPV6_HEADER) > Available ||
+            Version6->Version != 6 ||
+            Offset + sizeof (IPV6_HEADER) + NTOHS(Version6->PayloadLength) > Length)
+            return FALSE;
+
+        Protocol = Version6->NextHeader;
+        ExtensionLength = 0;
+        Offset += sizeof (IPV6_HEADER);
+
+        while (Protocol == IPPROTO_HOP_OPTIONS ||
+               Protocol == IPPROTO_DST_OPTIONS ||
+               Protocol == IPPROTO_ROUTING) {
+            PIPV6_OPTION_HEADER Option = (PIPV6_OPTION_HEADER)(Data + Offset);
+            ULONG               OptionLength;
+
+            if (Offset + sizeof (IPV6_OPTION_HEADER) > Available)
+                return FALSE;
+
+            // The length is in 8 octet units, not counting the first 8
+            OptionLength = ((ULONG)Option->PayloadLength + 1) * 8;
+
+            Protocol = Option->NextHeader;
+            ExtensionLength += OptionLength;
+            Offset += OptionLength;
+        }
+
+        if (ExtensionLength > NTOHS(Version6->PayloadLength))
+            return FALSE;
+
+        PayloadLength = NTOHS(Version6->PayloadLength) - ExtensionLength;
+
+        Sum = ChecksumPseudoHeader(&Version6->SourceAddress,
+                                   &Version6->DestinationAddress,
+                                   IPV6_ADDRESS_LENGTH,
+                                   Protocol,
+                                   PayloadLength);
+        break;
+    }
+    default:
+        return FALSE;
+    }
+
+    switch (Protocol) {
+    case IPPROTO_TCP: {
+        PTCP_HEADER TcpHeader = (PTCP_HEADER)(Data + Offset);
+
+        if (!OffloadOptions.OffloadIpVersion4TcpChecksum &&
+            !OffloadOptions.OffloadIpVersion6TcpChecksum)
+            return TRUE;
+
+        if (Offset + sizeof (TCP_HEADER) > Available ||
+            PayloadLength < sizeof (TCP_HEADER))
+            return FALSE;
+
+        Checksum = &TcpHeader->Checksum;
+        break;
+    }
+    case IPPROTO_UDP: {
+        PUDP_HEADER UdpHeader = (PUDP_HEADER)(Data + Offset);
+
+        if (!OffloadOptions.OffloadIpVersion4UdpChecksum &&
+            !OffloadOptions.OffloadIpVersion6UdpChecksum)
+            return TRUE;
+
+        if (Offset + sizeof (UDP_HEADER) > Available ||
+            PayloadLength < sizeof (UDP_HEADER))
+            return FALSE;
+
+        Checksum = &UdpHeader->Checksum;
+        break;
+    }
+    default:
+        return FALSE;
+    }
+
+    *Checksum = 0;
+
+    if (!ChecksumAccumulateMdl(Buffer->Mdl, Offset, PayloadLength, &Sum))
+        return FALSE;
+
+    *Checksum = (USHORT)~Sum;
+
+    // A UDP checksum of zero means that there is no checksum
+    if (Protocol == IPPROTO_UDP && *Checksum == 0)
+        *Checksum = 0xFFFF;
+
+    return TRUE;
+}
+
+static BOOLEAN
+__TransmitterCopyFromMdl(
+    IN      PUCHAR  Destination,
+    IN OUT  PMDL    *Mdl,
+    IN OUT  PULONG  Offset,
+    IN      ULONG   Length
+    )
+{
+    while (Length != 0) {
+        PUCHAR  MdlMappedSystemVa;
+        ULONG   Count;
+
+        if (*Mdl == NULL)
+            return FALSE;
+
+        if (*Offset >= (*Mdl)->ByteCount) {
+            *Offset -= (*Mdl)->ByteCount;
+            *Mdl = (*Mdl)->Next;
+            continue;
+        }
+
+        MdlMappedSystemVa = MmGetSystemAddressForMdlSafe(*Mdl, NormalPagePriority);
+        if (MdlMappedSystemVa == NULL)
+            return FALSE;
+
+        Count = __min((*Mdl)->ByteCount - *Offset, Length);
+
+        RtlCopyMemory(Destination, MdlMappedSystemVa + *Offset, Count);
+        Destination += Count;
+        Length -= Count;
+
+        *Offset += Count;
+    }
+
+    return TRUE;
+}
+
+static FORCEINLINE BOOLEAN
+__TransmitterIsSegmentationNeeded(
+    IN  PXENNET_TRANSMITTER         Transmitter,
+    IN  PXENVIF_VIF_OFFLOAD_OPTIONS OffloadOptions,
+    IN  ULONG                       Length
+    )
+{
+    // A size of zero means that the backend cannot segment at all
+    if (OffloadOptions->OffloadIpVersion4LargePacket)
+        return (Length > Transmitter->BackendLargePacketSize[0]) ? TRUE : FALSE;
+
+    if (OffloadOptions->OffloadIpVersion6LargePacket)
+        return (Length > Transmitter->BackendLargePacketSize[1]) ? TRUE : FALSE;
+
+    return FALSE;
+}
+
+//
+// Build one segment of a large packet in a transmitter buffer, with
+// its IP length (and ID), TCP sequence number and flags fixed up and
+// its checksums calculated. The payload is copied from the given MDL
+// cursor, which is left at the start of the next segment.
+//
+static BOOLEAN
+__TransmitterBuildSegment(
+    IN      PXENNET_TRANSMITTER_BUFFER  Buffer,
+    IN      PUCHAR                      Header,
+    IN      ULONG                       HeaderLength,
+    IN      ULONG                       IpHeaderOffset,
+    IN      ULONG                       TcpHeaderOffset,
+    IN      BOOLEAN                     IpVersion4,
+    IN      ULONG                       PayloadLength,
+    IN      USHORT                      MaximumSegmentSize,
+    IN      LONG                        Index,
+    IN      LONG                        Segments,
+    IN OUT  PMDL                        *Mdl,
+    IN OUT  PULONG                      Offset,
+    OUT     PULONG                      Length
+    )
+{
+    PIP_HEADER                          IpHeader;
+    PTCP_HEADER                         TcpHeader;
+    ULONG                               TcpHeaderLength;
+    ULONG                               SegmentLength;
+    PUCHAR                              Data;
+    PIP_HEADER                          SegmentIpHeader;
+    PTCP_HEADER                         SegmentTcpHeader;
+    ULONG                               Sum;
+
+    IpHeader = (PIP_HEADER)(Header + IpHeaderOffset);
+    TcpHeader = (PTCP_HEADER)(Header + TcpHeaderOffset);
+    TcpHeaderLength = HeaderLength - TcpHeaderOffset;
+
+    SegmentLength = __min(PayloadLength - (Index * MaximumSegmentSize),
+                          MaximumSegmentSize);
+
+    Data = Buffer->Data;
+    RtlCopyMemory(Data, Header, HeaderLength);
+
+    if (!__TransmitterCopyFromMdl(Data + HeaderLength,
+                                  Mdl,
+                                  Offset,
+                                  SegmentLength))
+        return FALSE;
+
+    SegmentIpHeader = (PIP_HEADER)(Data + IpHeaderOffset);
+    SegmentTcpHeader = (PTCP_HEADER)(Data + TcpHeaderOffset);
+
+    if (IpVersion4) {
+        PIPV4_HEADER    Version4 = &SegmentIpHeader->Version4;
+
+        Version4->PacketLength = HTONS((USHORT)(HeaderLength - IpHeaderOffset + SegmentLength));
+        Version4->PacketID = HTONS((USHORT)(NTOHS(IpHeader->Version4.PacketID) + Index));
+
+        Version4->Checksum = 0;
+        Version4->Checksum = (USHORT)~ChecksumAccumulate(Version4,
+                                                         TcpHeaderOffset - IpHeaderOffset,
+                                                         0);
+
+        Sum = ChecksumPseudoHeader(&Version4->SourceAddress,
+                                   &Version4->DestinationAddress,
+                                   IPV4_ADDRESS_LENGTH,
+                                   IPPROTO_TCP,
+                                   TcpHeaderLength + SegmentLength);
+    } else {
+        PIPV6_HEADER    Version6 = &SegmentIpHeader->Version6;
+
+        Version6->PayloadLength = HTONS((USHORT)(HeaderLength - IpHeaderOffset -
+                                                 sizeof (IPV6_HEADER) + SegmentLength));
+
+        Sum = ChecksumPseudoHeader(&Version6->SourceAddress,
+                                   &Version6->DestinationAddress,
+                                   IPV6_ADDRESS_LENGTH,
+                                   IPPROTO_TCP,
+                                   TcpHeaderLength + SegmentLength);
+    }
+
+    SegmentTcpHeader->Seq = HTONL(NTOHL(TcpHeader->Seq) + (Index * MaximumSegmentSize));
+
+    // FIN and PSH only belong on the last segment, CWR on the first
+    if (Index != Segments - 1)
+        SegmentTcpHeader->Flags &= ~(TCP_FIN | TCP_PSH);
+    if (Index != 0)
+        SegmentTcpHeader->Flags &= ~TCP_CWR;
+
+    SegmentTcpHeader->Checksum = 0;
+    SegmentTcpHeader->Checksum = (USHORT)~ChecksumAccumulate(SegmentTcpHeader,
+                                                             TcpHeaderLength + SegmentLength,
+                                                             Sum);
+
+    *Length = HeaderLength + SegmentLength;
+    return TRUE;
+}
+
+//
+// Segment a large packet, queueing each segment in turn. All the
+// buffers are taken up front so that, if there are not enough, the
+// packet can be backlogged as a whole. The NET_BUFFER holds one NBL
+// reference for each segment still to be sent.
+//
+// Every segment but the last is queued with More == TRUE, so if a
+// later one fails the earlier ones sit on the ring unpushed. The index
+// of the first unsent segment is then recorded in the NET_BUFFER and
+// STATUS_MORE_PROCESSING_REQUIRED returned, so that the caller keeps
+// the batch open and backlogs the NET_BUFFER. The rest of it is sent
+// from there when it is retried, and its last segment closes the
+// batch.
+//
+static NTSTATUS
+__TransmitterSegmentNetBuffer(
+    IN  PXENNET_TRANSMITTER         Transmitter,
+    IN  PNET_BUFFER_LIST            NetBufferList,
+    IN  PNET_BUFFER                 NetBuffer,
+    IN  PMDL                        Mdl,
+    IN  ULONG                       Offset,
+    IN  ULONG                       Length,
+    IN  XENVIF_VIF_OFFLOAD_OPTIONS  OffloadOptions,
+    IN  USHORT                      MaximumSegmentSize,
+    IN  USHORT                      TagControlInformation,
+    IN  PXENVIF_PACKET_HASH         Hash,
+    IN  BOOLEAN                     More
+    )
+{
+    PNDIS_TCP_LARGE_SEND_OFFLOAD_NET_BUFFER_LIST_INFO   LargeSendInfo;
+    PNET_BUFFER_LIST_RESERVED       ListReserved;
+    PNET_BUFFER_RESERVED            BufferReserved;
+    PXENNET_TRANSMITTER_PROCESSOR   Processor;
+    UCHAR                           Header[TRANSMITTER_SEGMENT_HEADER_LENGTH];
+    PMDL                            HeaderMdl;
+    ULONG                           HeaderOffset;
+    ULONG                           IpHeaderOffset;
+    ULONG                           TcpHeaderOffset;
+    ULONG                           TcpHeaderLength;
+    ULONG                           HeaderLength;
+    PTCP_HEADER                     TcpHeader;
+    BOOLEAN                         IpVersion4;
+    ULONG                           PayloadLength;
+    PMDL                            PayloadMdl;
+    ULONG                           PayloadOffset;
+    LONG                            Segments;
+    LONG                            Start;
+    LONG                            Reference;
+    LONG                            Index;
+    PXENNET_TRANSMITTER_BUFFER      Head;
+    PXENNET_TRANSMITTER_BUFFER      Buffer;
+    ULONG                           SegmentLength;
+    NTSTATUS                        status;
+
+    LargeSendInfo = (PNDIS_TCP_LARGE_SEND_OFFLOAD_NET_BUFFER_LIST_INFO)&NET_BUFFER_LIST_INFO(NetBufferList,
+                                                                                                TcpLargeSendNetBufferListInfo);
+    ListReserved = (PNET_BUFFER_LIST_RESERVED)NET_BUFFER_LIST_MINIPORT_RESERVED(NetBufferList);
+    BufferReserved = (PNET_BUFFER_RESERVED)NET_BUFFER_MINIPORT_RESERVED(NetBuffer);
+
+    IpVersion4 = (LargeSendInfo->LsoV2Transmit.IPVersion == NDIS_TCP_LARGE_SEND_OFFLOAD_IPv4) ?
+                 TRUE :
+                 FALSE;
+
+    TcpHeaderOffset = LargeSendInfo->LsoV2Transmit.TcpHeaderOffset;
+    if (TcpHeaderOffset + MAXIMUM_TCP_HEADER_LENGTH > sizeof (Header) ||
+        TcpHeaderOffset + sizeof (TCP_HEADER) > Length)
+        goto fail1;
+
+    HeaderMdl = Mdl;
+    HeaderOffset = Offset;
+    if (!__TransmitterCopyFromMdl(Header,
+                                  &HeaderMdl,
+                                  &HeaderOffset,
+                                  __min(Length, TcpHeaderOffset + MAXIMUM_TCP_HEADER_LENGTH)))
+        goto fail2;
+
+    IpHeaderOffset = ETHERNET_HEADER_IS_TAGGED((PETHERNET_HEADER)Header) ?
+                     sizeof (ETHERNET_TAGGED_HEADER) :
+                     sizeof (ETHERNET_UNTAGGED_HEADER);
+    if (IpHeaderOffset + ((IpVersion4) ? sizeof (IPV4_HEADER) : sizeof (IPV6_HEADER)) > TcpHeaderOffset)
+        goto fail3;
+
+    TcpHeader = (PTCP_HEADER)(Header + TcpHeaderOffset);
+
+    TcpHeaderLength = TCP_HEADER_LENGTH(TcpHeader);
+    HeaderLength = TcpHeaderOffset + TcpHeaderLength;
+    if (TcpHeaderLength < sizeof (TCP_HEADER) ||
+        HeaderLength >= Length ||
+        HeaderLength + MaximumSegmentSize > TRANSMITTER_BUFFER_SIZE)
+        goto fail4;
+
+    PayloadLength = Length - HeaderLength;
+    Segments = (LONG)((PayloadLength + MaximumSegmentSize - 1) / MaximumSegmentSize);
+
+    // A NET_BUFFER taken from the backlog may already be partly sent
+    Start = (LONG)BufferReserved->Segment;
+    Reference = BufferReserved->Reference;
+    ASSERT3S(Start, <, Segments);
+
+    Head = NULL;
+    for (Index = Start; Index < Segments; Index++) {
+        Buffer = __TransmitterGetBuffer(Transmitter);
+        if (Buffer == NULL)
+            goto fail5;
+
+        Buffer->ListEntry.Next = (Head != NULL) ? &Head->ListEntry : NULL;
+        Head = Buffer;
+    }
+
+    // Segments are no longer large, and all their checksums are done here
+    OffloadOptions.OffloadIpVersion4LargePacket = 0;
+    OffloadOptions.OffloadIpVersion6LargePacket = 0;
+    OffloadOptions.OffloadIpVersion4HeaderChecksum = 0;
+    OffloadOptions.OffloadIpVersion4TcpChecksum = 0;
+    OffloadOptions.OffloadIpVersion6TcpChecksum = 0;
+
+    (VOID) InterlockedAdd(&ListReserved->Reference, (Segments - Start) - Reference);
+
+    Processor = &Transmitter->Processor[KeGetCurrentProcessorNumberEx(NULL)];
+    if (Start == 0)
+        Processor->Segmented++;
+
+    // The payload follows straight on from the headers
+    PayloadMdl = Mdl;
+    PayloadOffset = Offset + HeaderLength + (Start * MaximumSegmentSize);
+
+    for (Index = Start; Index < Segments; Index++) {
+        Buffer = Head;
+        Head = (Buffer->ListEntry.Next != NULL) ?
+               CONTAINING_RECORD(Buffer->ListEntry.Next, XENNET_TRANSMITTER_BUFFER, ListEntry) :
+               NULL;
+        Buffer->ListEntry.Next = NULL;
+
+        status = STATUS_UNSUCCESSFUL;
+        if (!__TransmitterBuildSegment(Buffer,
+                                       Header,
+                                       HeaderLength,
+                                       IpHeaderOffset,
+                                       TcpHeaderOffset,
+                                       IpVersion4,
+                                       PayloadLength,
+                                       MaximumSegmentSize,
+                                       Index,
+                                       Segments,
+                                       &PayloadMdl,
+                                       &PayloadOffset,
+                                       &SegmentLength))
+            goto fail6;
+
+        Buffer->NetBufferList = NetBufferList;
+
+        status = XENVIF_VIF(TransmitterQueuePacket,
+                            AdapterGetVifInterface(Transmitter->Adapter),
+                            Buffer->Mdl,
+                            0,
+                            SegmentLength,
+                            OffloadOptions,
+                            0,
+                            TagControlInformation,
+                            Hash,
+                            (Index != Segments - 1) ? TRUE : More,
+                            (PVOID)((ULONG_PTR)Buffer | TRANSMITTER_BUFFER_COOKIE));
+        if (!NT_SUCCESS(status))
+            goto fail7;
+
+        Processor->Segments++;
+    }
+
+    return STATUS_SUCCESS;
+
+fail7:
+fail6:
+    __TransmitterPutBuffer(Transmitter, Buffer);
+
+    while (Head != NULL) {
+        PXENNET_TRANSMITTER_BUFFER  Next;
+
+        Next = (Head->ListEntry.Next != NULL) ?
+               CONTAINING_RECORD(Head->ListEntry.Next, XENNET_TRANSMITTER_BUFFER, ListEntry) :
+               NULL;
+
+        __TransmitterPutBuffer(Transmitter, Head);
+        Head = Next;
+    }
+
+    if (Index == Start) {
+        // Nothing more went out so the NET_BUFFER is as it was
+        (VOID) InterlockedAdd(&ListReserved->Reference, Reference - (Segments - Start));
+        return status;
+    }
+
+    // The unsent segments keep their references until they are retried
+    BufferReserved->Segment = (ULONG)Index;
+    BufferReserved->Reference = Segments - Index;
+
+    return STATUS_MORE_PROCESSING_REQUIRED;
+
+fail5:
+    while (Head != NULL) {
+        Buffer = Head;
+        Head = (Buffer->ListEntry.Next != NULL) ?
+               CONTAINING_RECORD(Buffer->ListEntry.Next, XENNET_TRANSMITTER_BUFFER, ListEntry) :
+               NULL;
+
+        __TransmitterPutBuffer(Transmitter, Buffer);
+    }
+
+    return STATUS_INSUFFICIENT_RESOURCES;
+
+fail4:
+fail3:
+fail2:
+fail1:
+    //
+    // A packet that cannot be segmented can never be sent. It is left
+    // to the caller to fail, as it may be needed to close a batch.
+    //
+    return STATUS_INVALID_PARAMETER;
+}
+
+static NTSTATUS
+__TransmitterQueueNetBuffer(
+    IN  PXENNET_TRANSMITTER         Transmitter,
+    IN  PNET_BUFFER_LIST            NetBufferList,
+    IN  PNET_BUFFER                 NetBuffer,
+    IN  PXENVIF_PACKET_HASH         Hash,
+    IN  BOOLEAN                     More
+    )
+{
+    PXENNET_TRANSMITTER_PROCESSOR   Processor;
+    XENVIF_VIF_OFFLOAD_OPTIONS      OffloadOptions;
+    XENVIF_VIF_OFFLOAD_OPTIONS      Software;
+    BOOLEAN                         Checksummed;
+    USHORT                          TagControlInformation;
+    USHORT                          MaximumSegmentSize;
+    PXENNET_TRANSMITTER_BUFFER      Buffer;
+    PMDL                            Mdl;
+    ULONG                           Offset;
+    ULONG                           Length;
+    PVOID                           Cookie;
+    NTSTATUS                        status;
+
+    ASSERT3U(KeGetCurrentIrql(), ==, DISPATCH_LEVEL);
+
+    __TransmitterOffloadOptions(NetBufferList,
+                                &OffloadOptions,
+                                &TagControlInformation,
+                                &MaximumSegmentSize);
+
+    ASSERT(__TransmitterIsOffloadEnabled(Transmitter, &OffloadOptions));
+
+    Mdl = NET_BUFFER_CURRENT_MDL(NetBuffer);
+    Offset = NET_BUFFER_CURRENT_MDL_OFFSET(NetBuffer);
+    Length = NET_BUFFER_DATA_LENGTH(NetBuffer);
+    Cookie = NetBufferList;
+
+    if (MaximumSegmentSize != 0 &&
+        __TransmitterIsSegmentationNeeded(Transmitter, &OffloadOptions, Length))
+        return __TransmitterSegmentNetBuffer(Transmitter,
+                                             NetBufferList,
+                                             NetBuffer,
+                                             Mdl,
+                                             Offset,
+                                             Length,
+                                             OffloadOptions,
+                                             MaximumSegmentSize,
+                                             TagControlInformation,
+                                             Hash,
+                                             More);
+
+    Buffer = __TransmitterLinearize(Transmitter, Mdl, Offset, Length);
+
+    // Anything the backend cannot do must be done here
+    Software.Value = OffloadOptions.Value &
+                     ~Transmitter->BackendOffloadOptions.Value;
+    Checksummed = FALSE;
+
+    if (Software.Value != 0) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        if (Buffer == NULL)
+            Buffer = __TransmitterCopyHeaders(Transmitter, Mdl, Offset, Length);
+        if (Buffer == NULL)
+            goto fail1;
+
+        //
+        // If the headers cannot be parsed there is nothing sensible
+        // that can be done, so the packet is sent as it is.
+        //
+        Checksummed = __TransmitterCalculateChecksums(Buffer,
+                                                      Length,
+                                                      Software);
+        OffloadOptions.Value &= ~Software.Value;
+    }
+
+    if (Buffer != NULL) {
+        Buffer->NetBufferList = NetBufferList;
+
+        Mdl = Buffer->Mdl;
+        Offset = 0;
+        Cookie = (PVOID)((ULONG_PTR)Buffer | TRANSMITTER_BUFFER_COOKIE);
+    }
+
+    status = XENVIF_VIF(TransmitterQueuePacket,
+                        AdapterGetVifInterface(Transmitter->Adapter),
+                        Mdl,
+                        Offset,
+                        Length,
+                        OffloadOptions,
+                        MaximumSegmentSize,
+                        TagControlInformation,
+                        Hash,
+                        More,
+                        Cookie);
+    if (!NT_SUCCESS(status))
+        goto fail2;
+
+    Processor = &Transmitter->Processor[KeGetCurrentProcessorNumberEx(NULL)];
+
+    if (Buffer != NULL)
+        Processor->Linearized++;
+    else
+        Processor->PassedThrough++;
+
+    if (Checksummed)
+        Processor->Checksummed++;
+
+    return STATUS_SUCCESS;
+
+fail2:
+    if (Buffer != NULL)
+        __TransmitterPutBuffer(Transmitter, Buffer);
+
+fail1:
+    return status;
+}
+
+static FORCEINLINE BOOLEAN
+__TransmitterIsTransientFailure(
+    IN  NTSTATUS    status
+    )
+{
+    return (status == STATUS_INSUFFICIENT_RESOURCES ||
+            status == STATUS_NO_MEMORY ||
+            status == STATUS_DEVICE_BUSY) ? TRUE : FALSE;
+}
+
+static VOID
+__TransmitterBacklogNetBuffers(
+    IN  PXENNET_TRANSMITTER         Transmitter,
+    IN  PXENNET_TRANSMITTER_BACKLOG Backlog,
+    IN  PNET_BUFFER_LIST            NetBufferList,
+    IN  PNET_BUFFER                 NetBuffer,
+    IN  LONG                        Remaining,
+    IN  BOOLEAN                     Open
+    )
+{
+    KIRQL                           Irql;
+
+    KeAcquireSpinLock(&Backlog->Lock, &Irql);
+
+    if (Open)
+        Backlog->Open = TRUE;
+
+    while (NetBuffer != NULL) {
+        PNET_BUFFER_RESERVED    BufferReserved;
+
+        // The first NET_BUFFER must get on if it is to close a batch
+        if (Backlog->Count >= TRANSMITTER_BACKLOG_MAX && !Open)
+            break;
+
+        BufferReserved = (PNET_BUFFER_RESERVED)NET_BUFFER_MINIPORT_RESERVED(NetBuffer);
+        BufferReserved->Next = NULL;
+        BufferReserved->NetBufferList = NetBufferList;
+
+        if (Backlog->Head == NULL) {
+            ASSERT3U(Backlog->Count, ==, 0);
+            Backlog->Head = NetBuffer;
+        } else {
+            PNET_BUFFER_RESERVED    TailReserved;
+
+            TailReserved = (PNET_BUFFER_RESERVED)NET_BUFFER_MINIPORT_RESERVED(Backlog->Tail);
+            TailReserved->Next = NetBuffer;
+        }
+        Backlog->Tail = NetBuffer;
+        Backlog->Count++;
+        Backlog->Backlogged++;
+
+        --Remaining;
+        NetBuffer = NET_BUFFER_NEXT_NB(NetBuffer);
+        Open = FALSE;
+    }
+
+    if (Remaining != 0)
+        Backlog->Overflows++;
+
+    KeReleaseSpinLock(&Backlog->Lock, Irql);
+
+    //
+    // Completions may have raced with us so make sure that the backlog
+    // is retried at least once.
+    //
+    (VOID) KeInsertQueueDpc(&Backlog->Dpc, NULL, NULL);
+
+    // Whatever would not fit is failed as before
+    if (Remaining != 0)
+        __TransmitterReleaseNetBufferList(Transmitter,
+                                          NetBufferList,
+                                          Remaining,
+                                          NDIS_STATUS_NOT_ACCEPTED);
+}
+
+static VOID
+__TransmitterSendNetBufferList(
+    IN  PXENNET_TRANSMITTER     Transmitter,
+    IN  PNET_BUFFER_LIST        NetBufferList,
+    IN  PXENVIF_PACKET_HASH     Hash,
+    IN  BOOLEAN                 More,
+    IN OUT PBOOLEAN             Open,
+    IN OUT PULONG               Packets,
+    IN OUT PULONG               Batches
+    )
+{
+    PXENNET_TRANSMITTER_BACKLOG Backlog;
+    PNET_BUFFER                 NetBuffer;
+    LONG                        Remaining;
+
+    Remaining = __TransmitterPrepareNetBufferList(Transmitter, NetBufferList);
+    Backlog = __TransmitterGetBacklog(Transmitter, Hash);
+
+    //
+    // NOTE: Once the last NET_BUFFER has been queued the NBL may be
+    //       completed at any time, so it must not be touched again.
+    //
+    NetBuffer = NET_BUFFER_LIST_FIRST_NB(NetBufferList);
+
+    // Don't overtake anything on the backlog for this ring
+    if (Backlog->Count != 0)
+        goto backlog;
+
+    while (NetBuffer != NULL) {
+        PNET_BUFFER         NetBufferListNext = NET_BUFFER_NEXT_NB(NetBuffer);
+        BOOLEAN             PacketMore;
+        NTSTATUS            status;
+
+        PacketMore = (NetBufferListNext != NULL) ? TRUE : More;
+
+        status = __TransmitterQueueNetBuffer(Transmitter,
+                                             NetBufferList,
+                                             NetBuffer,
+                                             Hash,
+                                             PacketMore);
+        if (!NT_SUCCESS(status)) {
+            // Some segments went with More == TRUE and the rest must follow
+            if (status == STATUS_MORE_PROCESSING_REQUIRED) {
+                *Open = TRUE;
+                goto backlog;
+            }
+
+            //
+            // If the last packet queued was More == TRUE then this one
+            // is needed to push it, so it cannot just be dropped.
+            //
+            if (__TransmitterIsTransientFailure(status) || *Open)
+                goto backlog;
+
+            // Retrying would not help so drop this NET_BUFFER alone
+            (VOID) InterlockedIncrement(&Transmitter->Failed);
+
+            --Remaining;
+            __TransmitterReleaseNetBufferList(Transmitter,
+                                              NetBufferList,
+                                              1,
+                                              NDIS_STATUS_FAILURE);
+
+            NetBuffer = NetBufferListNext;
+            continue;
+        }
+
+        *Open = PacketMore;
+
+        (*Packets)++;
+        if (!PacketMore)
+            (*Batches)++;
+
+        --Remaining;
+        NetBuffer = NetBufferListNext;
+    }
+
+    return;
+
+backlog:
+    // Closing any open batch is now up to the backlog
+    __TransmitterBacklogNetBuffers(Transmitter,
+                                   Backlog,
+                                   NetBufferList,
+                                   NetBuffer,
+                                   Remaining,
+                                   *Open);
+    *Open = FALSE;
+}
+
+__drv_functionClass(KDEFERRED_ROUTINE)
+__drv_maxIRQL(DISPATCH_LEVEL)
+__drv_minIRQL(DISPATCH_LEVEL)
+__drv_requiresIRQL(DISPATCH_LEVEL)
+__drv_sameIRQL
+static VOID
+TransmitterBacklogDpc(
+    IN  PKDPC               Dpc,
+    IN  PVOID               Context,
+    IN  PVOID               Argument1,
+    IN  PVOID               Argument2
+    )
+{
+    PXENNET_TRANSMITTER         Transmitter = Context;
+    PXENNET_TRANSMITTER_BACKLOG Backlog;
+    PNET_BUFFER                 Failed;
+    ULONG                       Packets;
+    ULONG                       Batches;
+
+    UNREFERENCED_PARAMETER(Argument1);
+    UNREFERENCED_PARAMETER(Argument2);
+
+    ASSERT(Transmitter != NULL);
+
+    Backlog = CONTAINING_RECORD(Dpc, XENNET_TRANSMITTER_BACKLOG, Dpc);
+
+    Failed = NULL;
+    Packets = 0;
+    Batches = 0;
+
+    KeAcquireSpinLockAtDpcLevel(&Backlog->Lock);
+
+    while (Backlog->Head != NULL) {
+        PNET_BUFFER             NetBuffer = Backlog->Head;
+        PNET_BUFFER_RESERVED    BufferReserved;
+        PNET_BUFFER_LIST        NetBufferList;
+        PNET_BUFFER             Next;
+        XENVIF_PACKET_HASH      Hash;
+        BOOLEAN                 More;
+        NTSTATUS                status;
+
+        BufferReserved = (PNET_BUFFER_RESERVED)NET_BUFFER_MINIPORT_RESERVED(NetBuffer);
+        NetBufferList = BufferReserved->NetBufferList;
+        Next = BufferReserved->Next;
+
+        __TransmitterHash(Transmitter, NetBufferList, &Hash);
+
+        More = FALSE;
+        if (Next != NULL) {
+            PNET_BUFFER_RESERVED    NextReserved;
+            XENVIF_PACKET_HASH      NextHash;
+
+            NextReserved = (PNET_BUFFER_RESERVED)NET_BUFFER_MINIPORT_RESERVED(Next);
+            __TransmitterHash(Transmitter, NextReserved->NetBufferList, &NextHash);
+
+            More = __TransmitterIsSameRing(&Hash, &NextHash);
+        }
+
+        status = __TransmitterQueueNetBuffer(Transmitter,
+                                             NetBufferList,
+                                             NetBuffer,
+                                             &Hash,
+                                             More);
+        if (NT_SUCCESS(status)) {
+            Backlog->Retries = 0;
+
+            Packets++;
+            if (More)
+                Backlog->Open = TRUE;
+            else
+                Batches++;
+        } else if (status == STATUS_MORE_PROCESSING_REQUIRED) {
+            // Partly sent, so it stays at the head to close the batch
+            Backlog->Retries = 0;
+            Backlog->Open = TRUE;
+            break;
+        } else {
+            if ((__TransmitterIsTransientFailure(status) ||
+                 Backlog->Open) &&
+                ++Backlog->Retries < TRANSMITTER_BACKLOG_RETRIES)
+                break;
+
+            Backlog->Retries = 0;
+            (VOID) InterlockedIncrement(&Transmitter->Failed);
+
+            // Failed once the lock is dropped
+            BufferReserved->Next = Failed;
+            Failed = NetBuffer;
+        }
+
+        Backlog->Head = Next;
+        if (Next == NULL)
+            Backlog->Tail = NULL;
+
+        ASSERT(Backlog->Count != 0);
+        --Backlog->Count;
+    }
+
+    //
+    // The last packet on the backlog always goes with More == FALSE.
+    // Otherwise, if a batch is open, there may be nothing outstanding
+    // to complete and trigger a retry.
+    //
+    if (Backlog->Head == NULL) {
+        Backlog->Open = FALSE;
+    } else if (Backlog->Open) {
+        LARGE_INTEGER   Timeout;
+
+        Timeout.QuadPart = -TRANSMITTER_BACKLOG_DELAY;
+        (VOID) KeSetTimer(&Backlog->Timer,
+                          Timeout,
+                          &Backlog->Dpc);
+    }
+
+    KeReleaseSpinLockFromDpcLevel(&Backlog->Lock);
+
+    while (Failed != NULL) {
+        PNET_BUFFER_RESERVED    BufferReserved;
+
+        BufferReserved = (PNET_BUFFER_RESERVED)NET_BUFFER_MINIPORT_RESERVED(Failed);
+        Failed = BufferReserved->Next;
+
+        __TransmitterReleaseNetBufferList(Transmitter,
+                                          BufferReserved->NetBufferList,
+                                          BufferReserved->Reference,
+                                          NDIS_STATUS_FAILURE);
+    }
+
+    (VOID) InterlockedAdd(&Transmitter->Packets, Packets);
+    (VOID) InterlockedAdd(&Transmitter->Batches, Batches);
+}
+
+static VOID
+__TransmitterAbortBacklog(
+    IN  PXENNET_TRANSMITTER     Transmitter,
+    IN  PVOID                   CancelId OPTIONAL,
+    IN  NDIS_STATUS             Status
+    )
+{
+    PNET_BUFFER                 Aborted;
+    ULONG                       Index;
+    KIRQL                       Irql;
+
+    Aborted = NULL;
+
+    for (Index = 0; Index < TRANSMITTER_BACKLOG_COUNT; Index++) {
+        PXENNET_TRANSMITTER_BACKLOG Backlog = &Transmitter->Backlog[Index];
+        PNET_BUFFER                 NetBuffer;
+        PNET_BUFFER                 Previous;
+
+        KeAcquireSpinLock(&Backlog->Lock, &Irql);
+
+        Previous = NULL;
+        NetBuffer = Backlog->Head;
+        while (NetBuffer != NULL) {
+            PNET_BUFFER_RESERVED    BufferReserved;
+            PNET_BUFFER             Next;
+
+            BufferReserved = (PNET_BUFFER_RESERVED)NET_BUFFER_MINIPORT_RESERVED(NetBuffer);
+            Next = BufferReserved->Next;
+
+            if (CancelId != NULL &&
+                NDIS_GET_NET_BUFFER_LIST_CANCEL_ID(BufferReserved->NetBufferList) != CancelId) {
+                Previous = NetBuffer;
+                NetBuffer = Next;
+                continue;
+            }
+
+            if (Previous == NULL) {
+                Backlog->Head = Next;
+            } else {
+                PNET_BUFFER_RESERVED    PreviousReserved;
+
+                PreviousReserved = (PNET_BUFFER_RESERVED)NET_BUFFER_MINIPORT_RESERVED(Previous);
+                PreviousReserved->Next = Next;
+            }
+
+            if (Backlog->Tail == NetBuffer)
+                Backlog->Tail = Previous;
+
+            ASSERT(Backlog->Count != 0);
+            --Backlog->Count;
+
+            BufferReserved->Next = Aborted;
+            Aborted = NetBuffer;
+
+            NetBuffer = Next;
+        }
+
+        if (Backlog->Head == NULL)
+            Backlog->Open = FALSE;
+
+        KeReleaseSpinLock(&Backlog->Lock, Irql);
+    }
+
+    KeRaiseIrql(DISPATCH_LEVEL, &Irql);
+
+    while (Aborted != NULL) {
+        PNET_BUFFER_RESERVED    BufferReserved;
+
+        BufferReserved = (PNET_BUFFER_RESERVED)NET_BUFFER_MINIPORT_RESERVED(Aborted);
+        Aborted = BufferReserved->Next;
+
+        __TransmitterReleaseNetBufferList(Transmitter,
+                                          BufferReserved->NetBufferList,
+                                          BufferReserved->Reference,
+                                          Status);
+    }
+
+    KeLowerIrql(Irql);
+}
+
+#pragma warning(push)
+#pragma warning(disable:28167) // changes IRQL
+
+VOID
+TransmitterSendNetBufferLists(
+    IN  PXENNET_TRANSMITTER     Transmitter,
+    IN  PNET_BUFFER_LIST        NetBufferList,
+    IN  NDIS_PORT_NUMBER        PortNumber,
+    IN  ULONG                   SendFlags
+    )
+{
+    PNET_BUFFER_LIST            HeadNetBufferList;
+    PNET_BUFFER_LIST            *TailNetBufferList;
+    PNET_BUFFER_LIST            FailedNetBufferList;
+    XENVIF_PACKET_HASH          Hash;
+    BOOLEAN                     Open;
+    ULONG                       Packets;
+    ULONG                       Batches;
+    KIRQL                       Irql = PASSIVE_LEVEL;
+
+    UNREFERENCED_PARAMETER(PortNumber);
+
+    if (!NDIS_TEST_SEND_AT_DISPATCH_LEVEL(SendFlags)) {
+        ASSERT3U(NDIS_CURRENT_IRQL(), <=, DISPATCH_LEVEL);
+        KeRaiseIrql(DISPATCH_LEVEL, &Irql);
+    }
+
+    //
+    // Fail anything requesting offloads we have not enabled up front,
+    // so that the rest of the chain can be passed to XENVIF as a single
+    // batch: only the last packet of the batch is queued with
+    // More == FALSE.
+    //
+    HeadNetBufferList = NULL;
+    TailNetBufferList = &HeadNetBufferList;
+    FailedNetBufferList = NULL;
+
+    while (NetBufferList != NULL) {
+        PNET_BUFFER_LIST            ListNext;
+        XENVIF_VIF_OFFLOAD_OPTIONS  OffloadOptions;
+        USHORT                      TagControlInformation;
+        USHORT                      MaximumSegmentSize;
+
+        ListNext = NET_BUFFER_LIST_NEXT_NBL(NetBufferList);
+        NET_BUFFER_LIST_NEXT_NBL(NetBufferList) = NULL;
+
+        __TransmitterOffloadOptions(NetBufferList,
+                                    &OffloadOptions,
+                                    &TagControlInformation,
+                                    &MaximumSegmentSize);
+
+        if (!__TransmitterIsOffloadEnabled(Transmitter, &OffloadOptions)) {
+            NET_BUFFER_LIST_STATUS(NetBufferList) = NDIS_STATUS_FAILURE;
+
+            NET_BUFFER_LIST_NEXT_NBL(NetBufferList) = FailedNetBufferList;
+            FailedNetBufferList = NetBufferList;
+        } else {
+            *TailNetBufferList = NetBufferList;
+            TailNetBufferList = &NET_BUFFER_LIST_NEXT_NBL(NetBufferList);
+        }
+
+        NetBufferList = ListNext;
+    }
+
+    if (FailedNetBufferList != NULL)
+        NdisMSendNetBufferListsComplete(AdapterGetHandle(Transmitter->Adapter),
+                                        FailedNetBufferList,
+                                        NDIS_SEND_COMPLETE_FLAGS_DISPATCH_LEVEL);
+
+    Open = FALSE;
+    Packets = 0;
+    Batches = 0;
+
+    NetBufferList = HeadNetBufferList;
+    if (NetBufferList != NULL)
+        __TransmitterHash(Transmitter, NetBufferList, &Hash);
+
+    while (NetBufferList != NULL) {
+        PNET_BUFFER_LIST            ListNext;
+        XENVIF_PACKET_HASH          NextHash;
+        BOOLEAN                     More;
+
+        ListNext = NET_BUFFER_LIST_NEXT_NBL(NetBufferList);
+        NET_BUFFER_LIST_NEXT_NBL(NetBufferList) = NULL;
+
+        //
+        // A batch can only span packets destined for the same ring,
+        // otherwise packets could be left sitting on a ring that is
+        // never pushed.
+        //
+        More = FALSE;
+        if (ListNext != NULL) {
+            __TransmitterHash(Transmitter, ListNext, &NextHash);
+            More = __TransmitterIsSameRing(&Hash, &NextHash);
+        }
+
+        __TransmitterSendNetBufferList(Transmitter,
+                                       NetBufferList,
+                                       &Hash,
+                                       More,
+                                       &Open,
+                                       &Packets,
+                                       &Batches);
+
+        if (ListNext != NULL)
+            Hash = NextHash;
+
+        NetBufferList = ListNext;
+    }
+
+    // The last packet queued was More == FALSE, or it went on the backlog
+    ASSERT(!Open);
+
+    (VOID) InterlockedAdd(&Transmitter->Packets, Packets);
+    (VOID) InterlockedAdd(&Transmitter->Batches, Batches);
+
+    if (!NDIS_TEST_SEND_AT_DISPATCH_LEVEL(SendFlags))
+        KeLowerIrql(Irql);
+}
+
+#pragma warning(pop)
+
+VOID
+TransmitterReturnPacket(
+    IN  PXENNET_TRANSMITTER                         Transmitter,
+    IN  PVOID                                       Cookie,
+    IN  PXENVIF_TRANSMITTER_PACKET_COMPLETION_INFO  Completion
+    )
+{
+    NDIS_STATUS                                     Status;
+    ULONG                                           Index;
+
+    Status = (Completion->Status == XENVIF_TRANSMITTER_PACKET_OK) ?
+             NDIS_STATUS_SUCCESS :
+             NDIS_STATUS_NOT_ACCEPTED;
+
+    if ((ULONG_PTR)Cookie & TRANSMITTER_BUFFER_COOKIE) {
+        PXENNET_TRANSMITTER_BUFFER  Buffer;
+
+        Buffer = (PXENNET_TRANSMITTER_BUFFER)((ULONG_PTR)Cookie & ~TRANSMITTER_BUFFER_COOKIE);
+        Cookie = Buffer->NetBufferList;
+
+        __TransmitterPutBuffer(Transmitter, Buffer);
+    }
+
+    __TransmitterReturnPacket(Transmitter, Cookie, Status);
+
+    //
+    // Space has been freed so retry anything that is backlogged. Which
+    // backlogs share the ring is not known, so try them all.
+    //
+    for (Index = 0; Index < TRANSMITTER_BACKLOG_COUNT; Index++) {
+        PXENNET_TRANSMITTER_BACKLOG Backlog = &Transmitter->Backlog[Index];
+
+        if (Backlog->Count != 0)
+            (VOID) KeInsertQueueDpc(&Backlog->Dpc, NULL, NULL);
+    }
+}
+
+VOID
+TransmitterCancelSendNetBufferLists(
+    IN  PXENNET_TRANSMITTER Transmitter,
+    IN  PVOID               CancelId
+    )
+{
+    __TransmitterAbortBacklog(Transmitter,
+                              CancelId,
+                              NDIS_STATUS_SEND_ABORTED);
+}
+
+VOID
+TransmitterSetLinearization(
+    IN  PXENNET_TRANSMITTER Transmitter,
+    IN  ULONG               CopyBreak,
+    IN  ULONG               MaximumFragments
+    )
+{
+    Transmitter->CopyBreak = __min(CopyBreak, TRANSMITTER_BUFFER_SIZE);
+    Transmitter->MaximumFragments = MaximumFragments;
+}
+
+__drv_functionClass(KDEFERRED_ROUTINE)
+__drv_maxIRQL(DISPATCH_LEVEL)
+__drv_minIRQL(DISPATCH_LEVEL)
+__drv_requiresIRQL(DISPATCH_LEVEL)
+__drv_sameIRQL
+static VOID
+TransmitterQuiesceDpc(
+    IN  PKDPC               Dpc,
+    IN  PVOID               Context,
+    IN  PVOID               Argument1,
+    IN  PVOID               Argument2
+    )
+{
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(Context);
+    UNREFERENCED_PARAMETER(Argument1);
+    UNREFERENCED_PARAMETER(Argument2);
+}
+
+//
+// Senders look up the hash table at DISPATCH_LEVEL without a lock, so a
+// new key is set by building a new table and swapping it in. The old
+// table can only be freed once every processor has run a DPC since the
+// swap, as any sender still using it must have finished by then.
+//
+NDIS_STATUS
+TransmitterSetHashKey(
+    IN  PXENNET_TRANSMITTER Transmitter,
+    IN  PUCHAR              Key,
+    IN  ULONG               KeySize
+    )
+{
+    PHASH_TOEPLITZ          Toeplitz;
+    ULONG                   Count;
+    ULONG                   Index;
+
+    ASSERT3U(KeGetCurrentIrql(), ==, PASSIVE_LEVEL);
+
+    Toeplitz = ExAllocatePoolWithTag(NonPagedPool,
+                                     sizeof (HASH_TOEPLITZ),
+                                     TRANSMITTER_POOL_TAG);
+    if (Toeplitz == NULL)
+        return NDIS_STATUS_RESOURCES;
+
+    HashToeplitzInitialize(Toeplitz, Key, KeySize);
+
+    Toeplitz = InterlockedExchangePointer(&Transmitter->Toeplitz, Toeplitz);
+
+    Count = __min(KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS),
+                  HVM_MAX_VCPUS);
+    for (Index = 0; Index < Count; Index++)
+        (VOID) KeInsertQueueDpc(&Transmitter->Processor[Index].QuiesceDpc,
+                                NULL,
+                                NULL);
+
+    KeFlushQueuedDpcs();
+
+    ExFreePoolWithTag(Toeplitz, TRANSMITTER_POOL_TAG);
+
+    return NDIS_STATUS_SUCCESS;
+}
+
+VOID
+TransmitterSetHashTypes(
+    IN  PXENNET_TRANSMITTER Transmitter,
+    IN  ULONG               Types
+    )
+{
+    Transmitter->HashTypes = (Types != 0) ?
+                             Types :
+                             TRANSMITTER_DEFAULT_HASH_TYPES;
+}
+
+ULONG
+TransmitterQueryBacklog(
+    IN  PXENNET_TRANSMITTER Transmitter
+    )
+{
+    ULONG                   Count;
+    ULONG                   Index;
+
+    Count = 0;
+    for (Index = 0; Index < TRANSMITTER_BACKLOG_COUNT; Index++)
+        Count += Transmitter->Backlog[Index].Count;
+
+    return Count;
+}
+
+ULONG
+TransmitterQueryLargePacketSize(
+    IN  PXENNET_TRANSMITTER     Transmitter,
+    IN  UCHAR                   Version
+    )
+{
+    PXENVIF_VIF_INTERFACE       VifInterface;
+    XENVIF_VIF_OFFLOAD_OPTIONS  Options;
+    ULONG                       Size;
+
+    VifInterface = AdapterGetVifInterface(Transmitter->Adapter);
+
+    XENVIF_VIF(TransmitterQueryOffloadOptions,
+               VifInterface,
+               &Options);
+
+    Size = 0;
+    if ((Version == 4 && Options.OffloadIpVersion4LargePacket) ||
+        (Version == 6 && Options.OffloadIpVersion6LargePacket))
+        XENVIF_VIF(TransmitterQueryLargePacketSize,
+                   VifInterface,
+                   Version,
+                   &Size);
+
+    // Anything bigger than the backend can take is segmented here
+    return __max(Size, TRANSMITTER_LARGE_PACKET_SIZE);
+}
 
 PXENVIF_VIF_OFFLOAD_OPTIONS
 TransmitterOffloadOptions(
@@ -411,3 +2428,140 @@ TransmitterOffloadOptions(
 {
     return &Transmitter->OffloadOptions;
 }
+
+VOID
+TransmitterEnable(
+    IN  PXENNET_TRANSMITTER Transmitter
+    )
+{
+    PXENNET_ADAPTER         Adapter = Transmitter->Adapter;
+    ULONG                   Index;
+
+    XENVIF_VIF(TransmitterQueryOffloadOptions,
+               AdapterGetVifInterface(Adapter),
+               &Transmitter->BackendOffloadOptions);
+
+    Transmitter->BackendLargePacketSize[0] = 0;
+    if (Transmitter->BackendOffloadOptions.OffloadIpVersion4LargePacket)
+        XENVIF_VIF(TransmitterQueryLargePacketSize,
+                   AdapterGetVifInterface(Adapter),
+                   4,
+                   &Transmitter->BackendLargePacketSize[0]);
+
+    Transmitter->BackendLargePacketSize[1] = 0;
+    if (Transmitter->BackendOffloadOptions.OffloadIpVersion6LargePacket)
+        XENVIF_VIF(TransmitterQueryLargePacketSize,
+                   AdapterGetVifInterface(Adapter),
+                   6,
+                   &Transmitter->BackendLargePacketSize[1]);
+
+    Transmitter->Packets = 0;
+    Transmitter->Batches = 0;
+    Transmitter->Failed = 0;
+
+    for (Index = 0; Index < TRANSMITTER_BACKLOG_COUNT; Index++) {
+        Transmitter->Backlog[Index].Backlogged = 0;
+        Transmitter->Backlog[Index].Overflows = 0;
+    }
+
+    for (Index = 0; Index < HVM_MAX_VCPUS; Index++) {
+        Transmitter->Processor[Index].Completed = 0;
+        Transmitter->Processor[Index].Completions = 0;
+        Transmitter->Processor[Index].Linearized = 0;
+        Transmitter->Processor[Index].PassedThrough = 0;
+        Transmitter->Processor[Index].Checksummed = 0;
+        Transmitter->Processor[Index].Segmented = 0;
+        Transmitter->Processor[Index].Segments = 0;
+    }
+}
+
+VOID
+TransmitterDisable(
+    IN  PXENNET_TRANSMITTER Transmitter
+    )
+{
+    PXENNET_ADAPTER         Adapter = Transmitter->Adapter;
+    ULONG                   Completed;
+    ULONG                   Completions;
+    ULONG                   Linearized;
+    ULONG                   PassedThrough;
+    ULONG                   Checksummed;
+    ULONG                   Segmented;
+    ULONG                   Segments;
+    ULONG                   Backlogged;
+    ULONG                   Overflows;
+    ULONG                   Index;
+
+    for (Index = 0; Index < TRANSMITTER_BACKLOG_COUNT; Index++)
+        (VOID) KeCancelTimer(&Transmitter->Backlog[Index].Timer);
+
+    // Nothing can be sent once we are paused
+    __TransmitterAbortBacklog(Transmitter,
+                              NULL,
+                              NDIS_STATUS_PAUSED);
+
+    Completed = 0;
+    Completions = 0;
+    Linearized = 0;
+    PassedThrough = 0;
+    Checksummed = 0;
+    Segmented = 0;
+    Segments = 0;
+    for (Index = 0; Index < HVM_MAX_VCPUS; Index++) {
+        Completed += Transmitter->Processor[Index].Completed;
+        Completions += Transmitter->Processor[Index].Completions;
+        Linearized += Transmitter->Processor[Index].Linearized;
+        PassedThrough += Transmitter->Processor[Index].PassedThrough;
+        Checksummed += Transmitter->Processor[Index].Checksummed;
+        Segmented += Transmitter->Processor[Index].Segmented;
+        Segments += Transmitter->Processor[Index].Segments;
+    }
+
+    Backlogged = 0;
+    Overflows = 0;
+    for (Index = 0; Index < TRANSMITTER_BACKLOG_COUNT; Index++) {
+        Backlogged += Transmitter->Backlog[Index].Backlogged;
+        Overflows += Transmitter->Backlog[Index].Overflows;
+    }
+
+    Info("%ws: <====> (Packets = %u Batches = %u Completed = %u Completions = %u Backlogged = %u Overflows = %u Failed = %u Linearized = %u PassedThrough = %u Checksummed = %u Segmented = %u Segments = %u)\n",
+         AdapterGetLocation(Adapter),
+         Transmitter->Packets,
+         Transmitter->Batches,
+         Completed,
+         Completions,
+         Backlogged,
+         Overflows,
+         Transmitter->Failed,
+         Linearized,
+         PassedThrough,
+         Checksummed,
+         Segmented,
+         Segments);
+}
+
+VOID
+TransmitterFlush(
+    IN  PXENNET_TRANSMITTER Transmitter
+    )
+{
+    ULONG                   Index;
+
+    //
+    // XENVIF returns every outstanding packet before it is disabled, but
+    // the NBLs are only gathered on the per-processor lists by then. Run
+    // the completion DPCs so that they are all back with NDIS before the
+    // pause completes.
+    //
+    KeFlushQueuedDpcs();
+
+    for (Index = 0; Index < HVM_MAX_VCPUS; Index++) {
+        PXENNET_TRANSMITTER_PROCESSOR   Processor = &Transmitter->Processor[Index];
+
+        BUG_ON(Processor->Head != NULL);
+        ASSERT3U(Processor->Count, ==, 0);
+    }
+
+    for (Index = 0; Index < TRANSMITTER_BACKLOG_COUNT; Index++)
+        ASSERT3U(Transmitter->Backlog[Index].Count, ==, 0);
+}
@@ -63,9 +63,61 @@ TransmitterReturnPacket(
     IN  PXENVIF_TRANSMITTER_PACKET_COMPLETION_INFO  Completion
     );
 
+extern VOID
+TransmitterCancelSendNetBufferLists(
+    IN  PXENNET_TRANSMITTER Transmitter,
+    IN  PVOID               CancelId
+    );
+
+extern VOID
+TransmitterSetLinearization(
+    IN  PXENNET_TRANSMITTER Transmitter,
+    IN  ULONG               CopyBreak,
+    IN  ULONG               MaximumFragments
+    );
+
+extern NDIS_STATUS
+TransmitterSetHashKey(
+    IN  PXENNET_TRANSMITTER Transmitter,
+    IN  PUCHAR              Key,
+    IN  ULONG               KeySize
+    );
+
+extern VOID
+TransmitterSetHashTypes(
+    IN  PXENNET_TRANSMITTER Transmitter,
+    IN  ULONG               Types
+    );
+
+extern ULONG
+TransmitterQueryBacklog(
+    IN  PXENNET_TRANSMITTER Transmitter
+    );
+
+extern ULONG
+TransmitterQueryLargePacketSize(
+    IN  PXENNET_TRANSMITTER Transmitter,
+    IN  UCHAR               Version
+    );
+
 extern PXENVIF_VIF_OFFLOAD_OPTIONS
 TransmitterOffloadOptions(
     IN  PXENNET_TRANSMITTER Transmitter
     );
 
+extern VOID
+TransmitterEnable(
+    IN  PXENNET_TRANSMITTER Transmitter
+    );
+
+extern VOID
+TransmitterDisable(
+    IN  PXENNET_TRANSMITTER Transmitter
+    );
+
+extern VOID
+TransmitterFlush(
+    IN  PXENNET_TRANSMITTER Transmitter
+    );
+
 #endif // _XENNET_TRANSMITTER_H_
@@ -0,0 +1,311 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+//
+// Check checksum.c against a plain RFC 1071 sum: buffers of every
+// length and alignment (so odd lengths and the SSE2 block edges are
+// all covered), MDL chains split into random, often odd-sized,
+// fragments, and the pseudo header.
+//
+
+#include <ndis.h>
+#include <tcpip.h>
+
+#include "checksum.h"
+
+static UCHAR    TestBuffer[64 * 1024];
+
+static ULONG    Failures;
+
+// Sum 16-bit little-endian words in memory order, padding an odd byte
+static ULONG
+TestReference(
+    IN  const UCHAR *Data,
+    IN  ULONG       Length,
+    IN  ULONG       Sum
+    )
+{
+    ULONG64         Accumulator = Sum;
+    ULONG           Index;
+
+    for (Index = 0; Index + 1 < Length; Index += 2)
+        Accumulator += (ULONG)Data[Index] | ((ULONG)Data[Index + 1] << 8);
+
+    if (Length & 1)
+        Accumulator += Data[Length - 1];
+
+    while (Accumulator >> 16)
+        Accumulator = (Accumulator & 0xFFFF) + (Accumulator >> 16);
+
+    return (ULONG)Accumulator;
+}
+
+static VOID
+TestCheck(
+    IN  const CHAR  *Name,
+    IN  ULONG       Length,
+    IN  ULONG       Expected,
+    IN  ULONG       Actual
+    )
+{
+    // 0x0000 and 0xFFFF are the same number in one's complement
+    if (Actual <= 0xFFFF && Expected % 0xFFFF == Actual % 0xFFFF)
+        return;
+
+    if (Failures++ < 16)
+        fprintf(stderr, "%s: length %u: expected %04x got %04x\n",
+                Name, Length, Expected, Actual);
+}
+
+static VOID
+TestFill(
+    IN  PUCHAR  Buffer,
+    IN  ULONG   Length,
+    IN  ULONG   Seed
+    )
+{
+    ULONG       Index;
+
+    srand(Seed);
+    for (Index = 0; Index < Length; Index++)
+        Buffer[Index] = (UCHAR)rand();
+}
+
+static VOID
+TestLengths(
+    VOID
+    )
+{
+    ULONG   Alignment;
+    ULONG   Length;
+
+    TestFill(TestBuffer, sizeof (TestBuffer), 1);
+
+    for (Alignment = 0; Alignment < 16; Alignment++) {
+        for (Length = 0; Length <= 4096; Length++) {
+            const UCHAR *Data = TestBuffer + Alignment;
+            ULONG       Sum = (ULONG)rand() & 0xFFFF;
+
+            TestCheck("length", Length,
+                      TestReference(Data, Length, Sum),
+                      ChecksumAccumulate(Data, Length, Sum));
+        }
+    }
+}
+
+// All ones maximises every partial sum, so overflow would show up here
+static VOID
+TestLarge(
+    VOID
+    )
+{
+    ULONG   Length;
+
+    for (Length = 0x7F000; Length < 0x90000; Length += 0x1001) {
+        PUCHAR  Data = malloc(Length);
+
+        if (Data == NULL)
+            abort();
+
+        memset(Data, 0xFF, Length);
+
+        TestCheck("large", Length,
+                  TestReference(Data, Length, 0xFFFF),
+                  ChecksumAccumulate(Data, Length, 0xFFFF));
+
+        free(Data);
+    }
+}
+
+static VOID
+TestMdls(
+    IN  ULONG   Iterations
+    )
+{
+    ULONG       Iteration;
+
+    TestFill(TestBuffer, sizeof (TestBuffer), 2);
+
+    for (Iteration = 0; Iteration < Iterations; Iteration++) {
+        MDL     Mdl[8];
+        ULONG   Count;
+        ULONG   Total;
+        ULONG   Offset;
+        ULONG   Length;
+        ULONG   Index;
+        ULONG   Initial;
+        ULONG   Sum;
+
+        // Fragments of random length laid end to end, starting at an
+        // odd address; every other iteration uses tiny fragments
+        Count = 1 + rand() % ARRAYSIZE(Mdl);
+        Total = 0;
+        for (Index = 0; Index < Count; Index++) {
+            ULONG   ByteCount = rand() % ((Iteration & 1) ? 9 : 3000);
+
+            Mdl[Index].Next = (Index + 1 < Count) ? &Mdl[Index + 1] : NULL;
+            Mdl[Index].ByteCount = ByteCount;
+            Mdl[Index].MappedSystemVa = TestBuffer + 1 + Total;
+
+            Total += ByteCount;
+        }
+
+        Offset = rand() % (Total + 1);
+        Length = rand() % (Total - Offset + 1);
+
+        Initial = (ULONG)rand() & 0xFFFF;
+
+        Sum = Initial;
+        if (!ChecksumAccumulateMdl(&Mdl[0], Offset, Length, &Sum)) {
+            if (Failures++ < 16)
+                fprintf(stderr, "mdl: %u fragments: failed\n", Count);
+            continue;
+        }
+
+        TestCheck("mdl", Length,
+                  TestReference(TestBuffer + 1 + Offset, Length, Initial),
+                  Sum);
+    }
+
+    // Running off the end of the chain must fail
+    {
+        MDL     Mdl;
+        ULONG   Sum = 0;
+
+        Mdl.Next = NULL;
+        Mdl.ByteCount = 100;
+        Mdl.MappedSystemVa = TestBuffer;
+
+        if (ChecksumAccumulateMdl(&Mdl, 50, 51, &Sum)) {
+            fprintf(stderr, "mdl: short chain not detected\n");
+            Failures++;
+        }
+    }
+}
+
+// Summing in two pieces, the second starting at an odd offset
+static VOID
+TestCombine(
+    VOID
+    )
+{
+    ULONG   Length;
+
+    TestFill(TestBuffer, sizeof (TestBuffer), 3);
+
+    for (Length = 2; Length < 2048; Length++) {
+        ULONG   Split = rand() % Length;
+        ULONG   Sum;
+
+        Sum = ChecksumAccumulate(TestBuffer, Split, 0);
+        Sum = ChecksumCombine(Sum,
+                              ChecksumAccumulate(TestBuffer + Split,
+                                                 Length - Split,
+                                                 0),
+                              (Split & 1) ? TRUE : FALSE);
+
+        TestCheck("combine", Length,
+                  TestReference(TestBuffer, Length, 0),
+                  Sum);
+    }
+}
+
+static VOID
+TestPseudoHeader(
+    VOID
+    )
+{
+    UCHAR   Header[40];
+    ULONG   Length;
+
+    TestFill(TestBuffer, sizeof (TestBuffer), 4);
+
+    for (Length = 0; Length <= 0xFFFF; Length += 0x1FF) {
+        ULONG   AddressLength = (Length & 0x200) ? 16 : 4;
+        UCHAR   Protocol = (Length & 0x400) ? IPPROTO_TCP : IPPROTO_UDP;
+        ULONG   Size;
+
+        // Addresses, then a zero pad, protocol and length in network order
+        memcpy(Header, TestBuffer, 2 * AddressLength);
+        Size = 2 * AddressLength;
+        Header[Size++] = 0;
+        Header[Size++] = Protocol;
+        Header[Size++] = (UCHAR)(Length >> 8);
+        Header[Size++] = (UCHAR)Length;
+
+        TestCheck("pseudo", Length,
+                  TestReference(Header, Size, 0),
+                  ChecksumPseudoHeader(TestBuffer,
+                                       TestBuffer + AddressLength,
+                                       AddressLength,
+                                       Protocol,
+                                       Length));
+    }
+}
+
+// A real IPv4 header, including its checksum, sums to all ones
+static VOID
+TestHeader(
+    VOID
+    )
+{
+    static const UCHAR  Header[] = {
+        0x45, 0x00, 0x00, 0x73, 0x00, 0x00, 0x40, 0x00,
+        0x40, 0x11, 0xb8, 0x61, 0xc0, 0xa8, 0x00, 0x01,
+        0xc0, 0xa8, 0x00, 0xc7
+    };
+
+    if (ChecksumAccumulate(Header, sizeof (Header), 0) != 0xFFFF) {
+        fprintf(stderr, "header: checksum does not verify\n");
+        Failures++;
+    }
+}
+
+int
+main(
+    IN  int     argc,
+    IN  char    **argv
+    )
+{
+    UNREFERENCED_PARAMETER(argc);
+    UNREFERENCED_PARAMETER(argv);
+
+    TestLengths();
+    TestLarge();
+    TestMdls(200000);
+    TestCombine();
+    TestPseudoHeader();
+    TestHeader();
+
+    printf("checksum_test: %s\n", (Failures == 0) ? "PASS" : "FAIL");
+
+    return (Failures == 0) ? 0 : 1;
+}
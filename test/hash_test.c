@@ -0,0 +1,279 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+//
+// Check the table-driven Toeplitz hash in hash.c against the
+// verification suite published with the Microsoft RSS specification,
+// and against a bit-at-a-time reference for random keys and inputs.
+//
+
+#include <ndis.h>
+
+#include "hash.h"
+
+static const UCHAR  TestKey[] = {
+    0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2,
+    0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+    0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4,
+    0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+    0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa
+};
+
+typedef struct _TEST_VECTOR {
+    const CHAR  *Destination;
+    USHORT      DestinationPort;
+    const CHAR  *Source;
+    USHORT      SourcePort;
+    ULONG       IpHash;
+    ULONG       TcpHash;
+} TEST_VECTOR, *PTEST_VECTOR;
+
+static const TEST_VECTOR    TestVersion4[] = {
+    { "161.142.100.80", 1766, "66.9.149.187", 2794, 0x323e8fc2, 0x51ccc178 },
+    { "65.69.140.83", 4739, "199.92.111.2", 14230, 0xd718262a, 0xc626b0ea },
+    { "12.22.207.184", 38024, "24.19.198.95", 12898, 0xd2d0a5de, 0x5c2b394a },
+    { "209.142.163.6", 2217, "38.27.205.30", 48228, 0x82989176, 0xafc7327f },
+    { "202.188.127.2", 1303, "153.39.163.191", 44251, 0x5d1809c5, 0x10e828a2 },
+};
+
+static const TEST_VECTOR    TestVersion6[] = {
+    { "3ffe:2501:200:3::1", 1766, "3ffe:2501:200:1fff::7", 2794, 0x2cc18cd5, 0x40207d3d },
+    { "ff02::1", 4739, "3ffe:501:8::260:97ff:fe40:efab", 14230, 0x0f0c461c, 0xdde51bbf },
+    { "fe80::200:f8ff:fe21:67cf", 38024, "3ffe:1900:4545:3:200:f8ff:fe21:67cf", 44251, 0x4b61e985, 0x02d1feef },
+};
+
+static HASH_TOEPLITZ    Toeplitz;
+
+static ULONG    Failures;
+
+static VOID
+TestParseVersion4(
+    IN  const CHAR  *String,
+    OUT PUCHAR      Address
+    )
+{
+    unsigned int    Byte[4];
+
+    if (sscanf(String, "%u.%u.%u.%u", &Byte[0], &Byte[1], &Byte[2], &Byte[3]) != 4)
+        abort();
+
+    Address[0] = (UCHAR)Byte[0];
+    Address[1] = (UCHAR)Byte[1];
+    Address[2] = (UCHAR)Byte[2];
+    Address[3] = (UCHAR)Byte[3];
+}
+
+// Enough of inet_pton() for the addresses above
+static VOID
+TestParseVersion6(
+    IN  const CHAR  *String,
+    OUT PUCHAR      Address
+    )
+{
+    USHORT          Word[8];
+    ULONG           Count;
+    ULONG           Gap;
+    ULONG           Index;
+    const CHAR      *Cursor;
+
+    Count = 0;
+    Gap = 8;
+
+    for (Cursor = String; *Cursor != '\0'; ) {
+        if (Cursor[0] == ':' && Cursor[1] == ':') {
+            Gap = Count;
+            Cursor += 2;
+            continue;
+        }
+
+        if (*Cursor == ':') {
+            Cursor++;
+            continue;
+        }
+
+        Word[Count++] = (USHORT)strtoul(Cursor, (char **)&Cursor, 16);
+    }
+
+    memset(Address, 0, 16);
+
+    for (Index = 0; Index < Count; Index++) {
+        ULONG   Position = (Index < Gap) ? Index : 8 - (Count - Index);
+
+        Address[2 * Position] = (UCHAR)(Word[Index] >> 8);
+        Address[2 * Position + 1] = (UCHAR)Word[Index];
+    }
+}
+
+// The hash as the specification describes it, one input bit at a time
+static ULONG
+TestReference(
+    IN  const UCHAR *Key,
+    IN  ULONG       KeySize,
+    IN  const UCHAR *Input,
+    IN  ULONG       Length
+    )
+{
+    UCHAR           Padded[NDIS_RSS_HASH_SECRET_KEY_MAX_SIZE_REVISION_1];
+    ULONG           Result;
+    ULONG           Window;
+    ULONG           Index;
+
+    memset(Padded, 0, sizeof (Padded));
+    memcpy(Padded, Key, KeySize);
+
+    Window = ((ULONG)Padded[0] << 24) | ((ULONG)Padded[1] << 16) |
+             ((ULONG)Padded[2] << 8) | Padded[3];
+    Result = 0;
+
+    for (Index = 0; Index < Length * 8; Index++) {
+        ULONG   Next = Index + 32;
+
+        if (Input[Index / 8] & (0x80 >> (Index % 8)))
+            Result ^= Window;
+
+        Window <<= 1;
+        if (Next / 8 < sizeof (Padded) &&
+            Padded[Next / 8] & (0x80 >> (Next % 8)))
+            Window |= 1;
+    }
+
+    return Result;
+}
+
+static VOID
+TestCheck(
+    IN  const CHAR  *Name,
+    IN  ULONG       Index,
+    IN  ULONG       Expected,
+    IN  ULONG       Actual
+    )
+{
+    if (Expected == Actual)
+        return;
+
+    fprintf(stderr, "%s[%u]: expected %08x got %08x\n",
+            Name, Index, Expected, Actual);
+    Failures++;
+}
+
+static VOID
+TestVectors(
+    IN  const CHAR          *Name,
+    IN  const TEST_VECTOR   *Vector,
+    IN  ULONG               Count,
+    IN  ULONG               AddressLength
+    )
+{
+    ULONG                   Index;
+
+    for (Index = 0; Index < Count; Index++) {
+        UCHAR   Input[HASH_TOEPLITZ_INPUT_MAX];
+
+        // Source address, destination address, source port, destination port
+        if (AddressLength == 4) {
+            TestParseVersion4(Vector[Index].Source, &Input[0]);
+            TestParseVersion4(Vector[Index].Destination, &Input[4]);
+        } else {
+            TestParseVersion6(Vector[Index].Source, &Input[0]);
+            TestParseVersion6(Vector[Index].Destination, &Input[16]);
+        }
+
+        Input[2 * AddressLength] = (UCHAR)(Vector[Index].SourcePort >> 8);
+        Input[2 * AddressLength + 1] = (UCHAR)Vector[Index].SourcePort;
+        Input[2 * AddressLength + 2] = (UCHAR)(Vector[Index].DestinationPort >> 8);
+        Input[2 * AddressLength + 3] = (UCHAR)Vector[Index].DestinationPort;
+
+        TestCheck(Name, Index,
+                  Vector[Index].IpHash,
+                  HashToeplitz(&Toeplitz, Input, 2 * AddressLength));
+        TestCheck(Name, Index,
+                  Vector[Index].TcpHash,
+                  HashToeplitz(&Toeplitz, Input, 2 * AddressLength + 4));
+
+        TestCheck(Name, Index,
+                  Vector[Index].TcpHash,
+                  TestReference(TestKey, sizeof (TestKey), Input, 2 * AddressLength + 4));
+    }
+}
+
+static VOID
+TestRandom(
+    IN  ULONG   Iterations
+    )
+{
+    ULONG       Iteration;
+
+    srand(1);
+
+    for (Iteration = 0; Iteration < Iterations; Iteration++) {
+        UCHAR   Key[NDIS_RSS_HASH_SECRET_KEY_MAX_SIZE_REVISION_1];
+        UCHAR   Input[HASH_TOEPLITZ_INPUT_MAX];
+        ULONG   KeySize;
+        ULONG   Length;
+        ULONG   Index;
+
+        // Short keys are padded with zeroes
+        KeySize = (Iteration % 2) ? sizeof (Key) : 16 + rand() % (sizeof (Key) - 16);
+        for (Index = 0; Index < KeySize; Index++)
+            Key[Index] = (UCHAR)rand();
+
+        Length = 1 + rand() % HASH_TOEPLITZ_INPUT_MAX;
+        for (Index = 0; Index < Length; Index++)
+            Input[Index] = (UCHAR)rand();
+
+        HashToeplitzInitialize(&Toeplitz, Key, KeySize);
+
+        TestCheck("random", Iteration,
+                  TestReference(Key, KeySize, Input, Length),
+                  HashToeplitz(&Toeplitz, Input, Length));
+    }
+}
+
+int
+main(
+    IN  int     argc,
+    IN  char    **argv
+    )
+{
+    UNREFERENCED_PARAMETER(argc);
+    UNREFERENCED_PARAMETER(argv);
+
+    HashToeplitzInitialize(&Toeplitz, TestKey, sizeof (TestKey));
+
+    TestVectors("ipv4", TestVersion4, ARRAYSIZE(TestVersion4), 4);
+    TestVectors("ipv6", TestVersion6, ARRAYSIZE(TestVersion6), 16);
+
+    TestRandom(1000);
+
+    printf("hash_test: %s\n", (Failures == 0) ? "PASS" : "FAIL");
+
+    return (Failures == 0) ? 0 : 1;
+}
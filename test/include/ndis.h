@@ -0,0 +1,136 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+//
+// Just enough of the kernel and NDIS environment to build the driver's
+// self-contained modules (checksum.c, hash.c) into user-mode tests with
+// a POSIX C compiler.
+//
+
+#ifndef _TEST_NDIS_H
+#define _TEST_NDIS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+typedef void        VOID, *PVOID;
+typedef char        CHAR, *PCHAR;
+typedef uint8_t     UCHAR, *PUCHAR;
+typedef int16_t     SHORT, *PSHORT;
+typedef uint16_t    USHORT, *PUSHORT;
+typedef int32_t     LONG, *PLONG;
+typedef uint32_t    ULONG, *PULONG;
+typedef int64_t     LONGLONG, *PLONGLONG;
+typedef uint64_t    ULONGLONG, *PULONGLONG;
+typedef uint64_t    ULONG64, *PULONG64;
+typedef uintptr_t   ULONG_PTR, *PULONG_PTR;
+typedef size_t      SIZE_T, *PSIZE_T;
+typedef UCHAR       BOOLEAN, *PBOOLEAN;
+typedef int32_t     NTSTATUS;
+
+#define TRUE    1
+#define FALSE   0
+
+#define IN
+#define OUT
+#define OPTIONAL
+#define UNALIGNED
+
+#define FORCEINLINE     inline __attribute__((always_inline))
+#define __inline        inline
+
+#define C_ASSERT(_e)    _Static_assert(_e, #_e)
+
+#define UNREFERENCED_PARAMETER(_p)  ((void)(_p))
+
+#define __min(_a, _b)   (((_a) < (_b)) ? (_a) : (_b))
+#define __max(_a, _b)   (((_a) > (_b)) ? (_a) : (_b))
+
+#define ARRAYSIZE(_a)   (sizeof (_a) / sizeof ((_a)[0]))
+
+#define RtlZeroMemory(_d, _l)       memset((_d), 0, (_l))
+#define RtlCopyMemory(_d, _s, _l)   memcpy((_d), (_s), (_l))
+#define RtlEqualMemory(_d, _s, _l)  (memcmp((_d), (_s), (_l)) == 0)
+
+#define _byteswap_ushort(_v)    __builtin_bswap16(_v)
+#define _byteswap_ulong(_v)     __builtin_bswap32(_v)
+
+#if defined(__x86_64__)
+#define _M_AMD64    1
+#endif
+
+// An MDL is just a chain of mapped fragments here
+typedef struct _MDL {
+    struct _MDL *Next;
+    ULONG       ByteCount;
+    PVOID       MappedSystemVa;
+} MDL, *PMDL;
+
+#define NormalPagePriority  16
+
+#define MmGetSystemAddressForMdlSafe(_Mdl, _Priority) \
+        ((PUCHAR)(_Mdl)->MappedSystemVa)
+
+#define NDIS_RSS_HASH_SECRET_KEY_MAX_SIZE_REVISION_1    40
+
+#define NDIS_HASH_IPV4          0x00000100
+#define NDIS_HASH_TCP_IPV4      0x00000200
+#define NDIS_HASH_IPV6          0x00000400
+#define NDIS_HASH_TCP_IPV6      0x00001000
+
+//
+// Replace the driver's debug print and assertion headers, which rely on
+// MSVC string pasting and the kernel debugger.
+//
+#define _XENNET_DBG_PRINT_H
+#define _XENNET_ASSERT_H
+
+#define Error(...)      fprintf(stderr, __VA_ARGS__)
+#define Warning(...)    fprintf(stderr, __VA_ARGS__)
+#define Info(...)       ((void)0)
+#define Trace(...)      ((void)0)
+
+#define BUG(_TEXT)      do { fprintf(stderr, "BUG: %s\n", _TEXT); abort(); } while (FALSE)
+#define BUG_ON(_EXP)    if (_EXP) BUG(#_EXP)
+
+#define ASSERT(_EXP)            assert(_EXP)
+#define ASSERT3U(_X, _OP, _Y)   assert((_X) _OP (_Y))
+#define ASSERT3S(_X, _OP, _Y)   assert((_X) _OP (_Y))
+#define ASSERT3P(_X, _OP, _Y)   assert((_X) _OP (_Y))
+
+#define IMPLY(_X, _Y)   (!(_X) || (_Y))
+#define EQUIV(_X, _Y)   (IMPLY((_X), (_Y)) && IMPLY((_Y), (_X)))
+
+#endif  // _TEST_NDIS_H
@@ -0,0 +1,565 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+//
+// Compare the receive NBL cache in receiver.c (per-processor pairs of
+// bounded magazines exchanged with a locked depot) with the scheme it
+// replaced (a per-processor get list refilled by grabbing a global
+// lock-free put list, which every free pushes onto with a CAS).
+//
+// Each thread stands in for a processor: it allocates a batch of
+// objects, as a receive DPC would, then frees them, as NDIS returning
+// the batch would. Objects are freed on a different thread to the one
+// that allocated them for a fraction of batches, as happens when
+// NDIS returns packets from another processor.
+//
+// Both schemes are modelled on the driver code with the kernel
+// primitives replaced: interlocked operations with GCC atomics and the
+// depot spin lock with a spin lock that yields, so that the numbers
+// mean something when there are more threads than CPUs.
+//
+
+#include <ndis.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#define BENCH_THREADS_MAX   64
+#define BENCH_BATCH         64
+#define BENCH_OPERATIONS    (1 << 22)
+
+typedef struct _BENCH_OBJECT {
+    struct _BENCH_OBJECT    *Next;
+    UCHAR                   Payload[248];
+} BENCH_OBJECT, *PBENCH_OBJECT;
+
+static LONG BenchAllocated;
+
+static PBENCH_OBJECT
+BenchCtor(
+    VOID
+    )
+{
+    __atomic_add_fetch(&BenchAllocated, 1, __ATOMIC_RELAXED);
+    return calloc(1, sizeof (BENCH_OBJECT));
+}
+
+static VOID
+BenchDtor(
+    IN  PBENCH_OBJECT   Object
+    )
+{
+    __atomic_sub_fetch(&BenchAllocated, 1, __ATOMIC_RELAXED);
+    free(Object);
+}
+
+typedef struct _BENCH_LOCK {
+    volatile LONG   Held;
+} BENCH_LOCK, *PBENCH_LOCK;
+
+static VOID
+BenchAcquire(
+    IN  PBENCH_LOCK Lock
+    )
+{
+    ULONG           Spin = 0;
+
+    while (__atomic_exchange_n(&Lock->Held, 1, __ATOMIC_ACQUIRE) != 0)
+        while (__atomic_load_n(&Lock->Held, __ATOMIC_RELAXED) != 0)
+            if (++Spin % 256 == 0)
+                sched_yield();
+}
+
+static VOID
+BenchRelease(
+    IN  PBENCH_LOCK Lock
+    )
+{
+    __atomic_store_n(&Lock->Held, 0, __ATOMIC_RELEASE);
+}
+
+//
+// The old scheme
+//
+
+typedef struct _STACK_CACHE {
+    PBENCH_OBJECT   PutList __attribute__((aligned(64)));
+    struct {
+        PBENCH_OBJECT   GetList;
+    } Processor[BENCH_THREADS_MAX] __attribute__((aligned(64)));
+} STACK_CACHE, *PSTACK_CACHE;
+
+static PBENCH_OBJECT
+StackGet(
+    IN  PSTACK_CACHE    Cache,
+    IN  ULONG           Index
+    )
+{
+    PBENCH_OBJECT       Object;
+
+    if (Cache->Processor[Index].GetList == NULL)
+        Cache->Processor[Index].GetList =
+            __atomic_exchange_n(&Cache->PutList, NULL, __ATOMIC_ACQUIRE);
+
+    Object = Cache->Processor[Index].GetList;
+    if (Object == NULL)
+        return BenchCtor();
+
+    Cache->Processor[Index].GetList = Object->Next;
+    Object->Next = NULL;
+
+    return Object;
+}
+
+static VOID
+StackPut(
+    IN  PSTACK_CACHE    Cache,
+    IN  PBENCH_OBJECT   Object
+    )
+{
+    PBENCH_OBJECT       Old;
+
+    Old = __atomic_load_n(&Cache->PutList, __ATOMIC_RELAXED);
+    do {
+        Object->Next = Old;
+    } while (!__atomic_compare_exchange_n(&Cache->PutList, &Old, Object, TRUE,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+//
+// The magazine scheme, as in receiver.c
+//
+
+#define MAGAZINE_SIZE   32
+#define DEPOT_LIMIT     64
+
+typedef struct _MAGAZINE {
+    struct _MAGAZINE    *Next;
+    ULONG               Count;
+    PBENCH_OBJECT       Slot[MAGAZINE_SIZE];
+} MAGAZINE, *PMAGAZINE;
+
+typedef struct _MAGAZINE_CACHE {
+    BENCH_LOCK  Lock __attribute__((aligned(64)));
+    PMAGAZINE   FullList;
+    ULONG       FullCount;
+    PMAGAZINE   EmptyList;
+    struct {
+        PMAGAZINE   Loaded;
+        PMAGAZINE   Previous;
+        ULONG       Hit;
+        ULONG       Miss;
+    } Processor[BENCH_THREADS_MAX] __attribute__((aligned(64)));
+} MAGAZINE_CACHE, *PMAGAZINE_CACHE;
+
+static BOOLEAN
+MagazineExchangeFull(
+    IN  PMAGAZINE_CACHE Cache,
+    IN  ULONG           Index
+    )
+{
+    PMAGAZINE           Magazine;
+
+    BenchAcquire(&Cache->Lock);
+
+    Magazine = Cache->FullList;
+    if (Magazine == NULL) {
+        BenchRelease(&Cache->Lock);
+        return FALSE;
+    }
+
+    Cache->FullList = Magazine->Next;
+    --Cache->FullCount;
+
+    if (Cache->Processor[Index].Previous != NULL) {
+        Cache->Processor[Index].Previous->Next = Cache->EmptyList;
+        Cache->EmptyList = Cache->Processor[Index].Previous;
+    }
+
+    BenchRelease(&Cache->Lock);
+
+    Cache->Processor[Index].Previous = Cache->Processor[Index].Loaded;
+    Cache->Processor[Index].Loaded = Magazine;
+
+    return TRUE;
+}
+
+static BOOLEAN
+MagazineExchangeEmpty(
+    IN  PMAGAZINE_CACHE Cache,
+    IN  ULONG           Index
+    )
+{
+    PMAGAZINE           Previous = Cache->Processor[Index].Previous;
+    PMAGAZINE           Magazine;
+
+    BenchAcquire(&Cache->Lock);
+
+    if (Previous != NULL && Cache->FullCount >= DEPOT_LIMIT)
+        goto fail1;
+
+    if (Cache->EmptyList == NULL) {
+        BenchRelease(&Cache->Lock);
+
+        Magazine = calloc(1, sizeof (MAGAZINE));
+        if (Magazine == NULL)
+            return FALSE;
+
+        BenchAcquire(&Cache->Lock);
+
+        Magazine->Next = Cache->EmptyList;
+        Cache->EmptyList = Magazine;
+
+        if (Previous != NULL && Cache->FullCount >= DEPOT_LIMIT)
+            goto fail2;
+    }
+
+    Magazine = Cache->EmptyList;
+    Cache->EmptyList = Magazine->Next;
+
+    if (Previous != NULL) {
+        Previous->Next = Cache->FullList;
+        Cache->FullList = Previous;
+        Cache->FullCount++;
+    }
+
+    BenchRelease(&Cache->Lock);
+
+    Cache->Processor[Index].Previous = Cache->Processor[Index].Loaded;
+    Cache->Processor[Index].Loaded = Magazine;
+
+    return TRUE;
+
+fail2:
+fail1:
+    BenchRelease(&Cache->Lock);
+
+    return FALSE;
+}
+
+static PBENCH_OBJECT
+MagazineGet(
+    IN  PMAGAZINE_CACHE Cache,
+    IN  ULONG           Index
+    )
+{
+    PMAGAZINE           Magazine = Cache->Processor[Index].Loaded;
+
+    if (Magazine == NULL || Magazine->Count == 0) {
+        PMAGAZINE   Previous = Cache->Processor[Index].Previous;
+
+        if (Previous != NULL && Previous->Count != 0) {
+            Cache->Processor[Index].Loaded = Previous;
+            Cache->Processor[Index].Previous = Magazine;
+        } else if (!MagazineExchangeFull(Cache, Index)) {
+            Cache->Processor[Index].Miss++;
+            return BenchCtor();
+        }
+
+        Magazine = Cache->Processor[Index].Loaded;
+    }
+
+    Cache->Processor[Index].Hit++;
+    return Magazine->Slot[--Magazine->Count];
+}
+
+static VOID
+MagazinePut(
+    IN  PMAGAZINE_CACHE Cache,
+    IN  ULONG           Index,
+    IN  PBENCH_OBJECT   Object
+    )
+{
+    PMAGAZINE           Magazine = Cache->Processor[Index].Loaded;
+
+    if (Magazine == NULL || Magazine->Count == MAGAZINE_SIZE) {
+        PMAGAZINE   Previous = Cache->Processor[Index].Previous;
+
+        if (Previous != NULL && Previous->Count != MAGAZINE_SIZE) {
+            Cache->Processor[Index].Loaded = Previous;
+            Cache->Processor[Index].Previous = Magazine;
+        } else if (!MagazineExchangeEmpty(Cache, Index)) {
+            BenchDtor(Object);
+            return;
+        }
+
+        Magazine = Cache->Processor[Index].Loaded;
+    }
+
+    Magazine->Slot[Magazine->Count++] = Object;
+}
+
+//
+// The driver
+//
+
+typedef enum _BENCH_SCHEME {
+    BENCH_SCHEME_STACK,
+    BENCH_SCHEME_MAGAZINE
+} BENCH_SCHEME;
+
+static BENCH_SCHEME     BenchScheme;
+static STACK_CACHE      BenchStack;
+static MAGAZINE_CACHE   BenchMagazine;
+static ULONG            BenchThreads;
+
+// Batches handed to another thread to free, one slot per thread
+static PBENCH_OBJECT    BenchMailbox[BENCH_THREADS_MAX] __attribute__((aligned(64)));
+
+static FORCEINLINE PBENCH_OBJECT
+BenchGet(
+    IN  ULONG   Index
+    )
+{
+    return (BenchScheme == BENCH_SCHEME_STACK) ?
+           StackGet(&BenchStack, Index) :
+           MagazineGet(&BenchMagazine, Index);
+}
+
+static FORCEINLINE VOID
+BenchPut(
+    IN  ULONG           Index,
+    IN  PBENCH_OBJECT   Object
+    )
+{
+    if (BenchScheme == BENCH_SCHEME_STACK)
+        StackPut(&BenchStack, Object);
+    else
+        MagazinePut(&BenchMagazine, Index, Object);
+}
+
+static VOID
+BenchPutList(
+    IN  ULONG           Index,
+    IN  PBENCH_OBJECT   Object
+    )
+{
+    while (Object != NULL) {
+        PBENCH_OBJECT   Next = Object->Next;
+
+        Object->Next = NULL;
+        BenchPut(Index, Object);
+        Object = Next;
+    }
+}
+
+static void *
+BenchThread(
+    IN  void    *Argument
+    )
+{
+    ULONG       Index = (ULONG)(ULONG_PTR)Argument;
+    ULONG       Iterations = BENCH_OPERATIONS / BENCH_BATCH / BenchThreads;
+    ULONG       Iteration;
+
+    for (Iteration = 0; Iteration < Iterations; Iteration++) {
+        PBENCH_OBJECT   Head = NULL;
+        ULONG           Count;
+
+        for (Count = 0; Count < BENCH_BATCH; Count++) {
+            PBENCH_OBJECT   Object = BenchGet(Index);
+
+            Object->Payload[0] = (UCHAR)Count;
+            Object->Next = Head;
+            Head = Object;
+        }
+
+        // One batch in eight is returned on the next thread along
+        if (BenchThreads > 1 && Iteration % 8 == 0) {
+            ULONG   Target = (Index + 1) % BenchThreads;
+
+            Head = __atomic_exchange_n(&BenchMailbox[Target], Head, __ATOMIC_ACQ_REL);
+        }
+
+        BenchPutList(Index, Head);
+
+        Head = __atomic_exchange_n(&BenchMailbox[Index], NULL, __ATOMIC_ACQ_REL);
+        BenchPutList(Index, Head);
+    }
+
+    return NULL;
+}
+
+static double
+BenchNow(
+    VOID
+    )
+{
+    struct timespec Now;
+
+    clock_gettime(CLOCK_MONOTONIC, &Now);
+    return (double)Now.tv_sec + (double)Now.tv_nsec / 1e9;
+}
+
+static VOID
+BenchDrain(
+    VOID
+    )
+{
+    ULONG   Index;
+
+    for (Index = 0; Index < BENCH_THREADS_MAX; Index++) {
+        PBENCH_OBJECT   Object;
+
+        Object = __atomic_exchange_n(&BenchMailbox[Index], NULL, __ATOMIC_ACQ_REL);
+        while (Object != NULL) {
+            PBENCH_OBJECT   Next = Object->Next;
+
+            BenchDtor(Object);
+            Object = Next;
+        }
+    }
+
+    if (BenchScheme == BENCH_SCHEME_STACK) {
+        PBENCH_OBJECT   List[BENCH_THREADS_MAX + 1];
+
+        for (Index = 0; Index < BENCH_THREADS_MAX; Index++) {
+            List[Index] = BenchStack.Processor[Index].GetList;
+            BenchStack.Processor[Index].GetList = NULL;
+        }
+        List[BENCH_THREADS_MAX] = BenchStack.PutList;
+        BenchStack.PutList = NULL;
+
+        for (Index = 0; Index <= BENCH_THREADS_MAX; Index++) {
+            PBENCH_OBJECT   Object = List[Index];
+
+            while (Object != NULL) {
+                PBENCH_OBJECT   Next = Object->Next;
+
+                BenchDtor(Object);
+                Object = Next;
+            }
+        }
+    } else {
+        PMAGAZINE   List[2 * BENCH_THREADS_MAX];
+        PMAGAZINE   Magazine;
+        ULONG       Count = 0;
+
+        for (Index = 0; Index < BENCH_THREADS_MAX; Index++) {
+            List[Count++] = BenchMagazine.Processor[Index].Loaded;
+            List[Count++] = BenchMagazine.Processor[Index].Previous;
+            memset(&BenchMagazine.Processor[Index], 0,
+                   sizeof (BenchMagazine.Processor[Index]));
+        }
+
+        for (Index = 0; Index < Count; Index++) {
+            Magazine = List[Index];
+            if (Magazine == NULL)
+                continue;
+
+            while (Magazine->Count != 0)
+                BenchDtor(Magazine->Slot[--Magazine->Count]);
+            free(Magazine);
+        }
+
+        while ((Magazine = BenchMagazine.FullList) != NULL) {
+            BenchMagazine.FullList = Magazine->Next;
+            while (Magazine->Count != 0)
+                BenchDtor(Magazine->Slot[--Magazine->Count]);
+            free(Magazine);
+        }
+        BenchMagazine.FullCount = 0;
+
+        while ((Magazine = BenchMagazine.EmptyList) != NULL) {
+            BenchMagazine.EmptyList = Magazine->Next;
+            free(Magazine);
+        }
+    }
+}
+
+static VOID
+BenchRun(
+    IN  BENCH_SCHEME    Scheme,
+    IN  ULONG           Threads
+    )
+{
+    pthread_t           Thread[BENCH_THREADS_MAX];
+    ULONG               Index;
+    double              Start;
+    double              Elapsed;
+    LONG                Allocated;
+    ULONG               Hit;
+    ULONG               Miss;
+
+    BenchScheme = Scheme;
+    BenchThreads = Threads;
+
+    Start = BenchNow();
+
+    for (Index = 0; Index < Threads; Index++)
+        pthread_create(&Thread[Index], NULL, BenchThread, (void *)(ULONG_PTR)Index);
+
+    for (Index = 0; Index < Threads; Index++)
+        pthread_join(Thread[Index], NULL);
+
+    Elapsed = BenchNow() - Start;
+
+    Allocated = BenchAllocated;
+
+    Hit = Miss = 0;
+    for (Index = 0; Index < BENCH_THREADS_MAX; Index++) {
+        Hit += BenchMagazine.Processor[Index].Hit;
+        Miss += BenchMagazine.Processor[Index].Miss;
+    }
+
+    BenchDrain();
+
+    printf("%-8s %2u threads: %7.1f Mops/s, %6d objects cached",
+           (Scheme == BENCH_SCHEME_STACK) ? "stack" : "magazine",
+           Threads,
+           2.0 * (BENCH_OPERATIONS / BENCH_BATCH / Threads) * BENCH_BATCH * Threads /
+           Elapsed / 1e6,
+           Allocated);
+
+    if (Scheme == BENCH_SCHEME_MAGAZINE)
+        printf(" (Hit = %u Miss = %u)", Hit, Miss);
+
+    printf("\n");
+}
+
+int
+main(
+    IN  int     argc,
+    IN  char    **argv
+    )
+{
+    ULONG       Threads;
+
+    UNREFERENCED_PARAMETER(argc);
+    UNREFERENCED_PARAMETER(argv);
+
+    for (Threads = 1; Threads <= BENCH_THREADS_MAX; Threads *= 2) {
+        BenchRun(BENCH_SCHEME_STACK, Threads);
+        BenchRun(BENCH_SCHEME_MAGAZINE, Threads);
+    }
+
+    return 0;
+}
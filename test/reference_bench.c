@@ -0,0 +1,345 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+//
+// Count the locked operations spent on NBL reference counting per
+// transmitted packet by transmitter.c, and by the scheme it replaced,
+// and time both.
+//
+// The old scheme took a reference around the send loop and one per
+// NET_BUFFER, then each completion did an InterlockedExchange of the
+// status and an InterlockedDecrement. The current scheme stores the
+// NET_BUFFER count up front and each completion does one InterlockedAdd.
+//
+// Completions are made on a second thread, as they would be from the
+// XENVIF completion path, so the reference count cache line moves
+// between the sender and the completer as it does in the driver.
+//
+
+#include <ndis.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#define NDIS_STATUS             LONG
+#define NDIS_STATUS_SUCCESS     ((NDIS_STATUS)0x00000000L)
+#define NDIS_STATUS_PENDING     ((NDIS_STATUS)0x00000103L)
+
+#define BENCH_PACKETS   (1 << 22)
+#define BENCH_RING      256
+
+typedef struct _BENCH_NET_BUFFER_LIST {
+    LONG        Reference;
+    NDIS_STATUS Status;
+    ULONG       Count;
+    ULONG       Completed;
+} __attribute__((aligned(64))) BENCH_NET_BUFFER_LIST, *PBENCH_NET_BUFFER_LIST;
+
+static __thread ULONG64 BenchAtomics;
+
+static FORCEINLINE LONG
+BenchInterlockedIncrement(
+    IN  PLONG   Value
+    )
+{
+    BenchAtomics++;
+    return __atomic_add_fetch(Value, 1, __ATOMIC_SEQ_CST);
+}
+
+static FORCEINLINE LONG
+BenchInterlockedDecrement(
+    IN  PLONG   Value
+    )
+{
+    BenchAtomics++;
+    return __atomic_sub_fetch(Value, 1, __ATOMIC_SEQ_CST);
+}
+
+static FORCEINLINE LONG
+BenchInterlockedAdd(
+    IN  PLONG   Value,
+    IN  LONG    Addend
+    )
+{
+    BenchAtomics++;
+    return __atomic_add_fetch(Value, Addend, __ATOMIC_SEQ_CST);
+}
+
+static FORCEINLINE LONG
+BenchInterlockedExchange(
+    IN  PLONG   Value,
+    IN  LONG    Exchange
+    )
+{
+    BenchAtomics++;
+    return __atomic_exchange_n(Value, Exchange, __ATOMIC_SEQ_CST);
+}
+
+typedef enum _BENCH_SCHEME {
+    BENCH_SCHEME_OLD,
+    BENCH_SCHEME_NEW
+} BENCH_SCHEME;
+
+static BENCH_SCHEME     BenchScheme;
+
+// A single producer, single consumer ring standing in for the VIF
+static PBENCH_NET_BUFFER_LIST   BenchRing[BENCH_RING];
+static ULONG                    BenchProducer __attribute__((aligned(64)));
+static ULONG                    BenchConsumer __attribute__((aligned(64)));
+
+static ULONG64  BenchCompleted;
+static ULONG64  BenchCompleterAtomics;
+
+static VOID
+BenchQueuePacket(
+    IN  PBENCH_NET_BUFFER_LIST  NetBufferList
+    )
+{
+    ULONG                       Producer = BenchProducer;
+
+    while (Producer - __atomic_load_n(&BenchConsumer, __ATOMIC_ACQUIRE) == BENCH_RING)
+        sched_yield();
+
+    BenchRing[Producer % BENCH_RING] = NetBufferList;
+    __atomic_store_n(&BenchProducer, Producer + 1, __ATOMIC_RELEASE);
+}
+
+static VOID
+BenchCompleteNetBufferList(
+    IN  PBENCH_NET_BUFFER_LIST  NetBufferList,
+    IN  NDIS_STATUS             Status
+    )
+{
+    assert(Status == NDIS_STATUS_SUCCESS);
+    assert(NetBufferList->Completed == 0);
+
+    NetBufferList->Completed = 1;
+    BenchCompleted++;
+}
+
+// transmitter.c before NET_BUFFERs were counted up front
+static VOID
+OldGetNetBufferList(
+    IN  PBENCH_NET_BUFFER_LIST  NetBufferList
+    )
+{
+    if (BenchInterlockedIncrement(&NetBufferList->Reference) == 1)
+        NetBufferList->Status = NDIS_STATUS_PENDING;
+}
+
+static VOID
+OldPutNetBufferList(
+    IN  PBENCH_NET_BUFFER_LIST  NetBufferList
+    )
+{
+    if (BenchInterlockedDecrement(&NetBufferList->Reference) == 0)
+        BenchCompleteNetBufferList(NetBufferList, NetBufferList->Status);
+}
+
+static VOID
+OldSendNetBufferList(
+    IN  PBENCH_NET_BUFFER_LIST  NetBufferList
+    )
+{
+    ULONG                       Index;
+
+    NetBufferList->Reference = 0;
+
+    OldGetNetBufferList(NetBufferList);
+
+    for (Index = 0; Index < NetBufferList->Count; Index++) {
+        OldGetNetBufferList(NetBufferList);
+        BenchQueuePacket(NetBufferList);
+    }
+
+    OldPutNetBufferList(NetBufferList);
+}
+
+static VOID
+OldReturnPacket(
+    IN  PBENCH_NET_BUFFER_LIST  NetBufferList,
+    IN  NDIS_STATUS             Status
+    )
+{
+    (VOID) BenchInterlockedExchange(&NetBufferList->Status, Status);
+    OldPutNetBufferList(NetBufferList);
+}
+
+// transmitter.c now
+static VOID
+NewSendNetBufferList(
+    IN  PBENCH_NET_BUFFER_LIST  NetBufferList
+    )
+{
+    ULONG                       Count = NetBufferList->Count;
+    ULONG                       Index;
+
+    NetBufferList->Reference = (LONG)Count;
+    NetBufferList->Status = NDIS_STATUS_SUCCESS;
+
+    for (Index = 0; Index < Count; Index++)
+        BenchQueuePacket(NetBufferList);
+}
+
+static VOID
+NewReturnPacket(
+    IN  PBENCH_NET_BUFFER_LIST  NetBufferList,
+    IN  NDIS_STATUS             Status
+    )
+{
+    if (Status != NDIS_STATUS_SUCCESS)
+        NetBufferList->Status = Status;
+
+    if (BenchInterlockedAdd(&NetBufferList->Reference, -1) == 0)
+        BenchCompleteNetBufferList(NetBufferList, NetBufferList->Status);
+}
+
+static void *
+BenchCompleter(
+    IN  void    *Argument
+    )
+{
+    ULONG       Packets = (ULONG)(ULONG_PTR)Argument;
+    ULONG       Consumer = 0;
+
+    while (Consumer != Packets) {
+        PBENCH_NET_BUFFER_LIST  NetBufferList;
+
+        while (__atomic_load_n(&BenchProducer, __ATOMIC_ACQUIRE) == Consumer)
+            sched_yield();
+
+        NetBufferList = BenchRing[Consumer % BENCH_RING];
+
+        if (BenchScheme == BENCH_SCHEME_OLD)
+            OldReturnPacket(NetBufferList, NDIS_STATUS_SUCCESS);
+        else
+            NewReturnPacket(NetBufferList, NDIS_STATUS_SUCCESS);
+
+        __atomic_store_n(&BenchConsumer, ++Consumer, __ATOMIC_RELEASE);
+    }
+
+    BenchCompleterAtomics = BenchAtomics;
+
+    return NULL;
+}
+
+static double
+BenchNow(
+    VOID
+    )
+{
+    struct timespec Now;
+
+    clock_gettime(CLOCK_MONOTONIC, &Now);
+    return (double)Now.tv_sec + (double)Now.tv_nsec / 1e9;
+}
+
+static VOID
+BenchRun(
+    IN  BENCH_SCHEME    Scheme,
+    IN  ULONG           NetBuffers
+    )
+{
+    ULONG               Lists = BENCH_PACKETS / NetBuffers;
+    ULONG               Packets = Lists * NetBuffers;
+    PBENCH_NET_BUFFER_LIST  NetBufferList;
+    pthread_t           Thread;
+    ULONG               Index;
+    double              Start;
+    double              Elapsed;
+    ULONG64             Atomics;
+
+    // Enough NBLs that none is reused while it is still outstanding
+    NetBufferList = calloc(Lists, sizeof (BENCH_NET_BUFFER_LIST));
+    if (NetBufferList == NULL)
+        abort();
+
+    for (Index = 0; Index < Lists; Index++)
+        NetBufferList[Index].Count = NetBuffers;
+
+    BenchScheme = Scheme;
+    BenchProducer = BenchConsumer = 0;
+    BenchCompleted = 0;
+    BenchAtomics = 0;
+
+    Start = BenchNow();
+
+    pthread_create(&Thread, NULL, BenchCompleter, (void *)(ULONG_PTR)Packets);
+
+    for (Index = 0; Index < Lists; Index++) {
+        if (Scheme == BENCH_SCHEME_OLD)
+            OldSendNetBufferList(&NetBufferList[Index]);
+        else
+            NewSendNetBufferList(&NetBufferList[Index]);
+    }
+
+    pthread_join(Thread, NULL);
+
+    Elapsed = BenchNow() - Start;
+
+    if (BenchCompleted != Lists) {
+        fprintf(stderr, "%llu of %u NBLs completed\n",
+                (unsigned long long)BenchCompleted, Lists);
+        abort();
+    }
+
+    Atomics = BenchAtomics + BenchCompleterAtomics;
+
+    printf("%-3s %2u NBs/NBL: %5.2f atomics/packet (send %5.2f complete %5.2f) %6.1f ns/packet\n",
+           (Scheme == BENCH_SCHEME_OLD) ? "old" : "new",
+           NetBuffers,
+           (double)Atomics / Packets,
+           (double)BenchAtomics / Packets,
+           (double)BenchCompleterAtomics / Packets,
+           Elapsed * 1e9 / Packets);
+
+    free(NetBufferList);
+}
+
+int
+main(
+    IN  int     argc,
+    IN  char    **argv
+    )
+{
+    static const ULONG  NetBuffers[] = { 1, 2, 4, 16, 64 };
+    ULONG               Index;
+
+    UNREFERENCED_PARAMETER(argc);
+    UNREFERENCED_PARAMETER(argv);
+
+    for (Index = 0; Index < ARRAYSIZE(NetBuffers); Index++) {
+        BenchRun(BENCH_SCHEME_OLD, NetBuffers[Index]);
+        BenchRun(BENCH_SCHEME_NEW, NetBuffers[Index]);
+    }
+
+    return 0;
+}
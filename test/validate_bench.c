@@ -0,0 +1,358 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+//
+// Cost of the receive checksum validation done for packets that the
+// backend has not validated, per protocol and frame size. The work
+// mirrors __ReceiverValidateChecksums(): the IPv4 header checksum, then
+// the pseudo header plus ChecksumAccumulateMdl() over the transport
+// header and payload. For comparison, the same frames are validated
+// with a plain RFC 1071 loop, as a generic software path would.
+//
+
+#include <ndis.h>
+#include <tcpip.h>
+#include <time.h>
+
+#include "checksum.h"
+
+#define BENCH_PACKETS   4000000
+
+#define BENCH_ETHERNET_HEADER_LENGTH    14
+
+typedef struct _BENCH_FRAME {
+    UCHAR   Data[2048];
+    ULONG   Length;
+    ULONG   IpOffset;
+    ULONG   L4Offset;
+    ULONG   Version;
+    UCHAR   Protocol;
+    MDL     Mdl;
+} BENCH_FRAME, *PBENCH_FRAME;
+
+typedef struct _BENCH_COUNTERS {
+    ULONG   IpChecksumsValidated;
+    ULONG   TcpChecksumsValidated;
+    ULONG   UdpChecksumsValidated;
+    ULONG   ChecksumsFailed;
+} BENCH_COUNTERS, *PBENCH_COUNTERS;
+
+static double
+BenchNow(
+    VOID
+    )
+{
+    struct timespec Now;
+
+    clock_gettime(CLOCK_MONOTONIC, &Now);
+    return (double)Now.tv_sec + (double)Now.tv_nsec / 1e9;
+}
+
+static ULONG
+BenchReference(
+    IN  const UCHAR *Data,
+    IN  ULONG       Length,
+    IN  ULONG       Sum
+    )
+{
+    ULONG64         Accumulator = Sum;
+    ULONG           Index;
+
+    for (Index = 0; Index + 1 < Length; Index += 2)
+        Accumulator += (ULONG)Data[Index] | ((ULONG)Data[Index + 1] << 8);
+
+    if (Length & 1)
+        Accumulator += Data[Length - 1];
+
+    while (Accumulator >> 16)
+        Accumulator = (Accumulator & 0xFFFF) + (Accumulator >> 16);
+
+    return (ULONG)Accumulator;
+}
+
+// Build a frame with correct checksums
+static VOID
+BenchBuildFrame(
+    OUT PBENCH_FRAME    Frame,
+    IN  ULONG           Version,
+    IN  UCHAR           Protocol,
+    IN  ULONG           Length
+    )
+{
+    PUCHAR              Data = Frame->Data;
+    ULONG               IpHeaderLength;
+    ULONG               PayloadLength;
+    ULONG               Sum;
+    PUSHORT             Checksum;
+    ULONG               Index;
+
+    memset(Frame, 0, sizeof (*Frame));
+
+    for (Index = 0; Index < Length; Index++)
+        Data[Index] = (UCHAR)rand();
+
+    Frame->Length = Length;
+    Frame->IpOffset = BENCH_ETHERNET_HEADER_LENGTH;
+    Frame->Version = Version;
+    Frame->Protocol = Protocol;
+
+    IpHeaderLength = (Version == 4) ? sizeof (IPV4_HEADER) : sizeof (IPV6_HEADER);
+    Frame->L4Offset = Frame->IpOffset + IpHeaderLength;
+    PayloadLength = Length - Frame->L4Offset;
+
+    if (Version == 4) {
+        PIPV4_HEADER    Version4 = (PIPV4_HEADER)(Data + Frame->IpOffset);
+
+        Version4->Version = 4;
+        Version4->HeaderLength = sizeof (IPV4_HEADER) / 4;
+        Version4->PacketLength = HTONS((USHORT)(IpHeaderLength + PayloadLength));
+        Version4->FragmentOffsetAndFlags = 0;
+        Version4->Protocol = Protocol;
+        Version4->Checksum = 0;
+        Version4->Checksum = (USHORT)~ChecksumAccumulate(Version4, IpHeaderLength, 0);
+
+        Sum = ChecksumPseudoHeader(&Version4->SourceAddress,
+                                   &Version4->DestinationAddress,
+                                   IPV4_ADDRESS_LENGTH,
+                                   Protocol,
+                                   PayloadLength);
+    } else {
+        PIPV6_HEADER    Version6 = (PIPV6_HEADER)(Data + Frame->IpOffset);
+
+        Version6->VCF = 0;
+        Version6->Version = 6;
+        Version6->PayloadLength = HTONS((USHORT)PayloadLength);
+        Version6->NextHeader = Protocol;
+
+        Sum = ChecksumPseudoHeader(&Version6->SourceAddress,
+                                   &Version6->DestinationAddress,
+                                   IPV6_ADDRESS_LENGTH,
+                                   Protocol,
+                                   PayloadLength);
+    }
+
+    if (Protocol == IPPROTO_TCP) {
+        PTCP_HEADER TcpHeader = (PTCP_HEADER)(Data + Frame->L4Offset);
+
+        TcpHeader->HeaderLength = sizeof (TCP_HEADER) / 4;
+        Checksum = &TcpHeader->Checksum;
+    } else {
+        PUDP_HEADER UdpHeader = (PUDP_HEADER)(Data + Frame->L4Offset);
+
+        UdpHeader->PacketLength = HTONS((USHORT)PayloadLength);
+        Checksum = &UdpHeader->Checksum;
+    }
+
+    *Checksum = 0;
+    Sum = ChecksumCombine(Sum,
+                          ChecksumAccumulate(Data + Frame->L4Offset, PayloadLength, 0),
+                          FALSE);
+    *Checksum = (USHORT)~Sum;
+    if (*Checksum == 0)
+        *Checksum = 0xFFFF;
+
+    Frame->Mdl.Next = NULL;
+    Frame->Mdl.ByteCount = Length;
+    Frame->Mdl.MappedSystemVa = Data;
+}
+
+static FORCEINLINE VOID
+BenchCount(
+    IN  PBENCH_COUNTERS Counters,
+    IN  UCHAR           Protocol,
+    IN  ULONG           Sum
+    )
+{
+    if (Sum != 0xFFFF)
+        Counters->ChecksumsFailed++;
+    else if (Protocol == IPPROTO_TCP)
+        Counters->TcpChecksumsValidated++;
+    else
+        Counters->UdpChecksumsValidated++;
+}
+
+static VOID
+BenchValidate(
+    IN  PBENCH_FRAME    Frame,
+    IN  PBENCH_COUNTERS Counters
+    )
+{
+    PUCHAR              Data = Frame->Data;
+    ULONG               PayloadLength;
+    ULONG               Sum;
+
+    if (Frame->Version == 4) {
+        PIPV4_HEADER    Version4 = (PIPV4_HEADER)(Data + Frame->IpOffset);
+        ULONG           HeaderLength = IPV4_HEADER_LENGTH(Version4);
+
+        if (ChecksumAccumulate(Version4, HeaderLength, 0) == 0xFFFF)
+            Counters->IpChecksumsValidated++;
+        else
+            Counters->ChecksumsFailed++;
+
+        PayloadLength = NTOHS(Version4->PacketLength) - HeaderLength;
+        Sum = ChecksumPseudoHeader(&Version4->SourceAddress,
+                                   &Version4->DestinationAddress,
+                                   IPV4_ADDRESS_LENGTH,
+                                   Version4->Protocol,
+                                   PayloadLength);
+    } else {
+        PIPV6_HEADER    Version6 = (PIPV6_HEADER)(Data + Frame->IpOffset);
+
+        PayloadLength = NTOHS(Version6->PayloadLength);
+        Sum = ChecksumPseudoHeader(&Version6->SourceAddress,
+                                   &Version6->DestinationAddress,
+                                   IPV6_ADDRESS_LENGTH,
+                                   Frame->Protocol,
+                                   PayloadLength);
+    }
+
+    (VOID) ChecksumAccumulateMdl(&Frame->Mdl, Frame->L4Offset, PayloadLength, &Sum);
+
+    BenchCount(Counters, Frame->Protocol, Sum);
+}
+
+static VOID
+BenchValidateReference(
+    IN  PBENCH_FRAME    Frame,
+    IN  PBENCH_COUNTERS Counters
+    )
+{
+    PUCHAR              Data = Frame->Data;
+    ULONG               PayloadLength;
+    UCHAR               Pseudo[40];
+    ULONG               AddressLength;
+    ULONG               Size;
+    ULONG               Sum;
+
+    if (Frame->Version == 4) {
+        PIPV4_HEADER    Version4 = (PIPV4_HEADER)(Data + Frame->IpOffset);
+        ULONG           HeaderLength = IPV4_HEADER_LENGTH(Version4);
+
+        if (BenchReference((PUCHAR)Version4, HeaderLength, 0) == 0xFFFF)
+            Counters->IpChecksumsValidated++;
+        else
+            Counters->ChecksumsFailed++;
+
+        PayloadLength = NTOHS(Version4->PacketLength) - HeaderLength;
+        AddressLength = IPV4_ADDRESS_LENGTH;
+        memcpy(Pseudo, &Version4->SourceAddress, 2 * AddressLength);
+    } else {
+        PIPV6_HEADER    Version6 = (PIPV6_HEADER)(Data + Frame->IpOffset);
+
+        PayloadLength = NTOHS(Version6->PayloadLength);
+        AddressLength = IPV6_ADDRESS_LENGTH;
+        memcpy(Pseudo, &Version6->SourceAddress, 2 * AddressLength);
+    }
+
+    Size = 2 * AddressLength;
+    Pseudo[Size++] = 0;
+    Pseudo[Size++] = Frame->Protocol;
+    Pseudo[Size++] = (UCHAR)(PayloadLength >> 8);
+    Pseudo[Size++] = (UCHAR)PayloadLength;
+
+    Sum = BenchReference(Pseudo, Size, 0);
+    Sum = BenchReference(Data + Frame->L4Offset, PayloadLength, Sum);
+
+    BenchCount(Counters, Frame->Protocol, Sum);
+}
+
+static VOID
+BenchRun(
+    IN  const CHAR  *Name,
+    IN  ULONG       Version,
+    IN  UCHAR       Protocol,
+    IN  ULONG       Length
+    )
+{
+    static BENCH_FRAME  Frame[64];
+    BENCH_COUNTERS      Counters;
+    ULONG               Index;
+    double              Start;
+    double              Validate;
+    double              Reference;
+
+    for (Index = 0; Index < ARRAYSIZE(Frame); Index++)
+        BenchBuildFrame(&Frame[Index], Version, Protocol, Length);
+
+    memset(&Counters, 0, sizeof (Counters));
+    Start = BenchNow();
+    for (Index = 0; Index < BENCH_PACKETS; Index++)
+        BenchValidate(&Frame[Index % ARRAYSIZE(Frame)], &Counters);
+    Validate = BenchNow() - Start;
+
+    if (Counters.ChecksumsFailed != 0) {
+        fprintf(stderr, "%s: %u checksums failed\n", Name, Counters.ChecksumsFailed);
+        exit(1);
+    }
+
+    printf("%s %4u bytes: %6.1f Mpps (IP = %u TCP = %u UDP = %u)",
+           Name,
+           Length,
+           BENCH_PACKETS / Validate / 1e6,
+           Counters.IpChecksumsValidated,
+           Counters.TcpChecksumsValidated,
+           Counters.UdpChecksumsValidated);
+
+    memset(&Counters, 0, sizeof (Counters));
+    Start = BenchNow();
+    for (Index = 0; Index < BENCH_PACKETS; Index++)
+        BenchValidateReference(&Frame[Index % ARRAYSIZE(Frame)], &Counters);
+    Reference = BenchNow() - Start;
+
+    printf(" reference %6.1f Mpps (%.1fx)\n",
+           BENCH_PACKETS / Reference / 1e6,
+           Reference / Validate);
+}
+
+int
+main(
+    IN  int     argc,
+    IN  char    **argv
+    )
+{
+    static const ULONG  Length[] = { 128, 576, 1514 };
+    ULONG               Index;
+
+    UNREFERENCED_PARAMETER(argc);
+    UNREFERENCED_PARAMETER(argv);
+
+    srand(1);
+
+    for (Index = 0; Index < ARRAYSIZE(Length); Index++) {
+        BenchRun("TCPv4", 4, IPPROTO_TCP, Length[Index]);
+        BenchRun("UDPv4", 4, IPPROTO_UDP, Length[Index]);
+        BenchRun("TCPv6", 6, IPPROTO_TCP, Length[Index]);
+        BenchRun("UDPv6", 6, IPPROTO_UDP, Length[Index]);
+    }
+
+    return 0;
+}